@@ -2,6 +2,8 @@
    for more information.
    $Id$  */
 #include "smysql.hh"
+#include <errmsg.h>
+#include <mysqld_error.h>
 #include <string>
 #include <iostream>
 #include "pdns/misc.hh"
@@ -43,6 +45,7 @@ SMySQL::SMySQL(const string &database, const string &host, uint16_t port, const
     }
 
     d_rres=0;
+    d_pstmt=0;
   }
 }
 
@@ -53,6 +56,9 @@ void SMySQL::setLog(bool state)
 
 SMySQL::~SMySQL()
 {
+  for(vector<Statement>::iterator i=d_prepared.begin(); i!=d_prepared.end(); ++i)
+    if(i->stmt)
+      mysql_stmt_close(i->stmt);
   mysql_close(&d_db);
 }
 
@@ -68,7 +74,7 @@ int SMySQL::doCommand(const string &query)
 
 int SMySQL::doQuery(const string &query)
 {
-  if(d_rres)
+  if(d_rres || d_pstmt)
     throw SSqlException("Attempt to start new MySQL query while old one still in progress");
 
   if(s_dolog)
@@ -96,16 +102,20 @@ int SMySQL::doQuery(const string &query, result_t &result)
 
 bool SMySQL::getRow(row_t &row)
 {
-  row.clear();
+  return copyRow(row);
+}
+
+bool SMySQL::nextRow()
+{
+  if(d_pstmt)
+    return nextStatementRow();
+
   if(!d_rres) 
     if(!(d_rres = mysql_use_result(&d_db)))
       throw sPerrorException("Failed on mysql_use_result");
 
-  MYSQL_ROW rrow;
-
-  if((rrow = mysql_fetch_row(d_rres))) {
-    for(unsigned int i=0;i<mysql_num_fields(d_rres);i++)
-      row.push_back(rrow[i] ?: "");
+  if((d_rrow = mysql_fetch_row(d_rres))) {
+    d_rrowlengths = mysql_fetch_lengths(d_rres);
     return true;
   }
   mysql_free_result(d_rres);  
@@ -120,6 +130,136 @@ bool SMySQL::getRow(row_t &row)
   return false;
 }
 
+unsigned int SMySQL::getFieldCount()
+{
+  return d_pstmt ? d_rbinds.size() : mysql_num_fields(d_rres);
+}
+
+SSqlField SMySQL::getField(unsigned int n)
+{
+  if(d_pstmt)
+    return SSqlField(d_rbuffers[n].data(), d_rlengths[n]);
+  if(!d_rrow[n])
+    return SSqlField();
+  return SSqlField(d_rrow[n], d_rrowlengths[n]);
+}
+
+void SMySQL::prepareStatement(Statement &statement)
+{
+  if(!(statement.stmt=mysql_stmt_init(&d_db)))
+    throw sPerrorException("Failed on mysql_stmt_init");
+  if(mysql_stmt_prepare(statement.stmt, statement.query.c_str(), statement.query.size())) {
+    string error=mysql_stmt_error(statement.stmt);
+    mysql_stmt_close(statement.stmt);
+    statement.stmt=0;
+    throw SSqlException("Unable to prepare '"+statement.query+"': "+error);
+  }
+}
+
+int SMySQL::prepare(const string &query, int nparams)
+{
+  Statement statement;
+  statement.query=query;
+  prepareStatement(statement);
+  if(mysql_stmt_param_count(statement.stmt) != (unsigned long)nparams) {
+    mysql_stmt_close(statement.stmt);
+    throw SSqlException("Prepared query '"+query+"' does not have "+itoa(nparams)+" parameters");
+  }
+  d_prepared.push_back(statement);
+  return d_prepared.size()-1;
+}
+
+/* the whole result is fetched with mysql_stmt_store_result(), so the connection is free again once this returns.
+   A reconnect throws away all prepared statements, we notice that here and prepare again */
+void SMySQL::execute(int statement, const vector<string> &params)
+{
+  if(d_rres || d_pstmt)
+    throw SSqlException("Attempt to start new MySQL query while old one still in progress");
+
+  Statement& prepared=d_prepared.at(statement);
+  if(s_dolog)
+    L<<Logger::Warning<<"Prepared query: "<<prepared.query<<endl;
+
+  vector<MYSQL_BIND> binds(params.size());
+  vector<unsigned long> lengths(params.size());
+  if(!binds.empty())
+    memset(&binds[0], 0, binds.size()*sizeof(MYSQL_BIND));
+  for(vector<string>::size_type n=0; n < params.size(); ++n) {
+    binds[n].buffer_type=MYSQL_TYPE_STRING;
+    binds[n].buffer=(void*)params[n].c_str();
+    binds[n].buffer_length=lengths[n]=params[n].size();
+    binds[n].length=&lengths[n];
+  }
+
+  for(bool first=true;;first=false) {
+    if(!prepared.stmt)
+      prepareStatement(prepared);
+    if(!mysql_stmt_bind_param(prepared.stmt, binds.empty() ? 0 : &binds[0]) && !mysql_stmt_execute(prepared.stmt))
+      break;
+
+    unsigned int err=mysql_stmt_errno(prepared.stmt);
+    if(!first || (err!=CR_SERVER_GONE_ERROR && err!=CR_SERVER_LOST && err!=ER_UNKNOWN_STMT_HANDLER))
+      throw SSqlException("Failed to execute prepared statement, perhaps connection died? Err="+itoa(err)+": "+mysql_stmt_error(prepared.stmt));
+    mysql_stmt_close(prepared.stmt);
+    prepared.stmt=0;
+  }
+
+  if(mysql_stmt_store_result(prepared.stmt))
+    throw SSqlException("Failed on mysql_stmt_store_result: "+string(mysql_stmt_error(prepared.stmt)));
+
+  unsigned int fields=mysql_stmt_field_count(prepared.stmt);
+  d_rbinds.resize(fields);
+  d_rlengths.resize(fields);
+  d_rnulls.resize(fields);
+  d_rbuffers.resize(fields);
+  if(fields)
+    memset(&d_rbinds[0], 0, fields*sizeof(MYSQL_BIND));
+  for(unsigned int i=0; i < fields; ++i) {
+    d_rbuffers[i].resize(256);
+    d_rbinds[i].buffer_type=MYSQL_TYPE_STRING;
+    d_rbinds[i].buffer=&d_rbuffers[i][0];
+    d_rbinds[i].buffer_length=d_rbuffers[i].size();
+    d_rbinds[i].length=&d_rlengths[i];
+    d_rbinds[i].is_null=&d_rnulls[i];
+  }
+  if(fields && mysql_stmt_bind_result(prepared.stmt, &d_rbinds[0])) {
+    mysql_stmt_free_result(prepared.stmt);
+    throw SSqlException("Failed on mysql_stmt_bind_result: "+string(mysql_stmt_error(prepared.stmt)));
+  }
+  d_pstmt=prepared.stmt;
+}
+
+bool SMySQL::nextStatementRow()
+{
+  int ret=mysql_stmt_field_count(d_pstmt) ? mysql_stmt_fetch(d_pstmt) : MYSQL_NO_DATA;
+  if(ret==MYSQL_NO_DATA || ret==1) {
+    string error=ret==1 ? mysql_stmt_error(d_pstmt) : "";
+    mysql_stmt_free_result(d_pstmt);
+    d_pstmt=0;
+    if(!error.empty())
+      throw SSqlException("Failed on mysql_stmt_fetch: "+error);
+    return false;
+  }
+
+  bool rebind=false;
+  for(unsigned int i=0; i < d_rbinds.size(); ++i) {
+    if(d_rnulls[i])
+      d_rlengths[i]=0;
+    else if(d_rlengths[i] >= d_rbinds[i].buffer_length) { // MYSQL_DATA_TRUNCATED, grow the buffer and go back for the rest
+      d_rbuffers[i].resize(d_rlengths[i]+1);
+      d_rbinds[i].buffer=&d_rbuffers[i][0];
+      d_rbinds[i].buffer_length=d_rbuffers[i].size();
+      if(mysql_stmt_fetch_column(d_pstmt, &d_rbinds[i], i, 0))
+        throw SSqlException("Failed on mysql_stmt_fetch_column: "+string(mysql_stmt_error(d_pstmt)));
+      rebind=true;
+    }
+    d_rbuffers[i][d_rlengths[i]]=0;
+  }
+  if(rebind && mysql_stmt_bind_result(d_pstmt, &d_rbinds[0]))
+    throw SSqlException("Failed on mysql_stmt_bind_result: "+string(mysql_stmt_error(d_pstmt)));
+  return true;
+}
+
 string SMySQL::escape(const string &name)
 {
   string a;
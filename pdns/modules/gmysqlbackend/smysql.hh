@@ -22,11 +22,32 @@ public:
   int doQuery(const string &query);
   int doCommand(const string &query);
   bool getRow(row_t &row);
+  bool nextRow();
+  unsigned int getFieldCount();
+  SSqlField getField(unsigned int n);
   string escape(const string &str);    
+  int prepare(const string &query, int nparams);
+  void execute(int statement, const vector<string> &params);
   void setLog(bool state);
 private:
+  struct Statement
+  {
+    string query;
+    MYSQL_STMT *stmt;
+  };
+  void prepareStatement(Statement &statement);
+  bool nextStatementRow();
+
   MYSQL d_db;
   MYSQL_RES *d_rres;
+  MYSQL_ROW d_rrow;
+  unsigned long *d_rrowlengths;
+  vector<Statement> d_prepared;
+  MYSQL_STMT *d_pstmt; //!< prepared statement whose rows getRow() is returning
+  vector<MYSQL_BIND> d_rbinds;
+  vector<unsigned long> d_rlengths;
+  vector<my_bool> d_rnulls;
+  vector<string> d_rbuffers;
   static bool s_dolog;
   static pthread_mutex_t s_myinitlock;
 };
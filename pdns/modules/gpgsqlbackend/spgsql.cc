@@ -5,6 +5,7 @@
 
 #include <iostream>
 #include "pdns/logger.hh"
+#include "pdns/misc.hh"
 #include "pdns/dns.hh"
 #include "pdns/namespaces.hh"
 
@@ -68,6 +69,76 @@ void SPgSQL::ensureConnect()
       throw;
     }
   }
+
+  // prepared statements live in the connection, so a new connection needs them all again
+  for(vector<pair<string, int> >::size_type n=0; n < d_prepared.size(); ++n)
+    prepareStatement(n);
+}
+
+void SPgSQL::prepareStatement(int statement)
+{
+  PGresult* res=PQprepare(d_db, ("pdns_"+itoa(statement)).c_str(), d_prepared[statement].first.c_str(), d_prepared[statement].second, 0);
+  if(!res || PQresultStatus(res)!=PGRES_COMMAND_OK) {
+    string error(res ? PQresultErrorMessage(res) : "unknown reason");
+    if(res)
+      PQclear(res);
+    throw SSqlException("PostgreSQL failed to prepare '"+d_prepared[statement].first+"': "+error);
+  }
+  PQclear(res);
+}
+
+int SPgSQL::prepare(const string &query, int nparams)
+{
+  string pgquery;
+  int param=0;
+  for(string::const_iterator i=query.begin(); i!=query.end(); ++i) {
+    if(*i=='?')
+      pgquery+="$"+itoa(++param);
+    else
+      pgquery+=*i;
+  }
+
+  d_prepared.push_back(make_pair(pgquery, nparams));
+  try {
+    prepareStatement(d_prepared.size()-1);
+  }
+  catch(...) {
+    d_prepared.pop_back();
+    throw;
+  }
+  return d_prepared.size()-1;
+}
+
+void SPgSQL::execute(int statement, const vector<string> &params)
+{
+  if(s_dolog)
+    L<<Logger::Warning<<"Prepared query: "<<d_prepared.at(statement).first<<endl;
+
+  vector<const char*> values;
+  for(vector<string>::const_iterator i=params.begin(); i!=params.end(); ++i)
+    values.push_back(i->c_str());
+
+  bool first = true;
+retry:
+  d_result=PQexecPrepared(d_db, ("pdns_"+itoa(statement)).c_str(), values.size(), values.empty() ? 0 : &values[0], 0, 0, 0);
+  if(!d_result || (PQresultStatus(d_result)!=PGRES_TUPLES_OK && PQresultStatus(d_result)!=PGRES_COMMAND_OK)) {
+    string error("unknown reason");
+    if(d_result) {
+      error=PQresultErrorMessage(d_result);
+      PQclear(d_result);
+    }
+    if(PQstatus(d_db)==CONNECTION_BAD) {
+      ensureConnect();
+      if(first) {
+        first = false;
+        goto retry;
+      }
+    }
+
+    throw SSqlException("PostgreSQL failed to execute prepared statement: "+error); 
+  }
+
+  d_count=0;
 }
 
 int SPgSQL::doCommand(const string &query)
@@ -157,19 +228,30 @@ int SPgSQL::doQuery(const string &query, result_t &result)
 
 bool SPgSQL::getRow(row_t &row)
 {
-  row.clear();
+  return copyRow(row);
+}
 
+bool SPgSQL::nextRow()
+{
   if(d_count >= PQntuples(d_result)) {
     PQclear(d_result);
+    d_result=0;
     return false;
   }
-  
-  for(int i=0;i<PQnfields(d_result);i++)
-    row.push_back(PQgetvalue(d_result,d_count,i) ?: "");
   d_count++;
   return true;
 }
 
+unsigned int SPgSQL::getFieldCount()
+{
+  return PQnfields(d_result);
+}
+
+SSqlField SPgSQL::getField(unsigned int n)
+{
+  return SSqlField(PQgetvalue(d_result, d_count-1, n), PQgetlength(d_result, d_count-1, n));
+}
+
 string SPgSQL::escape(const string &name)
 {
   string a;
@@ -20,10 +20,17 @@ public:
   int doQuery(const string &query);
   int doCommand(const string &query);
   bool getRow(row_t &row);
+  bool nextRow();
+  unsigned int getFieldCount();
+  SSqlField getField(unsigned int n);
   string escape(const string &str);    
+  int prepare(const string &query, int nparams);
+  void execute(int statement, const vector<string> &params);
   void setLog(bool state);
 private:
   void ensureConnect();
+  void prepareStatement(int statement);
+  vector<pair<string, int> > d_prepared; //!< query with $n placeholders, number of parameters
   PGconn* d_db; 
   string d_connectstr;
   string d_connectlogstr;
@@ -0,0 +1,56 @@
+#include "arena.hh"
+#include <inttypes.h>
+
+__thread uint64_t t_arenaAllocations, t_arenaHeapAllocations;
+
+namespace {
+  const unsigned int s_maxSpareChunks=16;
+  __thread void* t_spareChunks[s_maxSpareChunks];
+  __thread unsigned int t_numSpareChunks;
+}
+
+//! chunks bigger than what one allocation leaves of a standard chunk get one of their own, we go on with the current one
+void* MonotonicArena::allocateSlow(size_t n)
+{
+  if(n > s_chunkSize - s_header) {
+    t_arenaHeapAllocations++;
+    Chunk* big=(Chunk*)new char[s_header + n];
+    big->d_size=s_header + n;
+    if(d_chunk) {
+      big->d_next=d_chunk->d_next;
+      d_chunk->d_next=big;
+    }
+    else {
+      big->d_next=0;
+      d_chunk=big;
+    }
+    return (char*)big + s_header;
+  }
+
+  Chunk* chunk;
+  if(t_numSpareChunks)
+    chunk=(Chunk*)t_spareChunks[--t_numSpareChunks];
+  else {
+    t_arenaHeapAllocations++;
+    chunk=(Chunk*)new char[s_chunkSize];
+  }
+  chunk->d_size=s_chunkSize;
+  chunk->d_next=d_chunk;
+  d_chunk=chunk;
+  d_pos=(char*)chunk + s_header + n;
+  d_end=(char*)chunk + s_chunkSize;
+  return (char*)chunk + s_header;
+}
+
+void MonotonicArena::release()
+{
+  while(d_chunk) {
+    Chunk* next=d_chunk->d_next;
+    if(d_chunk->d_size == s_chunkSize && t_numSpareChunks < s_maxSpareChunks)
+      t_spareChunks[t_numSpareChunks++]=d_chunk;
+    else
+      delete[] (char*)d_chunk;
+    d_chunk=next;
+  }
+  d_pos=d_end=0;
+}
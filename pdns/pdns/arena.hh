@@ -0,0 +1,144 @@
+#ifndef PDNS_ARENA_HH
+#define PDNS_ARENA_HH
+#include <stddef.h>
+#include <inttypes.h>
+#include <new>
+#include <boost/utility.hpp>
+
+/* A monotonic arena: allocations are carved off a chunk in sequence, and never given back one by one. Everything
+   goes in one shot when the arena is released or destroyed. This fits the bookkeeping of a single resolution,
+   which builds lots of small sets that all die at the end of the query.
+
+   Released chunks of the standard size are kept in a small per-thread stash, so in steady state a query does not
+   go to the heap for its arena at all. An arena must be released in the thread it allocated from. */
+
+//! allocations the arenas of the calling thread served, and how often they had to go to the heap for a chunk themselves
+extern __thread uint64_t t_arenaAllocations, t_arenaHeapAllocations;
+
+class MonotonicArena : public boost::noncopyable
+{
+public:
+  MonotonicArena() : d_chunk(0), d_pos(0), d_end(0)
+  {}
+
+  ~MonotonicArena()
+  {
+    release();
+  }
+
+  void* allocate(size_t n)
+  {
+    t_arenaAllocations++;
+    n=(n + s_align - 1) & ~(s_align - 1);
+    if(n > (size_t)(d_end - d_pos))
+      return allocateSlow(n);
+    void* ret=d_pos;
+    d_pos+=n;
+    return ret;
+  }
+
+  //! frees all that was allocated from this arena, which may be reused afterwards
+  void release();
+
+private:
+  struct Chunk
+  {
+    Chunk* d_next;
+    size_t d_size;
+  };
+  static const size_t s_align=2*sizeof(void*);
+  static const size_t s_chunkSize=8192;
+  static const size_t s_header=(sizeof(Chunk) + s_align - 1) & ~(s_align - 1);
+
+  void* allocateSlow(size_t n);
+
+  Chunk* d_chunk;
+  char* d_pos;
+  char* d_end;
+};
+
+/* STL allocator drawing from a MonotonicArena. Containers keep the allocator they were constructed with, and pass
+   it on to their copies. Without an arena, for example in a default constructed container, it uses the heap. */
+template<typename T>
+class ArenaAllocator
+{
+public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template<typename U> struct rebind
+  {
+    typedef ArenaAllocator<U> other;
+  };
+
+  ArenaAllocator(MonotonicArena* arena=0) : d_arena(arena)
+  {}
+
+  template<typename U> ArenaAllocator(const ArenaAllocator<U>& rhs) : d_arena(rhs.getArena())
+  {}
+
+  pointer address(reference x) const
+  {
+    return &x;
+  }
+
+  const_pointer address(const_reference x) const
+  {
+    return &x;
+  }
+
+  pointer allocate(size_type n, const void* hint=0)
+  {
+    if(d_arena)
+      return (pointer)d_arena->allocate(n*sizeof(T));
+    return (pointer)::operator new(n*sizeof(T));
+  }
+
+  void deallocate(pointer p, size_type n)
+  {
+    if(!d_arena)
+      ::operator delete(p);
+  }
+
+  size_type max_size() const
+  {
+    return ((size_type)-1)/sizeof(T);
+  }
+
+  void construct(pointer p, const T& val)
+  {
+    new((void*)p) T(val);
+  }
+
+  void destroy(pointer p)
+  {
+    p->~T();
+  }
+
+  MonotonicArena* getArena() const
+  {
+    return d_arena;
+  }
+
+private:
+  MonotonicArena* d_arena;
+};
+
+template<typename T, typename U>
+inline bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+  return a.getArena() == b.getArena();
+}
+
+template<typename T, typename U>
+inline bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+  return a.getArena() != b.getArena();
+}
+
+#endif
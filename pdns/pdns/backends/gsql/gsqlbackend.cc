@@ -348,25 +348,32 @@ bool GSQLBackend::getBeforeAndAfterNamesAbsolute(uint32_t id, const std::string&
   SSql::row_t row;
 
   char output[1024];
+  vector<string> idparam(1, uitoa(id)), nameparams;
+  nameparams.push_back(lcqname);
+  nameparams.push_back(uitoa(id));
 
-  snprintf(output, sizeof(output)-1, d_afterOrderQuery.c_str(), sqlEscape(lcqname).c_str(), id);
-  
-  d_db->doQuery(output);
+  if(!executePrepared(d_afterOrderQuery, nameparams)) {
+    snprintf(output, sizeof(output)-1, d_afterOrderQuery.c_str(), sqlEscape(lcqname).c_str(), id);
+    d_db->doQuery(output);
+  }
   while(d_db->getRow(row)) {
     after=row[0];
   }
 
   if(after.empty() && !lcqname.empty()) {
-    snprintf(output, sizeof(output)-1, d_firstOrderQuery.c_str(), id);
-  
-    d_db->doQuery(output);
+    if(!executePrepared(d_firstOrderQuery, idparam)) {
+      snprintf(output, sizeof(output)-1, d_firstOrderQuery.c_str(), id);
+      d_db->doQuery(output);
+    }
     while(d_db->getRow(row)) {
       after=row[0];
     }
   }
 
-  snprintf(output, sizeof(output)-1, d_beforeOrderQuery.c_str(), sqlEscape(lcqname).c_str(), id);
-  d_db->doQuery(output);
+  if(!executePrepared(d_beforeOrderQuery, nameparams)) {
+    snprintf(output, sizeof(output)-1, d_beforeOrderQuery.c_str(), sqlEscape(lcqname).c_str(), id);
+    d_db->doQuery(output);
+  }
   while(d_db->getRow(row)) {
     before=row[0];
     unhashed=row[1];
@@ -378,8 +385,10 @@ bool GSQLBackend::getBeforeAndAfterNamesAbsolute(uint32_t id, const std::string&
     return true;
   }
 
-  snprintf(output, sizeof(output)-1, d_lastOrderQuery.c_str(), id);
-  d_db->doQuery(output);
+  if(!executePrepared(d_lastOrderQuery, idparam)) {
+    snprintf(output, sizeof(output)-1, d_lastOrderQuery.c_str(), id);
+    d_db->doQuery(output);
+  }
   while(d_db->getRow(row)) {
     before=row[0];
     unhashed=row[1];
@@ -568,12 +577,23 @@ bool GSQLBackend::setDomainMetadata(const string& name, const std::string& kind,
 }
 
 
-void GSQLBackend::lookup(const QType &qtype,const string &qname, DNSPacket *pkt_p, int domain_id)
+const string& GSQLBackend::lookupFormat(const QType &qtype, const string &qname, int domain_id)
 {
-  string format;
-  char output[1024];
+  bool wildcard = qname[0]=='%';
+  if(qtype.getCode()!=QType::ANY) {
+    if(domain_id<0)
+      return wildcard ? d_wildCardNoIDQuery : d_noWildCardNoIDQuery;
+    return wildcard ? d_wildCardIDQuery : d_noWildCardIDQuery;
+  }
+  if(domain_id<0)
+    return wildcard ? d_wildCardANYNoIDQuery : d_noWildCardANYNoIDQuery;
+  return wildcard ? d_wildCardANYIDQuery : d_noWildCardANYIDQuery;
+}
 
-  d_db->setLog(::arg().mustDo("query-logging"));
+string GSQLBackend::makeLookupQuery(const QType &qtype, const string &qname, int domain_id)
+{
+  const string& format=lookupFormat(qtype, qname, domain_id);
+  char output[1024];
 
   string lcqname=toLower(qname);
   
@@ -581,45 +601,99 @@ void GSQLBackend::lookup(const QType &qtype,const string &qname, DNSPacket *pkt_
 
   if(qtype.getCode()!=QType::ANY) {
     // qtype qname domain_id
-    if(domain_id<0) {
-      if(qname[0]=='%')
-        format=d_wildCardNoIDQuery;
-      else
-        format=d_noWildCardNoIDQuery;
-
+    if(domain_id<0)
       snprintf(output,sizeof(output)-1, format.c_str(),sqlEscape(qtype.getName()).c_str(), sqlEscape(lcqname).c_str());
-    }
-    else {
-      if(qname[0]!='%')
-        format=d_noWildCardIDQuery;
-      else
-        format=d_wildCardIDQuery;
+    else
       snprintf(output,sizeof(output)-1, format.c_str(),sqlEscape(qtype.getName()).c_str(),sqlEscape(lcqname).c_str(),domain_id);
-    }
   }
   else {
     // qtype==ANY
     // qname domain_id
-    if(domain_id<0) {
-      if(qname[0]=='%')
-        format=d_wildCardANYNoIDQuery;
-      else
-        format=d_noWildCardANYNoIDQuery;
-
+    if(domain_id<0)
       snprintf(output,sizeof(output)-1, format.c_str(),sqlEscape(lcqname).c_str());
+    else
+      snprintf(output,sizeof(output)-1, format.c_str(),sqlEscape(lcqname).c_str(),domain_id);
+  }
+  DLOG(L<< "Query: '" << output << "'"<<endl);
+  return output;
+}
+
+/* turns one of our printf-style queries into one with a '?' for every argument. This only works if
+   all arguments are quoted strings ('%s', or E'%s' for PostgreSQL) or numbers ('%d' or %d), and there is one 
+   for each parameter we pass */
+static bool makePlaceholders(const string &format, int nparams, string &query)
+{
+  int params=0;
+  query.clear();
+  for(string::size_type n=0; n < format.size(); ++n) {
+    if(format[n]=='?')
+      return false;
+    if(format[n]=='\'' && n+3 < format.size() && format[n+1]=='%' && (format[n+2]=='s' || format[n+2]=='d') && format[n+3]=='\'') {
+      string::size_type len=query.size();
+      if(len && (query[len-1]=='E' || query[len-1]=='e') && (len==1 || !(isalnum(query[len-2]) || query[len-2]=='_')))
+        query.resize(len-1); // E'%s' is an escaped string, but the parameter itself needs no escaping
+      query+='?';
+      ++params;
+      n+=3;
     }
-    else {
-      if(qname[0]!='%')
-        format=d_noWildCardANYIDQuery;
+    else if(format[n]=='%') {
+      if(n+1 == format.size())
+        return false;
+      if(format[n+1]=='d') {
+        query+='?';
+        ++params;
+      }
+      else if(format[n+1]=='%')
+        query+='%';
       else
-        format=d_wildCardANYIDQuery;
-      snprintf(output,sizeof(output)-1, format.c_str(),sqlEscape(lcqname).c_str(),domain_id);
+        return false;
+      ++n;
+    }
+    else
+      query+=format[n];
+  }
+  return params==nparams;
+}
+
+/* runs the query as a prepared statement, preparing it the first time around. Returns false if this
+   query or our database can't do that, the caller then has to send the query as text */
+bool GSQLBackend::executePrepared(const string &format, const vector<string> &params)
+{
+  prepared_t::const_iterator i=d_prepared.find(&format);
+  if(i==d_prepared.end()) {
+    int statement=-1;
+    string query;
+    if(makePlaceholders(format, params.size(), query)) {
+      try {
+        statement=d_db->prepare(query, params.size());
+      }
+      catch(SSqlException &e) {
+        L<<Logger::Warning<<d_logprefix<<"Unable to prepare query, will send it as text: "<<e.txtReason()<<endl;
+      }
     }
+    i=d_prepared.insert(make_pair(&format, statement)).first;
   }
-  DLOG(L<< "Query: '" << output << "'"<<endl);
+  if(i->second < 0)
+    return false;
+
+  d_db->execute(i->second, params);
+  return true;
+}
+
+void GSQLBackend::lookup(const QType &qtype,const string &qname, DNSPacket *pkt_p, int domain_id)
+{
+  d_db->setLog(::arg().mustDo("query-logging"));
+
+  vector<string> params;
+  if(qtype.getCode()!=QType::ANY)
+    params.push_back(qtype.getName());
+  params.push_back(toLower(qname));
+  if(domain_id>=0)
+    params.push_back(itoa(domain_id));
 
   try {
-    d_db->doQuery(output);
+    if(!executePrepared(lookupFormat(qtype, qname, domain_id), params))
+      d_db->doQuery(makeLookupQuery(qtype, qname, domain_id));
   }
   catch(SSqlException &e) {
     throw AhuException(e.txtReason());
@@ -634,10 +708,12 @@ bool GSQLBackend::list(const string &target, int domain_id )
 {
   DLOG(L<<"GSQLBackend constructing handle for list of domain id'"<<domain_id<<"'"<<endl);
 
-  char output[1024];
-  snprintf(output,sizeof(output)-1,d_listQuery.c_str(),domain_id);
   try {
-    d_db->doQuery(output);
+    if(!executePrepared(d_listQuery, vector<string>(1, itoa(domain_id)))) {
+      char output[1024];
+      snprintf(output,sizeof(output)-1,d_listQuery.c_str(),domain_id);
+      d_db->doQuery(output);
+    }
   }
   catch(SSqlException &e) {
     throw AhuException("GSQLBackend list query: "+e.txtReason());
@@ -730,30 +806,40 @@ void GSQLBackend::getAllDomains(vector<DomainInfo> *domains)
   }
 }
 
+/* row is content, ttl, prio, type, domain_id, name and, with DNSSEC, auth. The strings in r are assigned 
+   to, not replaced, so a caller that reuses r for all records of a list() hardly allocates at all */
+void GSQLBackend::rowToRecord(const SSqlField* row, const string& qname, DNSResourceRecord& r)
+{
+  r.content.assign(row[0].data, row[0].len);
+  if (row[1].empty())
+      r.ttl = ::arg().asNum( "default-ttl" );
+  else 
+      r.ttl=row[1].toLong();
+  r.priority=row[2].toLong();
+  if(!qname.empty())
+    r.qname=qname;
+  else
+    r.qname.assign(row[5].data, row[5].len);
+  r.qtype=row[3].data;
+  r.last_modified=0;
+  
+  if(d_dnssecQueries)
+    r.auth = !row[6].empty() && row[6].data[0]=='1';
+  else
+    r.auth = 1; 
+  
+  r.domain_id=row[4].toInt();
+}
+
 bool GSQLBackend::get(DNSResourceRecord &r)
 {
   // L << "GSQLBackend get() was called for "<<qtype.getName() << " record: ";
-  SSql::row_t row;
-  if(d_db->getRow(row)) {
-    r.content=row[0];
-    if (row[1].empty())
-        r.ttl = ::arg().asNum( "default-ttl" );
-    else 
-        r.ttl=atol(row[1].c_str());
-    r.priority=atol(row[2].c_str());
-    if(!d_qname.empty())
-      r.qname=d_qname;
-    else
-      r.qname=row[5];
-    r.qtype=row[3];
-    r.last_modified=0;
-    
-    if(d_dnssecQueries)
-      r.auth = !row[6].empty() && row[6][0]=='1';
-    else
-      r.auth = 1; 
-    
-    r.domain_id=atoi(row[4].c_str());
+  if(d_db->nextRow()) {
+    SSqlField fields[7];
+    unsigned int count=d_db->getFieldCount();
+    for(unsigned int n=0; n < count && n < 7; ++n)
+      fields[n]=d_db->getField(n);
+    rowToRecord(fields, d_qname, r);
     return true;
   }
   
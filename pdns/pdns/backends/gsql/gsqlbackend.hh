@@ -58,6 +58,14 @@ public:
   
   bool getTSIGKey(const string& name, string* algorithm, string* content);
 private:
+  const string& lookupFormat(const QType &qtype, const string &qname, int domain_id);
+  string makeLookupQuery(const QType &qtype, const string &qname, int domain_id);
+  bool executePrepared(const string &format, const vector<string> &params);
+  void rowToRecord(const SSqlField* row, const string& qname, DNSResourceRecord& r);
+
+  typedef map<const string*, int> prepared_t; //!< our query formats, and what d_db->prepare() made of them
+  prepared_t d_prepared;
+
   string d_qname;
   QType d_qtype;
   int d_count;
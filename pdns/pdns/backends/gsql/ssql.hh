@@ -9,6 +9,7 @@
 #endif // WIN32
 
 #include <string>
+#include <climits>
 #include <vector>
 #include "../../namespaces.hh"
 
@@ -29,6 +30,48 @@ private:
   string d_reason;
 };
 
+/** A column of the current result row, pointing straight into the buffers of the database driver. 
+    It is only valid until the next call to SSql::nextRow(). data is always 0-terminated, NULL comes out as "" */
+struct SSqlField
+{
+  SSqlField(const char *d="", unsigned int l=0) : data(d), len(l) {}
+  explicit SSqlField(const string &s) : data(s.c_str()), len(s.size()) {}
+
+  bool empty() const
+  {
+    return !len;
+  }
+  string str() const
+  {
+    return string(data, len);
+  }
+  //! like atol(), without the copy. Values that don't fit a long stop at its limit
+  long toLong() const
+  {
+    const char *p=data, *end=data+len;
+    bool negative = p!=end && *p=='-';
+    if(negative)
+      ++p;
+    long ret=0;
+    for(; p!=end && *p>='0' && *p<='9'; ++p) {
+      if(ret > (LONG_MAX - (*p-'0'))/10) {
+        ret=LONG_MAX;
+        break;
+      }
+      ret=ret*10 + (*p-'0');
+    }
+    return negative ? -ret : ret;
+  }
+  //! like atoi(), without the copy
+  int toInt() const
+  {
+    return (int)toLong();
+  }
+
+  const char *data;
+  unsigned int len;
+};
+
 class SSql
 {
 public:
@@ -40,8 +83,48 @@ public:
   virtual int doCommand(const string &query)=0;
   virtual bool getRow(row_t &row)=0;
   virtual string escape(const string &name)=0;
+  //! prepares a query in which parameters are marked with a '?', to be run with execute(). Returns -1 if the driver can not do this
+  virtual int prepare(const string &query, int nparams)
+  {
+    return -1;
+  }
+  //! runs a statement from prepare() with these parameters, its rows can then be retrieved with getRow()
+  virtual void execute(int statement, const vector<string> &params)
+  {
+    throw SSqlException("This database driver does not support prepared statements");
+  }
+  /** Moves to the next row of the current result, whose columns can then be read with getField().
+      Unlike getRow() this does not copy anything, unless the driver does not implement it */
+  virtual bool nextRow()
+  {
+    return getRow(d_fieldrow);
+  }
+  virtual unsigned int getFieldCount()
+  {
+    return d_fieldrow.size();
+  }
+  //! column 'n' of the row nextRow() moved to
+  virtual SSqlField getField(unsigned int n)
+  {
+    return SSqlField(d_fieldrow.at(n));
+  }
   virtual void setLog(bool state){}
   virtual ~SSql(){};
+protected:
+  //! getRow() for drivers that implement nextRow()
+  bool copyRow(row_t &row)
+  {
+    row.clear();
+    if(!nextRow())
+      return false;
+    unsigned int fields=getFieldCount();
+    row.reserve(fields);
+    for(unsigned int n=0; n < fields; ++n)
+      row.push_back(getField(n).str());
+    return true;
+  }
+private:
+  row_t d_fieldrow;
 };
 
 #endif /* SSQL_HH */
@@ -17,6 +17,7 @@
     Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 #include "common_startup.hh"
+#include "dnssecinfra.hh"
 
 typedef Distributor<DNSPacket,DNSPacket,PacketHandler> DNSDistributor;
 
@@ -28,6 +29,7 @@ DNSProxy *DP;
 DynListener *dl;
 CommunicatorClass Communicator;
 UDPNameserver *N;
+vector<UDPNameserver*> g_udpReceivers;
 int avg_latency;
 TCPNameserver *TN;
 
@@ -66,9 +68,10 @@ void declareArguments()
   ::arg().set("wildcard-url","Process URL and MBOXFW records")="no";
   ::arg().set("loglevel","Amount of logging. Higher is more. Do not set below 3")="4";
   ::arg().set("default-soa-name","name to insert in the SOA record if none set in the backend")="a.misconfigured.powerdns.server";
-  ::arg().set("distributor-threads","Default number of Distributor (backend) threads to start")="3";
+  ::arg().set("distributor-threads","Default number of Distributor (backend) threads to start per receiver thread")="3";
   ::arg().set("signing-threads","Default number of signer threads to start")="3";
-  ::arg().set("receiver-threads","Default number of Distributor (backend) threads to start")="1";
+  ::arg().set("receiver-threads","Default number of receiver threads to start")="1";
+  ::arg().setSwitch("reuseport","Give each receiver thread its own UDP sockets, using SO_REUSEPORT")="no";
   ::arg().set("queue-limit","Maximum number of milliseconds to queue a query")="1500"; 
   ::arg().set("recursor","If recursion is desired, IP address of a recursing nameserver")="no"; 
   ::arg().set("lazy-recursion","Only recurse if question cannot be answered locally")="yes";
@@ -132,6 +135,9 @@ void declareArguments()
   ::arg().set("setgid","If set, change group id to this gid for more security")="";
 
   ::arg().set("max-cache-entries", "Maximum number of cache entries")="1000000";
+  ::arg().set("cache-shards", "Number of independently locked shards to split the packet and query cache in")="1";
+  ::arg().setSwitch("cache-from-wire", "Answer packet cache hits straight from the received packet, skipping query rings and logging")="no";
+  ::arg().set("udp-batch-size", "Number of UDP questions to receive, and cached answers to send, per system call")="1";
   ::arg().set("entropy-source", "If set, read entropy from this file")="/dev/urandom";
 }
 
@@ -153,10 +159,15 @@ void declareStats(void)
   S.declare("tcp-answers","Number of answers sent out over TCP");
 
   S.declare("qsize-q","Number of questions waiting for database attention");
+  S.declare("coalesced-questions","Number of questions answered with a copy of the answer to an identical question");
 
   S.declare("deferred-cache-inserts","Amount of cache inserts that were deferred because of maintenance");
   S.declare("deferred-cache-lookup","Amount of cache lookups that were deferred because of maintenance");
 
+  S.declare("signature-cache-hit","Number of RRSIGs found in the signature cache");
+  S.declare("signature-cache-miss","Number of RRSIGs that had to be calculated");
+  S.declare("signature-cache-size","Number of RRSIGs in the signature cache");
+
   S.declare("query-cache-hit","Number of hits on the query cache");
   S.declare("query-cache-miss","Number of misses on the query cache");
 
@@ -209,9 +220,7 @@ void sendout(const DNSDistributor::AnswerData &AD)
   delete AD.A;  
 }
 
-static DNSDistributor* g_distributor;
-static pthread_mutex_t d_distributorlock =PTHREAD_MUTEX_INITIALIZER;
-static bool g_mustlockdistributor;
+static vector<DNSDistributor*> g_distributors;
 
 //! The qthread receives questions over the internet via the Nameserver class, and hands them to the Distributor for further processing
 void *qthread(void *number)
@@ -220,6 +229,7 @@ void *qthread(void *number)
 
   DNSPacket question;
   DNSPacket cached;
+  string wireAnswer;
 
   unsigned int &numreceived=*S.getPointer("udp-queries");
   unsigned int &numanswered=*S.getPointer("udp-answers");
@@ -232,19 +242,41 @@ void *qthread(void *number)
   numreceived=-1;
   int diff;
   bool logDNSQueries = ::arg().mustDo("log-dns-queries");
+  string *wireAnswerp = (::arg().mustDo("cache-from-wire") && !logDNSQueries) ? &wireAnswer : 0;
+  UDPNameserver *NS = N;
+  if((unsigned long)number < g_udpReceivers.size())
+    NS = g_udpReceivers[(unsigned long)number];
+  DNSDistributor *distributor = g_distributors[(unsigned long)number]; // the big dispatcher, one per receiver thread
+  UDPBatch *batch=0;
+  if(::arg().asNum("udp-batch-size") > 1 && UDPNameserver::canBatch())
+    batch=new UDPBatch(::arg().asNum("udp-batch-size"));
+
   for(;;) {
     if(number==0) { // only run on main thread
       if(!((numreceived++)%250)) { // maintenance tasks
         S.set("latency",(int)avg_latency);
-        int qcount, acount;
-        g_distributor->getQueueSizes(qcount, acount);
-        S.set("qsize-q",qcount);
+        int qcount, acount, total=0;
+        for(vector<DNSDistributor*>::const_iterator i=g_distributors.begin(); i!=g_distributors.end(); ++i) {
+          (*i)->getQueueSizes(qcount, acount);
+          total+=qcount;
+        }
+        S.set("qsize-q",total);
+
+        unsigned int hits, misses, size;
+        getSignatureCacheStats(hits, misses, size);
+        S.set("signature-cache-hit", hits);
+        S.set("signature-cache-miss", misses);
+        S.set("signature-cache-size", size);
       }
     }
 
-    if(!(P=N->receive(&question))) { // receive a packet         inline
-      continue;                    // packet was broken, try again
-    }
+    if(batch)
+      P=NS->receive(&question, *batch, wireAnswerp != 0);
+    else
+      P=NS->receive(&question, wireAnswerp); // receive a packet         inline
+
+    if(!P)
+      continue;                    // packet was broken or answered from the wire, try again
 
     if(P->d_remote.getSocklen()==sizeof(sockaddr_in))
       numreceived4++;
@@ -275,7 +307,10 @@ void *qthread(void *number)
       cached.d.id=P->d.id;
       cached.commitD(); // commit d to the packet                        inlined
 
-      N->send(&cached);   // answer it then                              inlined
+      if(batch)
+        UDPNameserver::queue(*batch, &cached);
+      else
+        N->send(&cached);   // answer it then                              inlined
       diff=P->d_dt.udiff();                                                    
       avg_latency=(int)(0.999*avg_latency+0.001*diff); // 'EWMA'
       
@@ -288,7 +323,7 @@ void *qthread(void *number)
       continue;
     }
     
-    if(g_distributor->isOverloaded()) {
+    if(distributor->isOverloaded()) {
       if(logDNSQueries) 
         L<<"Dropped query, db is overloaded"<<endl;
       continue;
@@ -297,12 +332,7 @@ void *qthread(void *number)
     if(logDNSQueries) 
       L<<"packetcache MISS"<<endl;
 
-    if(g_mustlockdistributor) {
-      Lock l(&d_distributorlock);
-      g_distributor->question(P, &sendout); // otherwise, give to the distributor
-    }
-    else
-      g_distributor->question(P, &sendout); // otherwise, give to the distributor
+    distributor->question(P, &sendout); // otherwise, give to the distributor
   }
   return 0;
 }
@@ -320,6 +350,7 @@ void mainthread()
      
    
    DNSPacket::s_doEDNSSubnetProcessing = ::arg().mustDo("edns-subnet-processing");
+   PC.setShards(::arg().asNum("cache-shards"));
      
 #ifndef WIN32
 
@@ -358,11 +389,11 @@ void mainthread()
     TN->go(); // tcp nameserver launch
     
   //  fork(); (this worked :-))
-  g_distributor = new DNSDistributor(::arg().asNum("distributor-threads")); // the big dispatcher!
-  if(::arg().asNum("receiver-threads") > 1) {
-    g_mustlockdistributor=true;
-  }
+  if(::arg().asNum("udp-batch-size") > 1 && !UDPNameserver::canBatch())
+    L<<Logger::Warning<<"udp-batch-size is set, but this platform lacks recvmmsg() and sendmmsg(), receiving one packet at a time"<<endl;
   unsigned int max_rthreads= ::arg().asNum("receiver-threads");
+  for(unsigned int n=0; n < max_rthreads; ++n)
+    g_distributors.push_back(new DNSDistributor(::arg().asNum("distributor-threads")));
   for(unsigned int n=0; n < max_rthreads; ++n)
     pthread_create(&qtid,0,qthread, reinterpret_cast<void *>(n)); // receives packets
 
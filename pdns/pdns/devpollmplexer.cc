@@ -21,8 +21,8 @@ public:
 
   virtual int run(struct timeval* tv);
 
-  virtual void addFD(callbackmap_t& cbmap, int fd, callbackfunc_t toDo, const funcparam_t& parameter);
-  virtual void removeFD(callbackmap_t& cbmap, int fd);
+  virtual void addFD(callbacktable_t& cbtable, int fd, callbackfunc_t toDo, const funcparam_t& parameter);
+  virtual void removeFD(callbacktable_t& cbtable, int fd);
   string getName()
   {
     return "/dev/poll";
@@ -54,25 +54,24 @@ DevPollFDMultiplexer::DevPollFDMultiplexer()
     
 }
 
-void DevPollFDMultiplexer::addFD(callbackmap_t& cbmap, int fd, callbackfunc_t toDo, const funcparam_t& parameter)
+void DevPollFDMultiplexer::addFD(callbacktable_t& cbtable, int fd, callbackfunc_t toDo, const funcparam_t& parameter)
 {
-  accountingAddFD(cbmap, fd, toDo, parameter);
+  accountingAddFD(cbtable, fd, toDo, parameter);
 
   struct pollfd devent;
   devent.fd=fd;
-  devent.events= (&cbmap == &d_readCallbacks) ? POLLIN : POLLOUT;
+  devent.events= (&cbtable == &d_readCallbacks) ? POLLIN : POLLOUT;
   devent.revents = 0;
 
   if(write(d_devpollfd, &devent, sizeof(devent)) != sizeof(devent)) {
-    cbmap.erase(fd);
+    accountingRemoveFD(cbtable, fd);
     throw FDMultiplexerException("Adding fd to /dev/poll/ set: "+stringerror());
   }
 }
 
-void DevPollFDMultiplexer::removeFD(callbackmap_t& cbmap, int fd)
+void DevPollFDMultiplexer::removeFD(callbacktable_t& cbtable, int fd)
 {
-  if(!cbmap.erase(fd))
-    throw FDMultiplexerException("Tried to remove unlisted fd "+lexical_cast<string>(fd)+ " from multiplexer");
+  accountingRemoveFD(cbtable, fd);
 
   struct pollfd devent;
   devent.fd=fd;
@@ -80,7 +79,6 @@ void DevPollFDMultiplexer::removeFD(callbackmap_t& cbmap, int fd)
   devent.revents = 0;
 
   if(write(d_devpollfd, &devent, sizeof(devent)) != sizeof(devent)) {
-    cbmap.erase(fd);
     throw FDMultiplexerException("Removing fd from epoll set: "+stringerror());
   }
 }
@@ -105,17 +103,9 @@ int DevPollFDMultiplexer::run(struct timeval* now)
 
   d_inrun=true;
   for(int n=0; n < ret; ++n) {
-    d_iter=d_readCallbacks.find(dvp.dp_fds[n].fd);
-    
-    if(d_iter != d_readCallbacks.end()) {
-      d_iter->second.d_callback(d_iter->first, d_iter->second.d_parameter);
+    if(dispatch(d_readCallbacks, dvp.dp_fds[n].fd))
       continue; // so we don't refind ourselves as writable!
-    }
-    d_iter=d_writeCallbacks.find(dvp.dp_fds[n].fd);
-    
-    if(d_iter != d_writeCallbacks.end()) {
-      d_iter->second.d_callback(d_iter->first, d_iter->second.d_parameter);
-    }
+    dispatch(d_writeCallbacks, dvp.dp_fds[n].fd);
   }
   delete[] dvp.dp_fds;
   d_inrun=false;
@@ -126,7 +116,7 @@ int DevPollFDMultiplexer::run(struct timeval* now)
 void acceptData(int fd, funcparam_t& parameter)
 {
   cout<<"Have data on fd "<<fd<<endl;
-  Socket* sock=funcparam_t_cast<Socket*>(parameter);
+  Socket* sock=funcparam_cast<Socket*>(parameter);
   string packet;
   IPEndpoint rem;
   sock->recvFrom(packet, rem);
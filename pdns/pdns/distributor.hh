@@ -23,6 +23,7 @@
 
 #include <string>
 #include <deque>
+#include <map>
 #include <queue>
 #include <vector>
 #include <pthread.h>
@@ -38,6 +39,8 @@
 #include "ahuexception.hh"
 #include "arguments.hh"
 #include "statbag.hh"
+#include "mpmcqueue.hh"
+#include "lock.hh"
 
 extern StatBag S;
 
@@ -54,6 +57,10 @@ extern StatBag S;
     The Backend needs to count the number of living instances and supply this number to
     the Distributor using its numBackends() method. This is silly.
 
+    Questions that are identical to one already queued or being answered are not queued again, 
+    but wait for that one to be answered and then get a copy of its answer. The Backend decides what
+    is identical through its static getCoalesceKey() method, and makes the copies with coalescedAnswer().
+
     If an exception escapes a Backend, the distributor retires it.
 */
 template<class Answer, class Question, class Backend> class Distributor
@@ -82,6 +89,7 @@ public:
     Question *Q;
     void (*callback)(const AnswerData &);
     int id;
+    string key; //!< if not empty, identical questions wait for the answer to this one
   };
 
   typedef pair<QuestionData, AnswerData> tuple_t;
@@ -91,38 +99,62 @@ public:
   }
   
 private:
+  void nextQuestion(QuestionData& QD); //!< spins a little, and then parks, until a question is available
+  void releaseWaiters(const QuestionData& QD, Answer *a); //!< hands copies of a to all questions waiting for QD, or 0 if a is
+
+  typedef map<string, vector<QuestionData> > inflight_t;
+  inflight_t d_inflight; //!< keys of questions that are queued or being answered, with the identical questions waiting for them
+  pthread_mutex_t d_inflightlock;
+
   bool d_overloaded;
-  std::queue<QuestionData> questions;
-  pthread_mutex_t q_lock;
+  MPMCQueue<QuestionData> d_questions;
+  AtomicCounter d_queued; //!< questions handed to us, but not yet picked up by a backend thread
+  AtomicCounter d_sleepers; //!< backend threads parked, or about to park, on d_wakeups
+  Semaphore d_wakeups;
+  unsigned int d_spins; //!< how often a backend thread looks for a question before parking
   
   deque<tuple_t> answers;
   pthread_mutex_t a_lock;
 
-  Semaphore numquestions;
   Semaphore numanswers;
 
   pthread_mutex_t to_mut;
   pthread_cond_t to_cond;
 
-  int nextid;
+  AtomicCounter d_nextid;
   time_t d_last_started;
   int d_num_threads;
   AtomicCounter d_idle_threads;
+  AtomicCounter d_running; //!< backend threads of this distributor that are alive
   Backend *b;
+
+  //! counts a backend thread in d_running for as long as it lives
+  struct RunningThread
+  {
+    explicit RunningThread(AtomicCounter& running) : d_running(running)
+    {
+      ++d_running;
+    }
+    ~RunningThread()
+    {
+      --d_running;
+    }
+    AtomicCounter& d_running;
+  };
 };
 
 
 //template<class Answer, class Question, class Backend>::nextid;
 
 template<class Answer, class Question, class Backend>Distributor<Answer,Question,Backend>::Distributor(int n)
+  : d_questions(max(1024, ::arg().asNum("max-queue-length")+1)) // room for more than max-queue-length, so we respawn before it fills up
 {
   b=0;
   d_overloaded = false;
-  nextid=0;
   // d_idle_threads=0;
   d_last_started=time(0);
-//  sem_init(&numquestions,0,0);
-  pthread_mutex_init(&q_lock,0);
+  pthread_mutex_init(&d_inflightlock,0);
+  d_spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? 100 : 0; // spinning on a single CPU only keeps the producer from running
 
 //  sem_init(&numanswers,0,0);
   pthread_mutex_init(&a_lock,0);
@@ -151,6 +183,7 @@ template<class Answer, class Question, class Backend>void *Distributor<Answer,Qu
   try {
     Backend *b=new Backend(); // this will answer our questions
     Distributor *us=static_cast<Distributor *>(p);
+    RunningThread running(us->d_running);
     int qcount;
 
     // this is so gross
@@ -162,28 +195,25 @@ template<class Answer, class Question, class Backend>void *Distributor<Answer,Qu
     for(;;) {
       ++(us->d_idle_threads);
 
-      us->numquestions.getValue( &qcount );
+      qcount=us->d_queued;
 
-      us->numquestions.wait();
+      QuestionData QD;
+      us->nextQuestion(QD);
+      --(us->d_queued);
 
       --(us->d_idle_threads);
-      pthread_mutex_lock(&us->q_lock);
-
-      QuestionData QD=us->questions.front();
 
       Question *q=QD.Q;
-      
-      us->questions.pop();
 
       if(us->d_overloaded && qcount <= overloadQueueLength/10) {
         us->d_overloaded=false;
       }
       
-      pthread_mutex_unlock(&us->q_lock);
       Answer *a;      
 
 #ifndef SMTPREDIR
       if(queuetimeout && q->d_dt.udiff()>queuetimeout*1000) {
+        us->releaseWaiters(QD, 0);
         delete q;
         S.inc("timedout-packets");
         continue;
@@ -192,15 +222,18 @@ template<class Answer, class Question, class Backend>void *Distributor<Answer,Qu
       // this is the only point where we interact with the backend (synchronous)
       try {
         a=b->question(q); // a can be NULL!
+        us->releaseWaiters(QD, a);
         delete q;
       }
       catch(const AhuException &e) {
         L<<Logger::Error<<"Backend error: "<<e.reason<<endl;
+        us->releaseWaiters(QD, 0);
         delete b;
         return 0;
       }
       catch(...) {
         L<<Logger::Error<<Logger::NTLog<<"Caught unknown exception in Distributor thread "<<(unsigned long)pthread_self()<<endl;
+        us->releaseWaiters(QD, 0);
         delete b;
         return 0;
       }
@@ -276,42 +309,46 @@ template<class Answer, class Question, class Backend>int Distributor<Answer,Ques
     q=new Question(*q);
   }
 
-  DLOG(L<<"Distributor has "<<Backend::numRunning()<<" threads available"<<endl);
-
-  /* the line below is a bit difficult.
-     What happens is that we have a goal for the number of running distributor threads. Furthermore, other
-     parts of PowerDNS also start backends, which get included in this count.
+  DLOG(L<<"Distributor has "<<d_running<<" threads available"<<endl);
 
-     If less than two threads now die, no new ones will be spawned.
-
-     The solutionis to add '+2' below, but it is not a pretty solution. Better solution is
-     to only account the number of threads within the Distributor, and not in the backend.
-
-     XXX FIXME 
-  */
-
-  if(Backend::numRunning() < d_num_threads+2 && time(0)-d_last_started>5) { 
+  /* only our own threads count here: other parts of PowerDNS, and with several receiver threads other
+     distributors, start backends too, so Backend::numRunning() would hide the threads we lost */
+  if((int)d_running < d_num_threads && time(0)-d_last_started>5) { 
     d_last_started=time(0);
-    L<<"Distributor misses a thread ("<<Backend::numRunning()<<"<"<<d_num_threads + 2<<"), spawning new one"<<endl;
+    L<<"Distributor misses a thread ("<<d_running<<"<"<<d_num_threads<<"), spawning new one"<<endl;
     pthread_t tid;
     pthread_create(&tid,0,&makeThread,static_cast<void *>(this));
   }
 
-  pthread_mutex_lock(&q_lock);
   QuestionData QD;
   QD.Q=q;
-  QD.id=nextid++;
+  QD.id=++d_nextid;
   QD.callback=callback;
-  questions.push(QD);
-  pthread_mutex_unlock(&q_lock);
+  if(callback && Backend::getCoalesceKey(q, &QD.key)) {
+    Lock l(&d_inflightlock);
+    pair<typename inflight_t::iterator, bool> res=d_inflight.insert(make_pair(QD.key, vector<QuestionData>()));
+    if(!res.second) { // an identical question is already on its way
+      res.first->second.push_back(QD);
+      S.inc("coalesced-questions");
+      return QD.id;
+    }
+  }
+  else
+    QD.key.clear();
+
+  ++d_queued;
+  if(!d_questions.push(QD)) {
+    L<<Logger::Error<<"Distributor question queue of "<<d_questions.capacity()<<" is full, respawning"<<endl;
+    _exit(1);
+  }
 
-  numquestions.post();
+  if(d_sleepers) // the push above and this read are both full barriers, so a backend thread going to sleep right now either sees the question, or gets woken
+    d_wakeups.post();
   
   static int overloadQueueLength=::arg().asNum("overload-queue-length");
 
-  if(!(nextid%50)) {
-    int val;
-    numquestions.getValue( &val );
+  if(!(QD.id%50)) {
+    int val=d_queued;
     
     if(!d_overloaded)
       d_overloaded = overloadQueueLength && (val > overloadQueueLength);
@@ -326,6 +363,48 @@ template<class Answer, class Question, class Backend>int Distributor<Answer,Ques
   return QD.id;
 }
 
+template<class Answer, class Question, class Backend>void Distributor<Answer,Question,Backend>::nextQuestion(QuestionData& QD)
+{
+  for(;;) {
+    // questions tend to arrive in bursts, so spin a little before paying for a sleep and a wakeup
+    for(unsigned int n=0; n < d_spins; ++n)
+      if(d_questions.pop(QD))
+        return;
+
+    ++d_sleepers;
+    if(d_questions.pop(QD)) {
+      --d_sleepers;
+      return;
+    }
+    d_wakeups.wait(); // may be a stale wakeup meant for someone who found a question on their own, that is fine
+    --d_sleepers;
+  }
+}
+
+template<class Answer, class Question, class Backend>void Distributor<Answer,Question,Backend>::releaseWaiters(const QuestionData& QD, Answer *a)
+{
+  if(QD.key.empty())
+    return;
+
+  vector<QuestionData> waiters;
+  {
+    Lock l(&d_inflightlock);
+    typename inflight_t::iterator i=d_inflight.find(QD.key);
+    if(i == d_inflight.end())
+      return;
+    waiters.swap(i->second);
+    d_inflight.erase(i);
+  }
+
+  AnswerData AD;
+  AD.created=time(0);
+  for(typename vector<QuestionData>::const_iterator i=waiters.begin(); i != waiters.end(); ++i) {
+    AD.A = a ? Backend::coalescedAnswer(a, i->Q) : 0;
+    delete i->Q;
+    i->callback(AD);
+  }
+}
+
 template<class Answer, class Question,class Backend>Answer* Distributor<Answer,Question,Backend>::answer()
 {
   numanswers.wait();
@@ -363,7 +442,7 @@ template<class Answer, class Question,class Backend>Answer* Distributor<Answer,Q
 
 template<class Answer, class Question,class Backend>void Distributor<Answer,Question,Backend>::getQueueSizes(int &questions, int &answers)
 {
-  numquestions.getValue( &questions );
+  questions=d_queued;
   numanswers.getValue( &answers );
 }
 
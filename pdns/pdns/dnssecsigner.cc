@@ -21,6 +21,9 @@
 #include "md5.hh"
 #include "dnsseckeeper.hh"
 #include "lock.hh"
+#include "arguments.hh"
+#include "cachecleaner.hh"
+#include <boost/multi_index/hashed_index.hpp>
 
 /* this is where the RRSIGs begin, keys are retrieved,
    but the actual signing happens in fillOutRRSIG */
@@ -106,8 +109,44 @@ void addSignature(DNSSECKeeper& dk, DNSBackend& db, const std::string& signer, c
   toSign.clear();
 }
 
-static pthread_mutex_t g_signatures_lock = PTHREAD_MUTEX_INITIALIZER;
-static map<pair<string, string>, string> g_signatures;
+/* Signatures are cached by what was signed and the key it was signed with. The cache is split in shards with 
+   their own lock, so signing threads rarely wait for each other. Each shard is kept in LRU order and trimmed to
+   its share of max-cache-entries, and a signature is not used anymore once it has expired */
+struct SignatureCacheEntry
+{
+  uint32_t getTTD() const
+  {
+    return d_ttd;
+  }
+  string d_key;       // md5sum of the signed message + hash of the public key
+  string d_signer;    // for purging per zone
+  string d_signature;
+  uint32_t d_ttd;     // RRSIG expiration
+};
+
+typedef multi_index_container<
+  SignatureCacheEntry,
+  indexed_by <
+    hashed_unique<member<SignatureCacheEntry, string, &SignatureCacheEntry::d_key> >,
+    sequenced<>,
+    ordered_non_unique<member<SignatureCacheEntry, string, &SignatureCacheEntry::d_signer> >
+  >
+> signaturecache_t;
+
+struct SignatureCacheShard
+{
+  SignatureCacheShard() : d_lastprune(0)
+  {
+    pthread_mutex_init(&d_lock, 0);
+  }
+  pthread_mutex_t d_lock;
+  signaturecache_t d_cache;
+  time_t d_lastprune;
+};
+
+static const unsigned int s_signatureshards=16;
+static SignatureCacheShard g_signatures[s_signatureshards];
+static AtomicCounter g_signaturehits, g_signaturemisses;
 
 void fillOutRRSIG(DNSSECPrivateKey& dpk, const std::string& signQName, RRSIGRecordContent& rrc, vector<shared_ptr<DNSRecordContent> >& toSign) 
 {
@@ -118,29 +157,81 @@ void fillOutRRSIG(DNSSECPrivateKey& dpk, const std::string& signQName, RRSIGReco
 
   
   string msg=getMessageForRRSET(signQName, rrc, toSign); // this is what we will hash & sign
-  pair<string, string> lookup(rc->getPubKeyHash(), pdns_md5sum(msg)); 
-  
-  bool doCache=1;
-  if(doCache)
+  string md5=pdns_md5sum(msg);
+  string key=md5+rc->getPubKeyHash();
+  SignatureCacheShard& shard=g_signatures[(unsigned char)md5[0] % s_signatureshards];
+  uint32_t now=time(0);
+
   {
-    Lock l(&g_signatures_lock);
-    if(g_signatures.count(lookup)) {
-      // cerr<<"Hit!"<<endl;
-      rrc.d_signature=g_signatures[lookup];
+    Lock l(&shard.d_lock);
+    signaturecache_t::iterator iter=shard.d_cache.find(key);
+    if(iter != shard.d_cache.end() && iter->d_ttd > now) {
+      rrc.d_signature=iter->d_signature;
+      moveCacheItemToBack(shard.d_cache, iter);
+      ++g_signaturehits;
       return;
     }
-    else
-      ; // cerr<<"Miss!"<<endl;
   }
+  ++g_signaturemisses;
   
   //DTime dt;
   //dt.set();
   rrc.d_signature = rc->sign(msg);
   //cerr<<dt.udiff()<<endl;
 
-  if(doCache) {
-    Lock l(&g_signatures_lock);
-    g_signatures[lookup] = rrc.d_signature;
+  SignatureCacheEntry entry;
+  entry.d_key=key;
+  entry.d_signer=rrc.d_signer;
+  entry.d_signature=rrc.d_signature;
+  entry.d_ttd=rrc.d_sigexpire;
+
+  unsigned int maxCached=max(1U, (unsigned int)::arg().asNum("max-cache-entries") / s_signatureshards);
+  Lock l(&shard.d_lock);
+  pair<signaturecache_t::iterator, bool> res=shard.d_cache.insert(entry);
+  if(!res.second) { // expired, or another thread signed the same thing meanwhile
+    shard.d_cache.replace(res.first, entry);
+    moveCacheItemToBack(shard.d_cache, res.first);
+  }
+  if(shard.d_cache.size() > maxCached || now - shard.d_lastprune > 30) {
+    pruneCollection(shard.d_cache, maxCached);
+    shard.d_lastprune=now;
+  }
+}
+
+//! removes the signatures of this zone from the cache, or all of them if zone is empty
+unsigned int purgeSignatureCache(const std::string& zone)
+{
+  string signer=toLower(zone);
+  if(!signer.empty() && signer[signer.size()-1]=='.')
+    signer.resize(signer.size()-1);
+
+  unsigned int count=0;
+  for(unsigned int n=0; n < s_signatureshards; ++n) {
+    Lock l(&g_signatures[n].d_lock);
+    signaturecache_t& cache=g_signatures[n].d_cache;
+    if(zone.empty()) {
+      count+=cache.size();
+      cache.clear();
+    }
+    else {
+      typedef signaturecache_t::nth_index<2>::type signeridx_t;
+      signeridx_t& idx=cache.get<2>();
+      pair<signeridx_t::iterator, signeridx_t::iterator> range=idx.equal_range(signer);
+      count+=distance(range.first, range.second);
+      idx.erase(range.first, range.second);
+    }
+  }
+  return count;
+}
+
+void getSignatureCacheStats(unsigned int& hits, unsigned int& misses, unsigned int& size)
+{
+  hits=g_signaturehits;
+  misses=g_signaturemisses;
+  size=0;
+  for(unsigned int n=0; n < s_signatureshards; ++n) {
+    Lock l(&g_signatures[n].d_lock);
+    size+=g_signatures[n].d_cache.size();
   }
 }
 
@@ -25,6 +25,7 @@
 #include <signal.h>
 #include "misc.hh"
 #include "communicator.hh"
+#include "dnssecinfra.hh"
 
 static bool s_pleasequit;
 
@@ -126,6 +127,22 @@ string DLPurgeHandler(const vector<string>&parts, Utility::pid_t ppid)
   return os.str();
 }
 
+string DLPurgeSignaturesHandler(const vector<string>&parts, Utility::pid_t ppid)
+{
+  ostringstream os;
+  unsigned int ret=0;
+
+  if(parts.size()>1) {
+    for (vector<string>::const_iterator i=++parts.begin();i<parts.end();++i) {
+      ret+=purgeSignatureCache(*i);
+    }
+  }
+  else
+    ret=purgeSignatureCache();
+  os<<ret;
+  return os.str();
+}
+
 string DLCCHandler(const vector<string>&parts, Utility::pid_t ppid)
 {
   extern PacketCache PC;  
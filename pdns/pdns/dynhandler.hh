@@ -50,5 +50,6 @@ string DLReloadHandler(const vector<string>&parts, Utility::pid_t ppid);
 string DLRediscoverHandler(const vector<string>&parts, Utility::pid_t ppid);
 string DLVersionHandler(const vector<string>&parts, Utility::pid_t ppid);
 string DLPurgeHandler(const vector<string>&parts, Utility::pid_t ppid);
+string DLPurgeSignaturesHandler(const vector<string>&parts, Utility::pid_t ppid);
 string DLNotifyRetrieveHandler(const vector<string>&parts, Utility::pid_t ppid);
 #endif /* PDNS_DYNHANDLER_HH */
@@ -23,8 +23,8 @@ public:
 
   virtual int run(struct timeval* tv);
 
-  virtual void addFD(callbackmap_t& cbmap, int fd, callbackfunc_t toDo, const funcparam_t& parameter);
-  virtual void removeFD(callbackmap_t& cbmap, int fd);
+  virtual void addFD(callbacktable_t& cbtable, int fd, callbackfunc_t toDo, const funcparam_t& parameter);
+  virtual void removeFD(callbacktable_t& cbtable, int fd);
   string getName()
   {
     return "epoll";
@@ -72,27 +72,26 @@ EpollFDMultiplexer::EpollFDMultiplexer() : d_eevents(new epoll_event[s_maxevents
     
 }
 
-void EpollFDMultiplexer::addFD(callbackmap_t& cbmap, int fd, callbackfunc_t toDo, const funcparam_t& parameter)
+void EpollFDMultiplexer::addFD(callbacktable_t& cbtable, int fd, callbackfunc_t toDo, const funcparam_t& parameter)
 {
-  accountingAddFD(cbmap, fd, toDo, parameter);
+  accountingAddFD(cbtable, fd, toDo, parameter);
 
   struct epoll_event eevent;
   
-  eevent.events = (&cbmap == &d_readCallbacks) ? EPOLLIN : EPOLLOUT;
+  eevent.events = (&cbtable == &d_readCallbacks) ? EPOLLIN : EPOLLOUT;
   
   eevent.data.u64=0; // placate valgrind (I love it so much)
   eevent.data.fd=fd; 
 
   if(epoll_ctl(d_epollfd, EPOLL_CTL_ADD, fd, &eevent) < 0) {
-    cbmap.erase(fd);
+    accountingRemoveFD(cbtable, fd);
     throw FDMultiplexerException("Adding fd to epoll set: "+stringerror());
   }
 }
 
-void EpollFDMultiplexer::removeFD(callbackmap_t& cbmap, int fd)
+void EpollFDMultiplexer::removeFD(callbacktable_t& cbtable, int fd)
 {
-  if(!cbmap.erase(fd))
-    throw FDMultiplexerException("Tried to remove unlisted fd "+lexical_cast<string>(fd)+ " from multiplexer");
+  accountingRemoveFD(cbtable, fd);
 
   struct epoll_event dummy;
   dummy.events = 0;
@@ -119,17 +118,9 @@ int EpollFDMultiplexer::run(struct timeval* now)
 
   d_inrun=true;
   for(int n=0; n < ret; ++n) {
-    d_iter=d_readCallbacks.find(d_eevents[n].data.fd);
-    
-    if(d_iter != d_readCallbacks.end()) {
-      d_iter->second.d_callback(d_iter->first, d_iter->second.d_parameter);
+    if(dispatch(d_readCallbacks, d_eevents[n].data.fd))
       continue; // so we don't refind ourselves as writable!
-    }
-    d_iter=d_writeCallbacks.find(d_eevents[n].data.fd);
-    
-    if(d_iter != d_writeCallbacks.end()) {
-      d_iter->second.d_callback(d_iter->first, d_iter->second.d_parameter);
-    }
+    dispatch(d_writeCallbacks, d_eevents[n].data.fd);
   }
   d_inrun=false;
   return 0;
@@ -139,7 +130,7 @@ int EpollFDMultiplexer::run(struct timeval* now)
 void acceptData(int fd, funcparam_t& parameter)
 {
   cout<<"Have data on fd "<<fd<<endl;
-  Socket* sock=funcparam_t_cast<Socket*>(parameter);
+  Socket* sock=funcparam_cast<Socket*>(parameter);
   string packet;
   IPEndpoint rem;
   sock->recvFrom(packet, rem);
@@ -55,6 +55,20 @@ union ComboAddress {
       return memcmp(&sin6.sin6_addr.s6_addr, &rhs.sin6.sin6_addr.s6_addr, 16)==0;
   }
 
+  //! hashes what operator== compares, mixed into init as with pdns_hashmix()
+  uint32_t hash(uint32_t init=2166136261U) const
+  {
+    uint32_t ret=pdns_hashmix(init, sin4.sin_family | (sin4.sin_port << 16));
+    if(sin4.sin_family == AF_INET)
+      return pdns_hashmix(ret, sin4.sin_addr.s_addr);
+    for(int n=0; n < 16; n+=4) {
+      uint32_t part;
+      memcpy(&part, sin6.sin6_addr.s6_addr + n, sizeof(part));
+      ret=pdns_hashmix(ret, part);
+    }
+    return ret;
+  }
+
   bool operator<(const ComboAddress& rhs) const
   {
     if(boost::tie(sin4.sin_family, sin4.sin_port) < boost::tie(rhs.sin4.sin_family, rhs.sin4.sin_port))
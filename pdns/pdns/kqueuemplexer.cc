@@ -25,8 +25,8 @@ public:
 
   virtual int run(struct timeval* tv);
 
-  virtual void addFD(callbackmap_t& cbmap, int fd, callbackfunc_t toDo, const boost::any& parameter);
-  virtual void removeFD(callbackmap_t& cbmap, int fd);
+  virtual void addFD(callbacktable_t& cbtable, int fd, callbackfunc_t toDo, const funcparam_t& parameter);
+  virtual void removeFD(callbacktable_t& cbtable, int fd);
   string getName()
   {
     return "kqueue";
@@ -58,25 +58,25 @@ KqueueFDMultiplexer::KqueueFDMultiplexer() : d_kevents(new struct kevent[s_maxev
     throw FDMultiplexerException("Setting up kqueue: "+stringerror());
 }
 
-void KqueueFDMultiplexer::addFD(callbackmap_t& cbmap, int fd, callbackfunc_t toDo, const boost::any& parameter)
+void KqueueFDMultiplexer::addFD(callbacktable_t& cbtable, int fd, callbackfunc_t toDo, const funcparam_t& parameter)
 {
-  accountingAddFD(cbmap, fd, toDo, parameter);
+  accountingAddFD(cbtable, fd, toDo, parameter);
 
   struct kevent kqevent;
-  EV_SET(&kqevent, fd, (&cbmap == &d_readCallbacks) ? EVFILT_READ : EVFILT_WRITE, EV_ADD, 0,0,0);
+  EV_SET(&kqevent, fd, (&cbtable == &d_readCallbacks) ? EVFILT_READ : EVFILT_WRITE, EV_ADD, 0,0,0);
   
   if(kevent(d_kqueuefd, &kqevent, 1, 0, 0, 0) < 0) {
-    cbmap.erase(fd);
+    accountingRemoveFD(cbtable, fd);
     throw FDMultiplexerException("Adding fd to kqueue set: "+stringerror());
   }
 }
 
-void KqueueFDMultiplexer::removeFD(callbackmap_t& cbmap, int fd)
+void KqueueFDMultiplexer::removeFD(callbacktable_t& cbtable, int fd)
 {
-  accountingRemoveFD(cbmap, fd);
+  accountingRemoveFD(cbtable, fd);
 
   struct kevent kqevent;
-  EV_SET(&kqevent, fd, (&cbmap == &d_readCallbacks) ? EVFILT_READ : EVFILT_WRITE, EV_DELETE, 0,0,0);
+  EV_SET(&kqevent, fd, (&cbtable == &d_readCallbacks) ? EVFILT_READ : EVFILT_WRITE, EV_DELETE, 0,0,0);
   
   if(kevent(d_kqueuefd, &kqevent, 1, 0, 0, 0) < 0) // ponder putting Callback back on the map..
     throw FDMultiplexerException("Removing fd from kqueue set: "+stringerror());
@@ -104,17 +104,9 @@ int KqueueFDMultiplexer::run(struct timeval* now)
   d_inrun=true;
 
   for(int n=0; n < ret; ++n) {
-    d_iter=d_readCallbacks.find(d_kevents[n].ident);
-    if(d_iter != d_readCallbacks.end()) {
-      d_iter->second.d_callback(d_iter->first, d_iter->second.d_parameter);
+    if(dispatch(d_readCallbacks, d_kevents[n].ident))
       continue; // so we don't find ourselves as writable again
-    }
-
-    d_iter=d_writeCallbacks.find(d_kevents[n].ident);
-
-    if(d_iter != d_writeCallbacks.end()) {
-      d_iter->second.d_callback(d_iter->first, d_iter->second.d_parameter);
-    }
+    dispatch(d_writeCallbacks, d_kevents[n].ident);
   }
 
   d_inrun=false;
@@ -122,10 +114,10 @@ int KqueueFDMultiplexer::run(struct timeval* now)
 }
 
 #if 0
-void acceptData(int fd, boost::any& parameter)
+void acceptData(int fd, FDMultiplexer::funcparam_t& parameter)
 {
   cout<<"Have data on fd "<<fd<<endl;
-  Socket* sock=boost::any_cast<Socket*>(parameter);
+  Socket* sock=funcparam_cast<Socket*>(parameter);
   string packet;
   IPEndpoint rem;
   sock->recvFrom(packet, rem);
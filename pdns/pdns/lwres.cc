@@ -97,15 +97,16 @@ int asyncresolve(const ComboAddress& ip, const string& domain, int type, bool do
     if(ip.sin4.sin_family==AF_INET6)
       g_stats.ipv6queries++;
 
+    // if this gets chained onto an identical query that is already out, ping becomes what that one sent
     if((ret=asendto((const char*)&*vpacket.begin(), (int)vpacket.size(), 0, ip, pw.getHeader()->id, 
-        	    domain, type, &queryfd)) < 0) {
+        	    domain, type, EDNS0Level, &ping, &queryfd)) < 0) {
       return ret; // passes back the -2 EMFILE
     }
   
     // sleep until we see an answer to this, interface to mtasker
     
     ret=arecvfrom(reinterpret_cast<char *>(buf.get()), bufsize-1,0, ip, &len, pw.getHeader()->id, 
-        	  domain, type, queryfd, now);
+        	  domain, type, EDNS0Level, ping, queryfd, now);
   }
   else {
     try {
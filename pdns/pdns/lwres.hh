@@ -41,9 +41,9 @@
 #include "namespaces.hh"
 
 int asendto(const char *data, int len, int flags, const ComboAddress& ip, uint16_t id, 
-            const string& domain, uint16_t qtype,  int* fd);
+            const string& domain, uint16_t qtype, int ednsLevel, string* ping, int* fd);
 int arecvfrom(char *data, int len, int flags, const ComboAddress& ip, int *d_len, uint16_t id, 
-              const string& domain, uint16_t, int fd, struct timeval* now);
+              const string& domain, uint16_t qtype, int ednsLevel, const string& ping, int fd, struct timeval* now);
 
 class LWResException : public AhuException
 {
@@ -336,6 +336,33 @@ inline bool pdns_iequals(const std::string& a, const std::string& b)
   return aLen == bLen; // strings are equal (in length)
 }
 
+//! case insensitive FNV-1a hash, so 'www.PowerDNS.com' and 'www.powerdns.com' hash the same. Pass a previous hash as 'init' to chain fields
+inline uint32_t pdns_ihash(const char* data, size_t len, uint32_t init=2166136261U) __attribute__((pure));
+inline uint32_t pdns_ihash(const char* data, size_t len, uint32_t init)
+{
+  uint32_t ret=init;
+  for(const char* end=data+len; data != end; ++data) {
+    ret ^= (unsigned char)dns_tolower(*data);
+    ret *= 16777619U;
+  }
+  return ret;
+}
+
+inline uint32_t pdns_ihash(const std::string& str, uint32_t init=2166136261U)
+{
+  return pdns_ihash(str.c_str(), str.length(), init);
+}
+
+//! mix an integer field into a hash started with pdns_ihash()
+inline uint32_t pdns_hashmix(uint32_t hash, uint32_t value)
+{
+  for(int n=0; n < 4; ++n, value >>= 8) {
+    hash ^= (value & 0xff);
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
 // lifted from boost, with thanks
 class AtomicCounter
 {
@@ -1,17 +1,113 @@
 #ifndef PDNS_MPLEXER_HH
 #define PDNS_MPLEXER_HH
 #include <boost/function.hpp>
-#include <boost/any.hpp>
+#include <boost/static_assert.hpp>
 #include <boost/shared_array.hpp>
 #include <boost/tuple/tuple.hpp>
 #include <boost/tuple/tuple_comparison.hpp>
 #include <boost/lexical_cast.hpp>
 #include <vector>
 #include <map>
+#include <deque>
+#include <algorithm>
+#include <new>
+#include <string.h>
+#include <inttypes.h>
 #include <stdexcept>
 #include <string>
 #include "utility.hh"
 
+/** The parameter that goes with an fd in the multiplexer. It holds a copy of a value of any type of up to
+    s_size bytes in place, so unlike boost::any, adding an fd does not allocate. Get the value back out
+    with funcparam_cast<T>(), which works like any_cast<T>() */
+class FDMultiplexerParameter
+{
+public:
+  static const size_t s_size=256;
+
+  FDMultiplexerParameter() : d_ops(0)
+  {}
+
+  template<typename T> FDMultiplexerParameter(const T& val) : d_ops(&Ops<T>::s_ops)
+  {
+    BOOST_STATIC_ASSERT(sizeof(T) <= s_size);
+    new(d_storage.d_buf) T(val);
+  }
+
+  FDMultiplexerParameter(const FDMultiplexerParameter& rhs) : d_ops(rhs.d_ops)
+  {
+    if(d_ops)
+      d_ops->copy(d_storage.d_buf, rhs.d_storage.d_buf);
+  }
+
+  FDMultiplexerParameter& operator=(const FDMultiplexerParameter& rhs)
+  {
+    if(this != &rhs) {
+      clear();
+      if(rhs.d_ops)
+        rhs.d_ops->copy(d_storage.d_buf, rhs.d_storage.d_buf);
+      d_ops=rhs.d_ops;
+    }
+    return *this;
+  }
+
+  ~FDMultiplexerParameter()
+  {
+    clear();
+  }
+
+  bool empty() const
+  {
+    return !d_ops;
+  }
+
+  void clear()
+  {
+    if(d_ops) {
+      d_ops->destroy(d_storage.d_buf);
+      d_ops=0;
+    }
+  }
+
+  //! 0 if we hold no T
+  template<typename T> T* get()
+  {
+    return d_ops == &Ops<T>::s_ops ? reinterpret_cast<T*>(d_storage.d_buf) : 0;
+  }
+
+private:
+  struct ops_t
+  {
+    void (*copy)(void* to, const void* from);
+    void (*destroy)(void* what);
+  };
+
+  // one set of ops per type, its address tells us what we hold
+  template<typename T> struct Ops
+  {
+    static void copy(void* to, const void* from)
+    {
+      new(to) T(*static_cast<const T*>(from));
+    }
+    static void destroy(void* what)
+    {
+      static_cast<T*>(what)->~T();
+    }
+    static const ops_t s_ops;
+  };
+
+  union
+  {
+    char d_buf[s_size];
+    long double d_align1;
+    void* d_align2;
+    uint64_t d_align3;
+  } d_storage;
+  const ops_t* d_ops;
+};
+
+template<typename T> const FDMultiplexerParameter::ops_t FDMultiplexerParameter::Ops<T>::s_ops = { &Ops<T>::copy, &Ops<T>::destroy };
+
 class FDMultiplexerException : public std::runtime_error
 {
 public:
@@ -19,31 +115,51 @@ public:
   {}
 };
 
+template<typename T> T* funcparam_cast(FDMultiplexerParameter* param)
+{
+  return param ? param->get<T>() : 0;
+}
+
+template<typename T> T& funcparam_cast(FDMultiplexerParameter& param)
+{
+  T* ret=param.get<T>();
+  if(!ret)
+    throw FDMultiplexerException("multiplexer parameter is not of the requested type");
+  return *ret;
+}
 
-/** Very simple FD multiplexer, based on callbacks and boost::any parameters
+/** Very simple FD multiplexer, based on callbacks and typed parameters
     As a special service, this parameter is kept around and can be modified, 
     allowing for state to be stored inside the multiplexer.
 
+    The callbacks live in tables indexed by fd, the backends only tell us which fds are ready. Read 
+    timeouts are kept in a heap, so getTimeouts() only looks at what expired.
+
     It has some "interesting" semantics
 */
 
 class FDMultiplexer
 {
 public:
-  //  typedef boost::variant<PacketID, TCPConnection> funcparam_t;
-  typedef boost::any funcparam_t;
+  typedef FDMultiplexerParameter funcparam_t;
 protected:
 
   typedef boost::function< void(int, funcparam_t&) > callbackfunc_t;
   struct Callback
   {
+    Callback() : d_active(false), d_ttdGeneration(0)
+    {
+      memset(&d_ttd, 0, sizeof(d_ttd));
+    }
     callbackfunc_t d_callback;
     funcparam_t d_parameter;
     struct timeval d_ttd;
+    bool d_active;
+    uint32_t d_ttdGeneration; //!< bumped whenever d_ttd changes, so outdated heap entries can be recognised
   };
 
 public:
-  FDMultiplexer() : d_inrun(false)
+  FDMultiplexer() : d_inrun(false), d_numReadFDs(0)
   {}
   virtual ~FDMultiplexer()
   {}
@@ -78,25 +194,47 @@ public:
 
   virtual void setReadTTD(int fd, struct timeval tv, int timeout)
   {
-    if(!d_readCallbacks.count(fd))
+    Callback* cb=getCallback(d_readCallbacks, fd);
+    if(!cb)
       throw FDMultiplexerException("attempt to timestamp fd not in the multiplexer");
     tv.tv_sec += timeout;
-    d_readCallbacks[fd].d_ttd=tv;
+    cb->d_ttd=tv;
+    cb->d_ttdGeneration++;
+
+    TTD ttd;
+    ttd.d_ttd=tv;
+    ttd.d_fd=fd;
+    ttd.d_generation=cb->d_ttdGeneration;
+    d_ttds.push_back(ttd);
+    std::push_heap(d_ttds.begin(), d_ttds.end(), TTD::later);
+
+    if(d_ttds.size() > 2*d_numReadFDs + 64) // too many entries for fds that went away or got a new ttd
+      rebuildTTDs();
   }
 
   virtual funcparam_t& getReadParameter(int fd) 
   {
-    if(!d_readCallbacks.count(fd))
+    Callback* cb=getCallback(d_readCallbacks, fd);
+    if(!cb)
       throw FDMultiplexerException("attempt to look up data in multiplexer for unlisted fd "+boost::lexical_cast<std::string>(fd));
-    return d_readCallbacks[fd].d_parameter;
+    return cb->d_parameter;
   }
 
+  //! returns the read fds whose ttd is before tv. Each ttd is reported once, the caller is expected to remove the fd
   virtual std::vector<std::pair<int, funcparam_t> > getTimeouts(const struct timeval& tv)
   {
     std::vector<std::pair<int, funcparam_t> > ret;
-    for(callbackmap_t::iterator i=d_readCallbacks.begin(); i!=d_readCallbacks.end(); ++i)
-      if(i->second.d_ttd.tv_sec && boost::tie(tv.tv_sec, tv.tv_usec) > boost::tie(i->second.d_ttd.tv_sec, i->second.d_ttd.tv_usec)) 
-        ret.push_back(std::make_pair(i->first, i->second.d_parameter));
+    while(!d_ttds.empty() && boost::tie(tv.tv_sec, tv.tv_usec) > boost::tie(d_ttds.front().d_ttd.tv_sec, d_ttds.front().d_ttd.tv_usec)) {
+      TTD ttd=d_ttds.front();
+      std::pop_heap(d_ttds.begin(), d_ttds.end(), TTD::later);
+      d_ttds.pop_back();
+
+      Callback* cb=getCallback(d_readCallbacks, ttd.d_fd);
+      if(!cb || cb->d_ttdGeneration != ttd.d_generation)
+        continue;
+      memset(&cb->d_ttd, 0, sizeof(cb->d_ttd));
+      ret.push_back(std::make_pair(ttd.d_fd, cb->d_parameter));
+    }
     return ret;
   }
 
@@ -113,31 +251,96 @@ public:
 
 
 protected:
-  typedef std::map<int, Callback> callbackmap_t;
-  callbackmap_t d_readCallbacks, d_writeCallbacks;
+  /* indexed by fd, unused slots are not d_active. A deque, because it does not move what it holds when it grows, 
+     so the Callback that is running stays put if it adds an fd */
+  typedef std::deque<Callback> callbacktable_t;
+  callbacktable_t d_readCallbacks, d_writeCallbacks;
 
-  virtual void addFD(callbackmap_t& cbmap, int fd, callbackfunc_t toDo, const funcparam_t& parameter)=0;
-  virtual void removeFD(callbackmap_t& cbmap, int fd)=0;
+  virtual void addFD(callbacktable_t& cbtable, int fd, callbackfunc_t toDo, const funcparam_t& parameter)=0;
+  virtual void removeFD(callbacktable_t& cbtable, int fd)=0;
   bool d_inrun;
-  callbackmap_t::iterator d_iter;
 
-  void accountingAddFD(callbackmap_t& cbmap, int fd, callbackfunc_t toDo, const funcparam_t& parameter)
+  static Callback* getCallback(callbacktable_t& cbtable, int fd)
   {
-    Callback cb;
+    if(fd < 0 || (unsigned int)fd >= cbtable.size() || !cbtable[fd].d_active)
+      return 0;
+    return &cbtable[fd];
+  }
+
+  //! runs the callback for fd if there is one, returns if there was
+  static bool dispatch(callbacktable_t& cbtable, int fd)
+  {
+    Callback* cb=getCallback(cbtable, fd);
+    if(!cb)
+      return false;
+    cb->d_callback(fd, cb->d_parameter);
+    return true;
+  }
+
+  void accountingAddFD(callbacktable_t& cbtable, int fd, callbackfunc_t toDo, const funcparam_t& parameter)
+  {
+    if(fd < 0)
+      throw FDMultiplexerException("Tried to add invalid fd "+boost::lexical_cast<std::string>(fd)+ " to multiplexer");
+    if(getCallback(cbtable, fd))
+      throw FDMultiplexerException("Tried to add fd "+boost::lexical_cast<std::string>(fd)+ " to multiplexer twice");
+    if((unsigned int)fd >= cbtable.size())
+      cbtable.resize(fd+1);
+
+    Callback& cb=cbtable[fd];
     cb.d_callback=toDo;
     cb.d_parameter=parameter;
     memset(&cb.d_ttd, 0, sizeof(cb.d_ttd));
-  
-    if(cbmap.count(fd))
-      throw FDMultiplexerException("Tried to add fd "+boost::lexical_cast<std::string>(fd)+ " to multiplexer twice");
-    cbmap[fd]=cb;
+    cb.d_active=true;
+    if(&cbtable == &d_readCallbacks)
+      d_numReadFDs++;
   }
 
-  void accountingRemoveFD(callbackmap_t& cbmap, int fd) 
+  void accountingRemoveFD(callbacktable_t& cbtable, int fd) 
   {
-    if(!cbmap.erase(fd)) 
+    Callback* cb=getCallback(cbtable, fd);
+    if(!cb)
       throw FDMultiplexerException("Tried to remove unlisted fd "+boost::lexical_cast<std::string>(fd)+ " from multiplexer");
+    cb->d_active=false;
+    cb->d_callback.clear();
+    cb->d_parameter.clear();
+    memset(&cb->d_ttd, 0, sizeof(cb->d_ttd));
+    cb->d_ttdGeneration++;
+    if(&cbtable == &d_readCallbacks)
+      d_numReadFDs--;
   }
+
+private:
+  struct TTD
+  {
+    struct timeval d_ttd;
+    int d_fd;
+    uint32_t d_generation;
+
+    //! makes the heap a min-heap
+    static bool later(const TTD& a, const TTD& b)
+    {
+      return boost::tie(a.d_ttd.tv_sec, a.d_ttd.tv_usec) > boost::tie(b.d_ttd.tv_sec, b.d_ttd.tv_usec);
+    }
+  };
+
+  void rebuildTTDs()
+  {
+    d_ttds.clear();
+    for(unsigned int fd=0; fd < d_readCallbacks.size(); ++fd) {
+      const Callback& cb=d_readCallbacks[fd];
+      if(!cb.d_active || !cb.d_ttd.tv_sec)
+        continue;
+      TTD ttd;
+      ttd.d_ttd=cb.d_ttd;
+      ttd.d_fd=fd;
+      ttd.d_generation=cb.d_ttdGeneration;
+      d_ttds.push_back(ttd);
+    }
+    std::make_heap(d_ttds.begin(), d_ttds.end(), TTD::later);
+  }
+
+  std::vector<TTD> d_ttds; //!< heap of read ttds, entries whose generation no longer matches are skipped
+  unsigned int d_numReadFDs;
 };
 
 class SelectFDMultiplexer : public FDMultiplexer
@@ -150,8 +353,8 @@ public:
 
   virtual int run(struct timeval* tv);
 
-  virtual void addFD(callbackmap_t& cbmap, int fd, callbackfunc_t toDo, const funcparam_t& parameter);
-  virtual void removeFD(callbackmap_t& cbmap, int fd);
+  virtual void addFD(callbacktable_t& cbtable, int fd, callbackfunc_t toDo, const funcparam_t& parameter);
+  virtual void removeFD(callbacktable_t& cbtable, int fd);
   std::string getName()
   {
     return "select";
@@ -0,0 +1,98 @@
+#ifndef PDNS_MPMCQUEUE_HH
+#define PDNS_MPMCQUEUE_HH
+#include <boost/utility.hpp>
+
+/* Bounded multi-producer, multi-consumer queue that does not take locks. Every cell carries a
+   sequence number that tells producers and consumers whose turn it is, so push() and pop() only
+   contend on a compare-and-swap of the head or tail position. Based on Dmitry Vyukov's bounded MPMC queue.
+
+   The size is rounded up to a power of two. push() returns false when the queue is full, pop() when it is empty,
+   neither ever blocks - callers that want to wait have to arrange that themselves (see the Distributor) */
+
+template<typename T> class MPMCQueue : public boost::noncopyable
+{
+public:
+  explicit MPMCQueue(unsigned int size) : d_head(0), d_tail(0)
+  {
+    unsigned int capacity=2;
+    while(capacity < size)
+      capacity <<= 1;
+    d_mask=capacity-1;
+    d_cells=new Cell[capacity];
+    for(unsigned int n=0; n < capacity; ++n)
+      d_cells[n].seq=n;
+  }
+
+  ~MPMCQueue()
+  {
+    delete[] d_cells;
+  }
+
+  bool push(const T& t)
+  {
+    Cell* cell;
+    unsigned int pos=d_head;
+    for(;;) {
+      cell=&d_cells[pos & d_mask];
+      unsigned int seq=cell->seq;
+      __sync_synchronize();
+      int dif=(int)(seq - pos);
+      if(!dif) {
+        if(__sync_bool_compare_and_swap(&d_head, pos, pos+1))
+          break;
+      }
+      else if(dif < 0)
+        return false; // full
+      pos=d_head;
+    }
+    cell->data=t;
+    __sync_synchronize();
+    cell->seq=pos+1;
+    return true;
+  }
+
+  bool pop(T& t)
+  {
+    Cell* cell;
+    unsigned int pos=d_tail;
+    for(;;) {
+      cell=&d_cells[pos & d_mask];
+      unsigned int seq=cell->seq;
+      __sync_synchronize();
+      int dif=(int)(seq - (pos+1));
+      if(!dif) {
+        if(__sync_bool_compare_and_swap(&d_tail, pos, pos+1))
+          break;
+      }
+      else if(dif < 0)
+        return false; // empty
+      pos=d_tail;
+    }
+    t=cell->data;
+    __sync_synchronize();
+    cell->seq=pos+d_mask+1;
+    return true;
+  }
+
+  unsigned int capacity() const
+  {
+    return d_mask+1;
+  }
+
+private:
+  struct Cell
+  {
+    volatile unsigned int seq;
+    T data;
+  };
+
+  Cell* d_cells;
+  unsigned int d_mask;
+  char d_pad1[64]; // keep producers and consumers off each others cache line
+  volatile unsigned int d_head;
+  char d_pad2[64];
+  volatile unsigned int d_tail;
+  char d_pad3[64];
+};
+
+#endif
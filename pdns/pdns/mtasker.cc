@@ -18,6 +18,9 @@
 #include "mtasker.hh"
 #include <stdio.h>
 #include <iostream>
+#include <sys/mman.h>
+#include <unistd.h>
+
 
 /** \page MTasker
     Simple system for implementing cooperative multitasking of functions, with 
@@ -31,7 +34,7 @@
     code that would ordinarily require a statemachine, for which the author does not consider 
     himself smart enough.
 
-    This class does not perform any magic it only makes calls to makecontext() and swapcontext(). 
+    This class does not perform any magic it only switches between stacks, see mtasker_context.hh. 
     Getting the details right however is complicated and MTasker does that for you.
 
     If preemptive multitasking or more advanced concepts such as semaphores, locks or mutexes
@@ -158,37 +161,36 @@ int main()
     \return returns -1 in case of error, 0 in case of timeout, 1 in case of an answer 
 */
 
-template<class EventKey, class EventVal>int MTasker<EventKey,EventVal>::waitEvent(EventKey &key, EventVal *val, unsigned int timeoutMsec, struct timeval* now)
+template<class EventKey, class EventVal, class PH, class PE>int MTasker<EventKey,EventVal,PH,PE>::waitEvent(EventKey &key, EventVal *val, unsigned int timeoutMsec, struct timeval* now)
 {
-  if(d_waiters.count(key)) { // there was already an exact same waiter
-    return -1;
-  }
-
   Waiter w;
-  w.context=new ucontext_t;
+  w.context=&d_threads[d_tid].context;
+
   w.ttd.tv_sec = 0; w.ttd.tv_usec = 0;
+  struct timeval realnow;
   if(timeoutMsec) {
     struct timeval increment;
     increment.tv_sec = timeoutMsec / 1000;
     increment.tv_usec = 1000 * (timeoutMsec % 1000);
     if(now) 
-      w.ttd = increment + *now;
-    else {
-      struct timeval realnow;
+      realnow = *now;
+    else 
       gettimeofday(&realnow, 0);
-      w.ttd = increment + realnow;
-    }
+    w.ttd = increment + realnow;
   }
 
   w.tid=d_tid;
   w.key=key;
 
-  d_waiters.insert(w);
+  pair<typename waiters_t::iterator, bool> res=d_waiters.insert(w);
+  if(!res.second) // there was already an exact same waiter
+    return -1;
+  const Waiter& waiter=*res.first;
+  if(timeoutMsec)
+    d_timers.add(&waiter, timerMsec(w.ttd) + 1, timerMsec(realnow)); // +1 so we only time out once ttd has passed
   
-  if(swapcontext(d_waiters.find(key)->context,&d_kernel)) { // 'A' will return here when 'key' has arrived, hands over control to kernel first
-    perror("swapcontext");
-    exit(EXIT_FAILURE); // no way we can deal with this 
-  }
+  switchTo(*w.context, d_kernel); // 'A' will return here when 'key' has arrived, hands over control to kernel first
+
   if(val && d_waitstatus==Answer) 
     *val=d_waitval;
   d_tid=w.tid;
@@ -202,13 +204,11 @@ template<class EventKey, class EventVal>int MTasker<EventKey,EventVal>::waitEven
 //! yields control to the kernel or other threads
 /** Hands over control to the kernel, allowing other processes to run, or events to arrive */
 
-template<class Key, class Val>void MTasker<Key,Val>::yield()
+template<class Key, class Val, class PH, class PE>void MTasker<Key,Val,PH,PE>::yield()
 {
   d_runQueue.push(d_tid);
-  if(swapcontext(d_threads[d_tid].context ,&d_kernel) < 0) { // give control to the kernel
-    perror("swapcontext in  yield");
-    exit(EXIT_FAILURE);
-  }
+  switchTo(d_threads[d_tid].context, d_kernel); // give control to the kernel
+
 }
 
 //! reports that an event took place for which threads may be waiting
@@ -219,7 +219,7 @@ template<class Key, class Val>void MTasker<Key,Val>::yield()
 
     WARNING: when passing val as zero, d_waitval is undefined, and hence waitEvent will return undefined!
 */
-template<class EventKey, class EventVal>int MTasker<EventKey,EventVal>::sendEvent(const EventKey& key, const EventVal* val)
+template<class EventKey, class EventVal, class PH, class PE>int MTasker<EventKey,EventVal,PH,PE>::sendEvent(const EventKey& key, const EventVal* val)
 {
   typename waiters_t::iterator waiter=d_waiters.find(key);
 
@@ -232,49 +232,60 @@ template<class EventKey, class EventVal>int MTasker<EventKey,EventVal>::sendEven
   if(val)
     d_waitval=*val;
   
-  ucontext_t *userspace=waiter->context;
+  pdns_ucontext_t *userspace=waiter->context;
   d_tid=waiter->tid;         // set tid 
   d_eventkey=waiter->key;        // pass waitEvent the exact key it was woken for
+  d_timers.remove(&*waiter);
   d_waiters.erase(waiter);             // removes the waitpoint 
-  if(swapcontext(&d_kernel,userspace)) { // swaps back to the above point 'A'
-    perror("swapcontext in sendEvent");
-    exit(EXIT_FAILURE);
-  }
-  delete userspace;
+  switchTo(d_kernel, *userspace); // swaps back to the above point 'A'
   return 1;
 }
 
-inline pair<uint32_t, uint32_t> splitPointer(void *ptr)
+//! hands out a stack of d_stacksize bytes with a guard page below it, reusing those of exited threads
+template<class Key, class Val, class PH, class PE>char* MTasker<Key,Val,PH,PE>::getStack()
 {
-  uint64_t ll = (uint64_t) ptr;
-  return make_pair(ll >> 32, ll & 0xffffffff);
+  if(!d_freeStacks.empty()) {
+    char* stack=d_freeStacks.back();
+    d_freeStacks.pop_back();
+    return stack;
+  }
+  size_t pagesize=getpagesize();
+  size_t size=(d_stacksize + pagesize - 1) / pagesize * pagesize;
+  char* mem=(char*)mmap(0, size + pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if(mem == MAP_FAILED) {
+    perror("mmap of MThread stack");
+    exit(EXIT_FAILURE);
+  }
+  if(mprotect(mem, pagesize, PROT_NONE) < 0) // stacks grow down, so this catches overflows
+    perror("mprotect of MThread stack guard page");
+  d_stacksAllocated++;
+  return mem + pagesize;
 }
 
-inline void* joinPtr(uint32_t val1, uint32_t val2)
+template<class Key, class Val, class PH, class PE>MTasker<Key,Val,PH,PE>::~MTasker()
 {
-  return (void*)(((uint64_t)val1 << 32) | (uint64_t)val2);
+  size_t pagesize=getpagesize();
+  size_t size=(d_stacksize + pagesize - 1) / pagesize * pagesize + pagesize;
+  for(typename mthreads_t::const_iterator i=d_threads.begin(); i != d_threads.end(); ++i)
+    d_freeStacks.push_back(i->second.stack);
+  for(std::vector<char*>::const_iterator i=d_freeStacks.begin(); i != d_freeStacks.end(); ++i)
+    munmap(*i - pagesize, size);
 }
 
+
+
 //! launches a new thread
 /** The kernel can call this to make a new thread, which starts at the function start and gets passed the val void pointer.
     \param start Pointer to the function which will form the start of the thread
     \param val A void pointer that can be used to pass data to the thread
 */
-template<class Key, class Val>void MTasker<Key,Val>::makeThread(tfunc_t *start, void* val)
+template<class Key, class Val, class PH, class PE>void MTasker<Key,Val,PH,PE>::makeThread(tfunc_t *start, void* val)
 {
-  ucontext_t *uc=new ucontext_t;
-  getcontext(uc);
-  
-  uc->uc_link = &d_kernel; // come back to kernel after dying
-  uc->uc_stack.ss_sp = new char[d_stacksize];
-  
-  uc->uc_stack.ss_size = d_stacksize;
-  pair<uint32_t, uint32_t> valpair = splitPointer(val);
-  pair<uint32_t, uint32_t> thispair = splitPointer(this);
-
-  makecontext (uc, (void (*)(void))threadWrapper, 6, thispair.first, thispair.second, start, d_maxtid, valpair.first, valpair.second);
-
-  d_threads[d_maxtid].context = uc;
+  ThreadInfo& ti=d_threads[d_maxtid];
+  ti.start=start;
+  ti.val=val;
+  ti.stack=getStack();
+  pdns_makecontext(ti.context, ti.stack, d_stacksize, threadWrapper, this);
   d_runQueue.push(d_maxtid++); // will run at next schedule invocation
 }
 
@@ -289,22 +300,20 @@ template<class Key, class Val>void MTasker<Key,Val>::makeThread(tfunc_t *start,
     \return Returns if there is more work scheduled and recalling schedule now would be useful
       
 */
-template<class Key, class Val>bool MTasker<Key,Val>::schedule(struct timeval*  now)
+template<class Key, class Val, class PH, class PE>bool MTasker<Key,Val,PH,PE>::schedule(struct timeval*  now)
 {
   if(!d_runQueue.empty()) {
     d_tid=d_runQueue.front();
-    if(swapcontext(&d_kernel, d_threads[d_tid].context)) {
-      perror("swapcontext in schedule");
-      exit(EXIT_FAILURE);
-    }
+    switchTo(d_kernel, d_threads[d_tid].context);
+
       
     d_runQueue.pop();
     return true;
   }
   if(!d_zombiesQueue.empty()) {
-    delete[] (char *)d_threads[d_zombiesQueue.front()].context->uc_stack.ss_sp;
-    delete d_threads[d_zombiesQueue.front()].context;
-    d_threads.erase(d_zombiesQueue.front());
+    typename mthreads_t::iterator zombie=d_threads.find(d_zombiesQueue.front());
+    d_freeStacks.push_back(zombie->second.stack);
+    d_threads.erase(zombie);
     d_zombiesQueue.pop();
     return true;
   }
@@ -315,25 +324,14 @@ template<class Key, class Val>bool MTasker<Key,Val>::schedule(struct timeval*  n
     else
       rnow = *now;
 
-    typedef typename waiters_t::template index<KeyTag>::type waiters_by_ttd_index_t;
-    //    waiters_by_ttd_index_t& ttdindex=d_waiters.template get<KeyTag>();
-    waiters_by_ttd_index_t& ttdindex=boost::multi_index::get<KeyTag>(d_waiters);
-
-    for(typename waiters_by_ttd_index_t::iterator i=ttdindex.begin(); i != ttdindex.end(); ) {
-      if(i->ttd.tv_sec && i->ttd < rnow) {
-        d_waitstatus=TimeOut;
-        d_eventkey=i->key;        // pass waitEvent the exact key it was woken for
-        ucontext_t* uc = i->context;
-        ttdindex.erase(i++);                  // removes the waitpoint 
-
-        if(swapcontext(&d_kernel, uc)) { // swaps back to the above point 'A'
-          perror("swapcontext in schedule2");
-          exit(EXIT_FAILURE);
-        }
-        delete uc;
-      }
-      else if(i->ttd.tv_sec)
-        break;
+    d_timers.advance(timerMsec(rnow));
+    while(const TimerWheel::Timer* timer=d_timers.popExpired()) {
+      const Waiter& waiter=static_cast<const Waiter&>(*timer);
+      d_waitstatus=TimeOut;
+      d_eventkey=waiter.key;        // pass waitEvent the exact key it was woken for
+      pdns_ucontext_t* uc = waiter.context;
+      d_waiters.erase(d_waiters.iterator_to(waiter));                  // removes the waitpoint 
+      switchTo(d_kernel, *uc); // swaps back to the above point 'A'
     }
   }
   return false;
@@ -343,7 +341,7 @@ template<class Key, class Val>bool MTasker<Key,Val>::schedule(struct timeval*  n
 /** Call this to check if no processes are running anymore
     \return true if no processes are left
  */
-template<class Key, class Val>bool MTasker<Key,Val>::noProcesses()
+template<class Key, class Val, class PH, class PE>bool MTasker<Key,Val,PH,PE>::noProcesses()
 {
   return d_threads.empty();
 }
@@ -352,7 +350,7 @@ template<class Key, class Val>bool MTasker<Key,Val>::noProcesses()
 /** Call this to perhaps limit activities if too many threads are running
     \return number of processes running
  */
-template<class Key, class Val>unsigned int MTasker<Key,Val>::numProcesses()
+template<class Key, class Val, class PH, class PE>unsigned int MTasker<Key,Val,PH,PE>::numProcesses()
 {
   return d_threads.size();
 }
@@ -364,37 +362,40 @@ template<class Key, class Val>unsigned int MTasker<Key,Val>::numProcesses()
 
     \param events Vector which is to be filled with keys threads are waiting for
 */
-template<class Key, class Val>void MTasker<Key,Val>::getEvents(std::vector<Key>& events)
+template<class Key, class Val, class PH, class PE>void MTasker<Key,Val,PH,PE>::getEvents(std::vector<Key>& events)
 {
   events.clear();
   for(typename waiters_t::const_iterator i=d_waiters.begin();i!=d_waiters.end();++i) {
-    events.push_back(i->first);
+    events.push_back(i->key);
   }
 }
 
-template<class Key, class Val>void MTasker<Key,Val>::threadWrapper(uint32_t self1, uint32_t self2, tfunc_t *tf, int tid, uint32_t val1, uint32_t val2)
+template<class Key, class Val, class PH, class PE>void MTasker<Key,Val,PH,PE>::threadWrapper(void* ptr)
 {
-  void* val = joinPtr(val1, val2); 
-  MTasker* self = (MTasker*) joinPtr(self1, self2);
-  self->d_threads[self->d_tid].startOfStack = self->d_threads[self->d_tid].highestStackSeen = (char*)&val;
-  (*tf)(val);
+  MTasker* self = (MTasker*) ptr;
+  int tid = self->d_tid;
+  ThreadInfo& ti = self->d_threads[tid];
+  ti.startOfStack = ti.highestStackSeen = (char*)&tid;
+  (*ti.start)(ti.val);
   self->d_zombiesQueue.push(tid);
   
-  // we now jump to &kernel, automatically
+  // back to the kernel for good, which will recycle our stack
+  pdns_ucontext_t dead;
+  self->switchTo(dead, self->d_kernel);
 }
 
 //! Returns the current Thread ID (tid)
 /** Processes can call this to get a numerical representation of their current thread ID.
     This can be useful for logging purposes.
 */
-template<class Key, class Val>int MTasker<Key,Val>::getTid()
+template<class Key, class Val, class PH, class PE>int MTasker<Key,Val,PH,PE>::getTid()
 {
   return d_tid;
 }
 
 
 //! Returns the maximum stack usage so far of this MThread
-template<class Key, class Val>unsigned int MTasker<Key,Val>::getMaxStackUsage()
+template<class Key, class Val, class PH, class PE>unsigned int MTasker<Key,Val,PH,PE>::getMaxStackUsage()
 {
   return d_threads[d_tid].startOfStack - d_threads[d_tid].highestStackSeen;
 }
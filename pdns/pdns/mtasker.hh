@@ -24,35 +24,45 @@
 #else
 
 #include <signal.h>
-#include <ucontext.h>
 #include <queue>
 #include <vector> 
 #include <map>
 #include <time.h>
 #include <boost/multi_index_container.hpp>
-#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/hashed_index.hpp>
 #include <boost/multi_index/key_extractors.hpp>
+#include <boost/functional/hash.hpp>
+#include "mtasker_context.hh"
+#include "timerwheel.hh"
 #include "namespaces.hh"
 using namespace ::boost::multi_index;
 
-struct KeyTag {};
+struct PartialKeyTag {};
 
 //! The main MTasker class    
 /** The main MTasker class. See the main page for more information.
     \param EventKey Type of the key with which events are to be identified. Defaults to int.
     \param EventVal Type of the content or value of an event. Defaults to int. Cannot be set to void.
-    \note The EventKey needs to have an operator< defined because it is used as the key of an associative array
+    \param PartialHash, PartialEqual Hash and equality of a second, coarser index on the keys of waiters, so the
+           kernel can find all waiters that match part of a key. Default to the full key.
+    \note The EventKey needs operator== and a boost::hash, as waiters are kept in a hash table
 */
-template<class EventKey=int, class EventVal=int> class MTasker
+template<class EventKey=int, class EventVal=int, class PartialHash=boost::hash<EventKey>, class PartialEqual=std::equal_to<EventKey> > class MTasker
 {
+public:
+  typedef void tfunc_t(void *); //!< type of the pointer that starts a thread 
+
 private:
-  ucontext_t d_kernel;     
+  pdns_ucontext_t d_kernel;     
   std::queue<int> d_runQueue;
   std::queue<int> d_zombiesQueue;
 
   struct ThreadInfo
   {
-	ucontext_t* context;
+	pdns_ucontext_t context;
+	tfunc_t* start;
+	void* val;
+	char* stack;
 	char* startOfStack;
 	char* highestStackSeen;
   };
@@ -62,15 +72,20 @@ private:
   int d_tid;
   int d_maxtid;
   size_t d_stacksize;
+  std::vector<char*> d_freeStacks; //!< stacks of exited threads, ready for the next makeThread()
+  TimerWheel d_timers;             //!< timeouts of d_waiters, in msec
+  unsigned int d_stacksAllocated;
+  uint64_t d_switches;
 
   EventVal d_waitval;
   enum waitstatusenum {Error=-1,TimeOut=0,Answer} d_waitstatus;
 
 public:
-  struct Waiter
+  //! a thread waiting for an event, if it has a timeout it is armed in d_timers
+  struct Waiter : public TimerWheel::Timer
   {
     EventKey key;
-    ucontext_t *context;
+    pdns_ucontext_t *context;
     struct timeval ttd;
     int tid;    
   };
@@ -78,24 +93,26 @@ public:
   typedef multi_index_container<
     Waiter,
     indexed_by <
-                ordered_unique<member<Waiter,EventKey,&Waiter::key> >,
-                ordered_non_unique<tag<KeyTag>, member<Waiter,struct timeval,&Waiter::ttd> >
+                hashed_unique<member<Waiter,EventKey,&Waiter::key>, boost::hash<EventKey> >,
+                hashed_non_unique<tag<PartialKeyTag>, member<Waiter,EventKey,&Waiter::key>, PartialHash, PartialEqual>
                >
   > waiters_t;
+  typedef typename waiters_t::template index<PartialKeyTag>::type waiters_by_partial_key_t;
 
   waiters_t d_waiters;
 
   //! Constructor
   /** Constructor with a small default stacksize. If any of your threads exceeds this stack, your application will crash. 
       This limit applies solely to the stack, the heap is not limited in any way. If threads need to allocate a lot of data,
-      the use of new/delete is suggested. 
+      the use of new/delete is suggested. Stacks are followed by a guard page, so overflowing one crashes right away
+      instead of corrupting whatever lies beyond it.
    */
-  MTasker(size_t stacksize=8192) : d_stacksize(stacksize)
+  MTasker(size_t stacksize=8192) : d_stacksize(stacksize), d_stacksAllocated(0), d_switches(0)
   {
     d_maxtid=0;
   }
+  ~MTasker();
 
-  typedef void tfunc_t(void *); //!< type of the pointer that starts a thread 
   int waitEvent(EventKey &key, EventVal *val=0, unsigned int timeoutMsec=0, struct timeval* now=0);
   void yield();
   int sendEvent(const EventKey& key, const EventVal* val=0);
@@ -106,9 +123,29 @@ public:
   unsigned int numProcesses();
   int getTid(); 
   unsigned int getMaxStackUsage();
+  //! number of context switches so far, in and out of threads
+  uint64_t getSwitches() const
+  {
+    return d_switches;
+  }
+  //! number of stacks ever allocated, which is the highest number of threads that ran at the same time
+  unsigned int getStacksAllocated() const
+  {
+    return d_stacksAllocated;
+  }
 
 private:
-  static void threadWrapper(uint32_t self1, uint32_t self2, tfunc_t *tf, int tid, uint32_t val1, uint32_t val2);
+  static void threadWrapper(void* self);
+  char* getStack();
+  static uint64_t timerMsec(const struct timeval& tv)
+  {
+    return tv.tv_sec * 1000ULL + tv.tv_usec / 1000;
+  }
+  void switchTo(pdns_ucontext_t& save, const pdns_ucontext_t& target)
+  {
+    d_switches++;
+    pdns_swapcontext(save, target);
+  }
   EventKey d_eventkey;   // for waitEvent, contains exact key it was awoken for
 };
 #include "mtasker.cc"
@@ -0,0 +1,117 @@
+/*
+    PowerDNS Versatile Database Driven Nameserver
+    Copyright (C) 2002 - 2012  PowerDNS.COM BV
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "mtasker_context.hh"
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#ifdef PDNS_FAST_CONTEXT
+
+extern "C" void pdns_ctx_switch(void** save, void* target);
+extern "C" void pdns_ctx_start();
+
+/* pdns_ctx_switch(save, target) pushes rbp, rbx and r12-r15 plus the SSE and x87 control words, stores the
+   stack pointer in *save, and pops the same from target. A fresh context (see pdns_makecontext) 'returns' into
+   pdns_ctx_start, which calls r12(r13). */
+__asm__ (
+  ".text\n"
+  ".globl pdns_ctx_switch\n"
+  ".type pdns_ctx_switch,@function\n"
+  "pdns_ctx_switch:\n"
+  "  pushq %rbp\n"
+  "  pushq %rbx\n"
+  "  pushq %r12\n"
+  "  pushq %r13\n"
+  "  pushq %r14\n"
+  "  pushq %r15\n"
+  "  subq $8, %rsp\n"
+  "  stmxcsr (%rsp)\n"
+  "  fnstcw 4(%rsp)\n"
+  "  movq %rsp, (%rdi)\n"
+  "  movq %rsi, %rsp\n"
+  "  ldmxcsr (%rsp)\n"
+  "  fldcw 4(%rsp)\n"
+  "  addq $8, %rsp\n"
+  "  popq %r15\n"
+  "  popq %r14\n"
+  "  popq %r13\n"
+  "  popq %r12\n"
+  "  popq %rbx\n"
+  "  popq %rbp\n"
+  "  ret\n"
+  ".size pdns_ctx_switch,.-pdns_ctx_switch\n"
+  ".globl pdns_ctx_start\n"
+  ".type pdns_ctx_start,@function\n"
+  "pdns_ctx_start:\n"
+  "  movq %r13, %rdi\n"
+  "  callq *%r12\n"
+  "  ud2\n"
+  ".size pdns_ctx_start,.-pdns_ctx_start\n"
+  ".section .note.GNU-stack,\"\",@progbits\n"
+  ".text\n"
+);
+
+void pdns_makecontext(pdns_ucontext_t& ctx, char* stack, size_t stacksize, pdns_context_func_t* start, void* arg)
+{
+  // lay out what pdns_ctx_switch expects to pop, so that the stack is 16 byte aligned on entry of pdns_ctx_start
+  uint64_t* sp=(uint64_t*)(((uintptr_t)(stack + stacksize)) & ~(uintptr_t)15);
+  *--sp = (uint64_t)pdns_ctx_start; // return address
+  *--sp = 0;                        // rbp
+  *--sp = 0;                        // rbx
+  *--sp = (uint64_t)start;          // r12
+  *--sp = (uint64_t)arg;            // r13
+  *--sp = 0;                        // r14
+  *--sp = 0;                        // r15
+  *--sp = 0x1f80 | (0x037fULL << 32); // default MXCSR and x87 control word
+  ctx.sp=sp;
+}
+
+void pdns_swapcontext(pdns_ucontext_t& save, const pdns_ucontext_t& target)
+{
+  pdns_ctx_switch(&save.sp, target.sp);
+}
+
+#else
+
+// makecontext() only passes ints, so pointers travel in two halves
+static void contextWrapper(uint32_t start1, uint32_t start2, uint32_t arg1, uint32_t arg2)
+{
+  pdns_context_func_t* start=(pdns_context_func_t*)(((uint64_t)start1 << 32) | start2);
+  void* arg=(void*)(((uint64_t)arg1 << 32) | arg2);
+  (*start)(arg);
+}
+
+void pdns_makecontext(pdns_ucontext_t& ctx, char* stack, size_t stacksize, pdns_context_func_t* start, void* arg)
+{
+  getcontext(&ctx.uc);
+  ctx.uc.uc_link = 0;
+  ctx.uc.uc_stack.ss_sp = stack;
+  ctx.uc.uc_stack.ss_size = stacksize;
+  uint64_t s=(uint64_t)start, a=(uint64_t)arg;
+  makecontext(&ctx.uc, (void (*)(void))contextWrapper, 4, (uint32_t)(s >> 32), (uint32_t)s, (uint32_t)(a >> 32), (uint32_t)a);
+}
+
+void pdns_swapcontext(pdns_ucontext_t& save, const pdns_ucontext_t& target)
+{
+  if(swapcontext(&save.uc, &target.uc)) {
+    perror("swapcontext");
+    exit(EXIT_FAILURE); // no way we can deal with this
+  }
+}
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef MTASKER_CONTEXT_HH
+#define MTASKER_CONTEXT_HH
+#include <stddef.h>
+
+/* The context switch underneath MTasker. On x86_64 a switch saves the callee-saved registers and the
+   floating point control words on the old stack and pops them off the new one, in a handful of instructions.
+   glibc swapcontext() in addition saves the signal mask with a sigprocmask() system call on every switch,
+   which MTasker has no use for. Elsewhere, or when PDNS_USE_UCONTEXT is defined, we fall back to ucontext. */
+
+#if defined(__x86_64__) && defined(__ELF__) && !defined(PDNS_USE_UCONTEXT)
+#define PDNS_FAST_CONTEXT
+struct pdns_ucontext_t
+{
+  void* sp;  //!< where the context was saved, on its own stack
+};
+#else
+#include <ucontext.h>
+struct pdns_ucontext_t
+{
+  ucontext_t uc;
+};
+#endif
+
+typedef void pdns_context_func_t(void*);
+
+//! prepares ctx to call start(arg) on the given stack once switched to. start() must never return, but switch away for good
+void pdns_makecontext(pdns_ucontext_t& ctx, char* stack, size_t stacksize, pdns_context_func_t* start, void* arg);
+//! saves the current context in save and continues in target
+void pdns_swapcontext(pdns_ucontext_t& save, const pdns_ucontext_t& target);
+
+#endif
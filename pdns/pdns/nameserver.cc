@@ -32,6 +32,7 @@
 #include "logger.hh"
 #include "arguments.hh"
 #include "statbag.hh"
+#include "packetcache.hh"
 
 #include "namespaces.hh"
 
@@ -117,14 +118,16 @@ void UDPNameserver::bindIPv4()
     }
 
     locala.sin_port=htons(::arg().asNum("local-port"));
-    
+    setReusePort(s);
+
     if(::bind(s, (sockaddr*)&locala,sizeof(locala))<0) {
       L<<Logger::Error<<"binding UDP socket to '"+localname+"' port "+lexical_cast<string>(ntohs(locala.sin_port))+": "<<strerror(errno)<<endl;
       throw AhuException("Unable to bind to UDP socket");
     }
     d_highfd=max(s,d_highfd);
     d_sockets.push_back(s);
-    L<<Logger::Error<<"UDP server bound to "<<inet_ntoa(locala.sin_addr)<<":"<<::arg().asNum("local-port")<<endl;
+    if(!d_additional_socket)
+      L<<Logger::Error<<"UDP server bound to "<<inet_ntoa(locala.sin_addr)<<":"<<::arg().asNum("local-port")<<endl;
     FD_SET(s, &d_rfds);
   }
 }
@@ -152,6 +155,7 @@ void UDPNameserver::bindIPv6()
     }
     
     ComboAddress locala(localname, ::arg().asNum("local-port"));
+    setReusePort(s);
 
     if(::bind(s, (sockaddr*)&locala, sizeof(locala))<0) {
       L<<Logger::Error<<"binding to UDP ipv6 socket: "<<strerror(errno)<<endl;
@@ -159,14 +163,36 @@ void UDPNameserver::bindIPv6()
     }
     d_highfd=max(s,d_highfd);
     d_sockets.push_back(s);
-    L<<Logger::Error<<"UDPv6 server bound to "<<locala.toStringWithPort()<<endl;
+    if(!d_additional_socket)
+      L<<Logger::Error<<"UDPv6 server bound to "<<locala.toStringWithPort()<<endl;
     FD_SET(s, &d_rfds);
   }
 #endif // WIN32
 }
 
-UDPNameserver::UDPNameserver()
+bool UDPNameserver::canReusePort()
+{
+#ifdef SO_REUSEPORT
+  return true;
+#else
+  return false;
+#endif
+}
+
+void UDPNameserver::setReusePort(int s)
+{
+  if(!::arg().mustDo("reuseport"))
+    return;
+#ifdef SO_REUSEPORT
+  int one=1;
+  if(setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (char*)&one, sizeof(one)) < 0)
+    throw AhuException("Unable to set SO_REUSEPORT on UDP socket: "+stringerror());
+#endif
+}
+
+UDPNameserver::UDPNameserver(bool additional_socket)
 {
+  d_additional_socket=additional_socket;
   d_highfd=0;
   FD_ZERO(&d_rfds);  
   if(!::arg()["local-address"].empty())
@@ -174,7 +200,7 @@ UDPNameserver::UDPNameserver()
   if(!::arg()["local-ipv6"].empty())
     bindIPv6();
 
-  if(::arg()["local-address"].empty() && ::arg()["local-ipv6"].empty()) 
+  if(!additional_socket && ::arg()["local-address"].empty() && ::arg()["local-ipv6"].empty()) 
     L<<Logger::Critical<<"PDNS is deaf and mute! Not listening on any interfaces"<<endl;
     
 }
@@ -190,3 +216,182 @@ void UDPNameserver::send(DNSPacket *p)
     L<<Logger::Error<<"Error sending reply with sendto (socket="<<p->getSocket()<<"): "<<strerror(errno)<<endl;
 }
 
+/** Tries to answer a raw question from the packet cache, and sends out the answer if this works. This skips
+    parsing into a DNSPacket, and with it query logging and the query rings */
+bool UDPNameserver::answerFromWire(Utility::sock_t sock, const ComboAddress& remote, const char *mesg, int len, string& buffer)
+{
+  extern PacketCache PC;
+
+  if(!PC.getFromWire(mesg, len, buffer))
+    return false;
+
+  if(sendto(sock, buffer.c_str(), buffer.length(), 0, (struct sockaddr *)(&remote), remote.getSocklen()) < 0)
+    L<<Logger::Error<<"Error sending reply with sendto (socket="<<sock<<"): "<<strerror(errno)<<endl;
+
+  countWireAnswer(remote);
+  return true;
+}
+
+void UDPNameserver::countWireAnswer(const ComboAddress& remote)
+{
+  static unsigned int &numreceived4=*S.getPointer("udp4-queries");
+  static unsigned int &numreceived6=*S.getPointer("udp6-queries");
+  static unsigned int &numanswered=*S.getPointer("udp-answers");
+  static unsigned int &numanswered4=*S.getPointer("udp4-answers");
+  static unsigned int &numanswered6=*S.getPointer("udp6-answers");
+
+  numanswered++;
+  if(remote.sin4.sin_family==AF_INET) {
+    numreceived4++;
+    numanswered4++;
+  }
+  else {
+    numreceived6++;
+    numanswered6++;
+  }
+}
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+UDPBatch::UDPBatch(unsigned int size) : d_size(size), d_inbuf(size*513), d_inremotes(size), d_iniovs(size), d_inmsgs(size),
+  d_received(0), d_pos(0), d_insock(-1), d_outbufs(size), d_outremotes(size), d_outiovs(size), d_outmsgs(size), d_queued(0), d_outsock(-1)
+{
+  for(unsigned int n=0; n < size; ++n) {
+    d_iniovs[n].iov_base=&d_inbuf[n*513];
+    d_iniovs[n].iov_len=512;
+    memset(&d_inmsgs[n], 0, sizeof(d_inmsgs[n]));
+    d_inmsgs[n].msg_hdr.msg_name=&d_inremotes[n];
+    d_inmsgs[n].msg_hdr.msg_iov=&d_iniovs[n];
+    d_inmsgs[n].msg_hdr.msg_iovlen=1;
+
+    memset(&d_outmsgs[n], 0, sizeof(d_outmsgs[n]));
+    d_outmsgs[n].msg_hdr.msg_name=&d_outremotes[n];
+    d_outmsgs[n].msg_hdr.msg_iov=&d_outiovs[n];
+    d_outmsgs[n].msg_hdr.msg_iovlen=1;
+  }
+}
+
+bool UDPNameserver::canBatch()
+{
+  return true;
+}
+
+/** Hands out the questions of the previous recvmmsg() one by one, and only blocks for new ones once these are
+    all gone, after flushing the answers queued for them. Returns 0 for broken packets and for packets answered from the wire */
+DNSPacket *UDPNameserver::receive(DNSPacket *prefilled, UDPBatch& batch, bool fromWire)
+{
+  extern PacketCache PC;
+
+  while(batch.d_pos == batch.d_received) {
+    flush(batch);
+
+    Utility::sock_t sock=d_sockets[0];
+    if(d_sockets.size()>1) {
+      fd_set rfds=d_rfds;
+    
+      select(d_highfd+1, &rfds, 0, 0,  0); // blocks
+
+      sock=-1;
+      for(vector<int>::const_iterator i=d_sockets.begin();i!=d_sockets.end();++i) {
+        if(FD_ISSET(*i, &rfds)) {
+          sock=*i;
+          break;
+        }
+      }
+      if(sock==-1)
+        throw AhuException("select betrayed us! (should not happen)");
+    }
+
+    for(unsigned int n=0; n < batch.d_size; ++n)
+      batch.d_inmsgs[n].msg_hdr.msg_namelen=sizeof(ComboAddress);
+
+    int ret=recvmmsg(sock, &batch.d_inmsgs[0], batch.d_size, MSG_WAITFORONE, 0);
+    if(ret < 0) {
+      if(errno != EAGAIN)
+        L<<Logger::Error<<"recvmmsg gave error, ignoring: "<<strerror(errno)<<endl;
+      return 0;
+    }
+    batch.d_received=ret;
+    batch.d_pos=0;
+    batch.d_insock=sock;
+  }
+
+  unsigned int n=batch.d_pos++;
+  const char *mesg=&batch.d_inbuf[n*513];
+  int len=batch.d_inmsgs[n].msg_len;
+  const ComboAddress& remote=batch.d_inremotes[n];
+
+  DLOG(L<<"Received a packet " << len <<" bytes long from "<< remote.toString()<<endl);
+
+  if(fromWire) {
+    if(batch.d_queued && batch.d_outsock != batch.d_insock)
+      flush(batch);
+    if(PC.getFromWire(mesg, len, batch.d_outbufs[batch.d_queued])) {
+      countWireAnswer(remote);
+      batch.d_outsock=batch.d_insock;
+      batch.d_outremotes[batch.d_queued]=remote;
+      if(++batch.d_queued == batch.d_size)
+        flush(batch);
+      return 0;
+    }
+  }
+
+  return makePacket(prefilled, batch.d_insock, remote, mesg, len);
+}
+
+void UDPNameserver::queue(UDPBatch& batch, DNSPacket *p)
+{
+  if(batch.d_queued && batch.d_outsock != p->getSocket())
+    flush(batch);
+
+  batch.d_outsock=p->getSocket();
+  batch.d_outbufs[batch.d_queued]=p->getString();
+  batch.d_outremotes[batch.d_queued]=p->d_remote;
+  if(++batch.d_queued == batch.d_size)
+    flush(batch);
+}
+
+void UDPNameserver::flush(UDPBatch& batch)
+{
+  for(unsigned int n=0; n < batch.d_queued; ++n) {
+    batch.d_outmsgs[n].msg_hdr.msg_namelen=batch.d_outremotes[n].getSocklen();
+    batch.d_outiovs[n].iov_base=(void*)batch.d_outbufs[n].c_str();
+    batch.d_outiovs[n].iov_len=batch.d_outbufs[n].length();
+  }
+
+  unsigned int sent=0;
+  while(sent < batch.d_queued) {
+    int ret=sendmmsg(batch.d_outsock, &batch.d_outmsgs[sent], batch.d_queued - sent, 0);
+    if(ret < 0) { // the first message failed, skip it and try the rest
+      L<<Logger::Error<<"Error sending reply with sendmmsg (socket="<<batch.d_outsock<<"): "<<strerror(errno)<<endl;
+      sent++;
+    }
+    else
+      sent+=ret;
+  }
+  batch.d_queued=0;
+}
+#else
+UDPBatch::UDPBatch(unsigned int size) : d_size(size)
+{
+  throw AhuException("Batched UDP I/O needs recvmmsg() and sendmmsg(), which are not available on this platform");
+}
+
+bool UDPNameserver::canBatch()
+{
+  return false;
+}
+
+DNSPacket *UDPNameserver::receive(DNSPacket *prefilled, UDPBatch& batch, bool fromWire)
+{
+  return receive(prefilled);
+}
+
+void UDPNameserver::queue(UDPBatch& batch, DNSPacket *p)
+{
+  send(p);
+}
+
+void UDPNameserver::flush(UDPBatch& batch)
+{
+}
+#endif
@@ -31,6 +31,7 @@
 #endif // WIN32
 
 #include <vector>
+#include <boost/utility.hpp>
 #include "statbag.hh"
 #include "namespaces.hh"
 
@@ -68,22 +69,58 @@
 
 */
 
+/** Buffers for one receiver thread to move many datagrams per recvmmsg() and sendmmsg() call. Only available
+    where the platform has both, see UDPNameserver::canBatch() */
+class UDPBatch : public boost::noncopyable
+{
+public:
+  explicit UDPBatch(unsigned int size);
+private:
+  friend class UDPNameserver;
+  unsigned int d_size;
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+  vector<char> d_inbuf;
+  vector<ComboAddress> d_inremotes;
+  vector<struct iovec> d_iniovs;
+  vector<struct mmsghdr> d_inmsgs;
+  unsigned int d_received, d_pos;
+  Utility::sock_t d_insock;
+
+  vector<string> d_outbufs;
+  vector<ComboAddress> d_outremotes;
+  vector<struct iovec> d_outiovs;
+  vector<struct mmsghdr> d_outmsgs;
+  unsigned int d_queued;
+  Utility::sock_t d_outsock;
+#endif
+};
+
 class UDPNameserver
 {
 public:
-  UDPNameserver();  //!< Opens the socket
-  inline DNSPacket *receive(DNSPacket *prefilled=0); //!< call this in a while or for(;;) loop to get packets
+  UDPNameserver(bool additional_socket=false);  //!< Opens the socket. Additional sockets share the local addresses of the first through SO_REUSEPORT
+  inline DNSPacket *receive(DNSPacket *prefilled=0, string *wireAnswer=0); //!< call this in a while or for(;;) loop to get packets. Pass wireAnswer to have packet cache hits answered without a DNSPacket, 0 is returned for those
+  DNSPacket *receive(DNSPacket *prefilled, UDPBatch& batch, bool fromWire); //!< same, but pulls questions in batches. Cache hits from the wire are queued in the batch
   static void send(DNSPacket *); //!< send a DNSPacket. Will call DNSPacket::truncate() if over 512 bytes
+  static void queue(UDPBatch& batch, DNSPacket *); //!< queue an answer to be sent with the next flush of the batch
+  static void flush(UDPBatch& batch); //!< send out all queued answers
+  static bool canBatch(); //!< if recvmmsg() and sendmmsg() are available
+  static bool canReusePort(); //!< if SO_REUSEPORT is available
   
 private:
+  inline static DNSPacket *makePacket(DNSPacket *prefilled, Utility::sock_t sock, const ComboAddress& remote, const char *mesg, int len);
+  static bool answerFromWire(Utility::sock_t sock, const ComboAddress& remote, const char *mesg, int len, string& buffer);
+  static void countWireAnswer(const ComboAddress& remote);
   vector<int> d_sockets;
   void bindIPv4();
   void bindIPv6();
+  void setReusePort(int s);
+  bool d_additional_socket;
   fd_set d_rfds;
   int d_highfd;
 };
 
-inline DNSPacket *UDPNameserver::receive(DNSPacket *prefilled)
+inline DNSPacket *UDPNameserver::receive(DNSPacket *prefilled, string *wireAnswer)
 {
   ComboAddress remote;
   extern StatBag S;
@@ -132,7 +169,17 @@ inline DNSPacket *UDPNameserver::receive(DNSPacket *prefilled)
   }
   
   DLOG(L<<"Received a packet " << len <<" bytes long from "<< remote.toString()<<endl);
-  
+
+  if(wireAnswer && answerFromWire(sock, remote, mesg, len, *wireAnswer))
+    return 0;
+
+  return makePacket(prefilled, sock, remote, mesg, len);
+}
+
+inline DNSPacket *UDPNameserver::makePacket(DNSPacket *prefilled, Utility::sock_t sock, const ComboAddress& remote, const char *mesg, int len)
+{
+  extern StatBag S;
+
   DNSPacket *packet;
   if(prefilled)  // they gave us a preallocated packet
     packet=prefilled;
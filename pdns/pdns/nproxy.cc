@@ -49,7 +49,7 @@ void syslogFmt(const boost::format& fmt)
   syslog(LOG_WARNING, "%s", str(fmt).c_str());
 }
 
-void handleOutsideUDPPacket(int fd, boost::any&)
+void handleOutsideUDPPacket(int fd, FDMultiplexer::funcparam_t&)
 try
 {
   char buffer[1500];
@@ -120,7 +120,7 @@ catch(std::exception &e)
 }
 
 
-void handleInsideUDPPacket(int fd, boost::any&)
+void handleInsideUDPPacket(int fd, FDMultiplexer::funcparam_t&)
 try
 {
   char buffer[1500];
@@ -0,0 +1,294 @@
+#ifndef PDNS_OPENHASH_HH
+#define PDNS_OPENHASH_HH
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <inttypes.h>
+
+/* Hash map with open addressing: entries live in one array, a collision moves on to the next slot. Erasing shifts
+   the rest of the probe sequence back into the hole, so there are no tombstones and lookups never get slower as
+   entries come and go. The table doubles when it is half full.
+
+   Expiry is incremental: expire() sweeps a few slots at a time around the table, so a large table is cleaned in
+   many small steps instead of with a full scan.
+
+   Like a std::map it hands out pair<Key, T>, but the key must not be changed. Inserting may move all entries, so
+   pointers, references and iterators are only good until the next insert. Erasing while iterating is allowed, but
+   when a probe sequence wraps around the end of the array an entry may be visited twice. */
+
+template<typename Key, typename T, typename Hash, typename Equal=std::equal_to<Key> >
+class OpenHashMap
+{
+public:
+  typedef std::pair<Key, T> value_type;
+
+  struct Slot
+  {
+    Slot() : d_hash(0), d_used(false)
+    {}
+    value_type d_value;
+    uint32_t d_hash;
+    bool d_used;
+  };
+
+  template<typename V, typename S>
+  class Iterator
+  {
+  public:
+    Iterator() : d_pos(0), d_end(0)
+    {}
+
+    Iterator(S* pos, S* end) : d_pos(pos), d_end(end)
+    {
+      skip();
+    }
+
+    template<typename V2, typename S2> Iterator(const Iterator<V2, S2>& rhs) : d_pos(rhs.d_pos), d_end(rhs.d_end)
+    {}
+
+    V& operator*() const
+    {
+      return d_pos->d_value;
+    }
+
+    V* operator->() const
+    {
+      return &d_pos->d_value;
+    }
+
+    Iterator& operator++()
+    {
+      ++d_pos;
+      skip();
+      return *this;
+    }
+
+    Iterator operator++(int)
+    {
+      Iterator ret(*this);
+      ++*this;
+      return ret;
+    }
+
+    bool operator==(const Iterator& rhs) const
+    {
+      return d_pos == rhs.d_pos;
+    }
+
+    bool operator!=(const Iterator& rhs) const
+    {
+      return d_pos != rhs.d_pos;
+    }
+
+    S* d_pos;
+    S* d_end;
+
+  private:
+    void skip()
+    {
+      while(d_pos != d_end && !d_pos->d_used)
+        ++d_pos;
+    }
+  };
+
+  typedef Iterator<value_type, Slot> iterator;
+  typedef Iterator<const value_type, const Slot> const_iterator;
+
+  explicit OpenHashMap(unsigned int capacity=16) : d_size(0), d_cursor(0)
+  {
+    unsigned int size=16;
+    while(size < capacity)
+      size <<= 1;
+    d_slots.resize(size);
+    d_mask=size-1;
+  }
+
+  iterator begin()
+  {
+    return iterator(&d_slots[0], &d_slots[0] + d_slots.size());
+  }
+
+  iterator end()
+  {
+    Slot* end=&d_slots[0] + d_slots.size();
+    return iterator(end, end);
+  }
+
+  const_iterator begin() const
+  {
+    return const_iterator(&d_slots[0], &d_slots[0] + d_slots.size());
+  }
+
+  const_iterator end() const
+  {
+    const Slot* end=&d_slots[0] + d_slots.size();
+    return const_iterator(end, end);
+  }
+
+  size_t size() const
+  {
+    return d_size;
+  }
+
+  bool empty() const
+  {
+    return !d_size;
+  }
+
+  size_t capacity() const
+  {
+    return d_slots.size();
+  }
+
+  iterator find(const Key& key)
+  {
+    uint32_t pos;
+    if(!lookup(key, d_hasher(key), &pos))
+      return end();
+    return iterator(&d_slots[pos], &d_slots[0] + d_slots.size());
+  }
+
+  const_iterator find(const Key& key) const
+  {
+    uint32_t pos;
+    if(!lookup(key, d_hasher(key), &pos))
+      return end();
+    return const_iterator(&d_slots[pos], &d_slots[0] + d_slots.size());
+  }
+
+  size_t count(const Key& key) const
+  {
+    uint32_t pos;
+    return lookup(key, d_hasher(key), &pos);
+  }
+
+  //! as with std::map, an existing entry is left alone, the bool tells if v was inserted
+  std::pair<iterator, bool> insert(const value_type& v)
+  {
+    uint32_t hash=d_hasher(v.first), pos;
+    bool found=lookup(v.first, hash, &pos);
+    if(!found) {
+      if(2*(d_size+1) > d_slots.size()) {
+        rehash(2*d_slots.size());
+        lookup(v.first, hash, &pos);
+      }
+      Slot& s=d_slots[pos];
+      s.d_value=v;
+      s.d_hash=hash;
+      s.d_used=true;
+      d_size++;
+    }
+    return std::make_pair(iterator(&d_slots[pos], &d_slots[0] + d_slots.size()), !found);
+  }
+
+  T& operator[](const Key& key)
+  {
+    return insert(value_type(key, T())).first->second;
+  }
+
+  //! returns where to continue iterating
+  iterator erase(iterator i)
+  {
+    uint32_t pos=i.d_pos - &d_slots[0];
+    eraseSlot(pos);
+    return iterator(&d_slots[pos], &d_slots[0] + d_slots.size());
+  }
+
+  size_t erase(const Key& key)
+  {
+    uint32_t pos;
+    if(!lookup(key, d_hasher(key), &pos))
+      return 0;
+    eraseSlot(pos);
+    return 1;
+  }
+
+  void clear()
+  {
+    slots_t empty(d_slots.size());
+    d_slots.swap(empty);
+    d_size=0;
+  }
+
+  /** looks at the next 'slots' slots of a sweep around the table, and erases the entries for which expired(entry)
+      is true. Returns the number of entries erased */
+  template<typename Pred> unsigned int expire(unsigned int slots, Pred expired)
+  {
+    unsigned int erased=0;
+    for(unsigned int n=0; n < slots && d_size; ++n) {
+      d_cursor&=d_mask;
+      Slot& s=d_slots[d_cursor];
+      if(s.d_used && expired(s.d_value)) {
+        eraseSlot(d_cursor); // and look at this slot again, the next entry may have moved into it
+        erased++;
+      }
+      else
+        d_cursor++;
+    }
+    return erased;
+  }
+
+private:
+  typedef std::vector<Slot> slots_t;
+
+  //! finds key, or if it is not there, the empty slot where it would go
+  bool lookup(const Key& key, uint32_t hash, uint32_t* pos) const
+  {
+    for(uint32_t n=hash & d_mask;; n=(n+1) & d_mask) {
+      const Slot& s=d_slots[n];
+      if(!s.d_used || (s.d_hash == hash && d_equal(s.d_value.first, key))) {
+        *pos=n;
+        return s.d_used;
+      }
+    }
+  }
+
+  static void moveSlot(Slot& to, Slot& from)
+  {
+    using std::swap;
+    swap(to.d_value.first, from.d_value.first);
+    swap(to.d_value.second, from.d_value.second);
+    to.d_hash=from.d_hash;
+    to.d_used=true;
+  }
+
+  //! pulls back whatever follows in the probe sequence and could live closer to home
+  void eraseSlot(uint32_t hole)
+  {
+    for(uint32_t n=(hole+1) & d_mask; d_slots[n].d_used; n=(n+1) & d_mask) {
+      uint32_t home=d_slots[n].d_hash & d_mask;
+      if(((n - home) & d_mask) >= ((n - hole) & d_mask)) {
+        moveSlot(d_slots[hole], d_slots[n]);
+        hole=n;
+      }
+    }
+    d_slots[hole]=Slot();
+    d_size--;
+  }
+
+  void rehash(size_t size)
+  {
+    slots_t old(size);
+    d_slots.swap(old);
+    d_mask=size-1;
+    d_cursor=0;
+    for(typename slots_t::iterator i=old.begin(); i != old.end(); ++i) {
+      if(!i->d_used)
+        continue;
+      uint32_t n=i->d_hash & d_mask;
+      while(d_slots[n].d_used)
+        n=(n+1) & d_mask;
+      moveSlot(d_slots[n], *i);
+    }
+  }
+
+  slots_t d_slots;
+  size_t d_size;
+  uint32_t d_mask;
+  uint32_t d_cursor;
+  Hash d_hasher;
+  Equal d_equal;
+};
+
+#endif
@@ -27,7 +27,7 @@ extern StatBag S;
 
 PacketCache::PacketCache()
 {
-  pthread_rwlock_init(&d_mut,0);
+  d_maps.push_back(new MapCombo);
   // d_ops = 0;
 
   d_ttl=-1;
@@ -44,7 +44,41 @@ PacketCache::PacketCache()
 
 PacketCache::~PacketCache()
 {
-  WriteLock l(&d_mut);
+  for(vector<MapCombo*>::iterator i=d_maps.begin(); i != d_maps.end(); ++i)
+    delete *i;
+}
+
+void PacketCache::setShards(unsigned int shards)
+{
+  if(!shards)
+    shards=1;
+
+  for(vector<MapCombo*>::iterator i=d_maps.begin(); i != d_maps.end(); ++i)
+    delete *i;
+  d_maps.clear();
+
+  for(unsigned int n=0; n < shards; ++n) {
+    MapCombo* mc=new MapCombo;
+    if(shards > 1) {
+      string prefix="packetcache-shard"+lexical_cast<string>(n);
+      S.declare(prefix+"-hit", "Number of hits on packet cache shard "+lexical_cast<string>(n));
+      S.declare(prefix+"-miss", "Number of misses on packet cache shard "+lexical_cast<string>(n));
+      mc->d_statnumhit=S.getPointer(prefix+"-hit");
+      mc->d_statnummiss=S.getPointer(prefix+"-miss");
+    }
+    d_maps.push_back(mc);
+  }
+  *d_statnumentries=0;
+}
+
+uint32_t PacketCache::hashKey(const string &qname, uint16_t qtype, uint16_t ctype, int zoneID, bool meritsRecursion,
+  unsigned int maxReplyLen, bool dnssecOk)
+{
+  uint32_t ret=pdns_ihash(qname);
+  ret=pdns_hashmix(ret, qtype | (ctype << 16));
+  ret=pdns_hashmix(ret, zoneID);
+  ret=pdns_hashmix(ret, maxReplyLen);
+  return pdns_hashmix(ret, meritsRecursion | (dnssecOk << 1));
 }
 
 int PacketCache::get(DNSPacket *p, DNSPacket *cached)
@@ -77,18 +111,22 @@ int PacketCache::get(DNSPacket *p, DNSPacket *cached)
 
   string value;
   bool haveSomething;
+  uint16_t maxReplyLen = p->d_tcp ? 0xffff : p->getMaxReplyLen();
+  uint32_t hash=hashKey(p->qdomain, p->qtype.getCode(), PacketCache::PACKETCACHE, -1, packetMeritsRecursion, maxReplyLen, p->d_dnssecOk);
+  MapCombo& mc=getMap(hash);
   {
-    TryReadLock l(&d_mut); // take a readlock here
+    TryReadLock l(&mc.d_mut); // take a readlock here
     if(!l.gotIt()) {
       S.inc("deferred-cache-lookup");
       return 0;
     }
 
-    uint16_t maxReplyLen = p->d_tcp ? 0xffff : p->getMaxReplyLen();
-    haveSomething=getEntryLocked(p->qdomain, p->qtype, PacketCache::PACKETCACHE, value, -1, packetMeritsRecursion, maxReplyLen, p->d_dnssecOk);
+    haveSomething=getEntryLocked(mc, hash, p->qdomain, p->qtype, PacketCache::PACKETCACHE, value, -1, packetMeritsRecursion, maxReplyLen, p->d_dnssecOk);
   }
   if(haveSomething) {
     (*d_statnumhit)++;
+    if(mc.d_statnumhit)
+      (*mc.d_statnumhit)++;
     if(cached->noparse(value.c_str(), value.size()) < 0) {
       return 0;
     }
@@ -98,9 +136,103 @@ int PacketCache::get(DNSPacket *p, DNSPacket *cached)
 
   //  cerr<<"Packet cache miss for '"<<p->qdomain<<"', merits: "<<packetMeritsRecursion<<endl;
   (*d_statnummiss)++;
+  if(mc.d_statnummiss)
+    (*mc.d_statnummiss)++;
   return 0; // bummer
 }
 
+/* This is the fast path for UDP questions, it only understands plain queries with a single question 
+   and at most an option-less EDNS0 OPT record. Anything else returns false and should go through get(),
+   which will also account for the miss. The key built here must be equal to what DNSPacket::parse() would
+   have yielded. */
+bool PacketCache::getFromWire(const char *query, unsigned int len, string& response)
+{
+  if(d_ttl<0) 
+    getTTLS();
+
+  if(len < sizeof(dnsheader))
+    return false;
+
+  dnsheader dh;
+  memcpy(&dh, query, sizeof(dh));
+  if(dh.qr || dh.opcode != Opcode::Query || ntohs(dh.qdcount) != 1 || dh.ancount || dh.nscount || ntohs(dh.arcount) > 1)
+    return false;
+
+  bool packetMeritsRecursion=d_doRecursion && dh.rd;
+  if(packetMeritsRecursion ? !d_recursivettl : !d_ttl)
+    return false;
+
+  const unsigned char* packet=(const unsigned char*)query;
+  unsigned int pos=sizeof(dnsheader);
+  string qname;
+  for(;;) {
+    if(pos >= len)
+      return false;
+    unsigned char labellen=packet[pos++];
+    if(!labellen)
+      break;
+    if((labellen & 0xc0) || pos + labellen > len) // no compression in a question
+      return false;
+    if(!qname.empty())
+      qname.append(1, '.');
+    for(unsigned int n=0; n < labellen; ++n, ++pos) { // escape like PacketReader::getLabelFromContent
+      if(packet[pos]=='.' || packet[pos]=='\\') {
+        qname.append(1, '\\');
+        qname.append(1, packet[pos]);
+      }
+      else if(packet[pos]==' ')
+        qname+="\\032";
+      else
+        qname.append(1, packet[pos]);
+    }
+  }
+  unsigned int qnameEnd=pos;
+
+  if(pos + 4 > len)
+    return false;
+  uint16_t qtype=packet[pos]*256 + packet[pos+1];
+  uint16_t qclass=packet[pos+2]*256 + packet[pos+3];
+  pos+=4;
+  if(qclass != QClass::IN)
+    return false;
+
+  unsigned int maxReplyLen=512;
+  bool dnssecOk=false;
+  if(dh.arcount) { // only an OPT record for the root without options is fine
+    if(pos + 11 > len || packet[pos] || packet[pos+1]*256 + packet[pos+2] != QType::OPT || packet[pos+9] || packet[pos+10])
+      return false;
+    maxReplyLen=std::min(packet[pos+3]*256 + packet[pos+4], 1680);
+    dnssecOk=packet[pos+7] & 0x80;
+    pos+=11;
+  }
+  if(pos != len)
+    return false;
+
+  uint32_t hash=hashKey(qname, qtype, PacketCache::PACKETCACHE, -1, packetMeritsRecursion, maxReplyLen, dnssecOk);
+  MapCombo& mc=getMap(hash);
+  {
+    TryReadLock l(&mc.d_mut);
+    if(!l.gotIt()) 
+      return false;
+
+    if(!getEntryLocked(mc, hash, qname, QType(qtype), PacketCache::PACKETCACHE, response, -1, packetMeritsRecursion, maxReplyLen, dnssecOk))
+      return false;
+  }
+  if(response.size() < qnameEnd)
+    return false;
+
+  (*d_statnumhit)++;
+  if(mc.d_statnumhit)
+    (*mc.d_statnumhit)++;
+
+  // patch in the ID, the RD bit and the exact case of the question
+  dnsheader* rh=(dnsheader*)&response[0];
+  rh->id=dh.id;
+  rh->rd=dh.rd;
+  response.replace(sizeof(dnsheader), qnameEnd - sizeof(dnsheader), query + sizeof(dnsheader), qnameEnd - sizeof(dnsheader));
+  return true;
+}
+
 void PacketCache::getTTLS()
 {
   d_ttl=::arg().asNum("cache-ttl");
@@ -153,16 +285,22 @@ void PacketCache::insert(const string &qname, const QType& qtype, CacheEntryType
   val.maxReplyLen = maxReplyLen;
   val.dnssecOk = dnssecOk;
   val.zoneID = zoneID;
-  
-  TryWriteLock l(&d_mut);
+  val.hash = hashKey(qname, val.qtype, cet, zoneID, meritsRecursion, maxReplyLen, dnssecOk);
+
+  MapCombo& mc=getMap(val.hash);
+  TryWriteLock l(&mc.d_mut);
   if(l.gotIt()) { 
-    bool success;
-    cmap_t::iterator place;
-    tie(place, success)=d_map.insert(val);
-    //    cerr<<"Insert succeeded: "<<success<<endl;
-    if(!success)
-      d_map.replace(place, val);
-    
+    cmap_t::iterator place, end;
+    for(tie(place, end)=mc.d_map.equal_range(val.hash); place != end; ++place) {
+      if(place->qtype == val.qtype && place->ctype == val.ctype && place->zoneID == zoneID && place->meritsRecursion == meritsRecursion &&
+         place->maxReplyLen == maxReplyLen && place->dnssecOk == dnssecOk && pdns_iequals(place->qname, qname))
+        break;
+    }
+    //    cerr<<"Insert replaces: "<<(place != end)<<endl;
+    if(place == end)
+      mc.d_map.insert(val);
+    else
+      mc.d_map.replace(place, val);
   }
   else 
     S.inc("deferred-cache-inserts"); 
@@ -171,9 +309,12 @@ void PacketCache::insert(const string &qname, const QType& qtype, CacheEntryType
 /* clears the entire packetcache. */
 int PacketCache::purge()
 {
-  WriteLock l(&d_mut);
-  int delcount=d_map.size();
-  d_map.clear();
+  int delcount=0;
+  for(vector<MapCombo*>::iterator i=d_maps.begin(); i != d_maps.end(); ++i) {
+    WriteLock l(&(*i)->d_mut);
+    delcount+=(*i)->d_map.size();
+    (*i)->d_map.clear();
+  }
   *d_statnumentries=0;
   return delcount;
 }
@@ -181,8 +322,8 @@ int PacketCache::purge()
 /* purges entries from the packetcache. If match ends on a $, it is treated as a suffix */
 int PacketCache::purge(const string &match)
 {
-  WriteLock l(&d_mut);
   int delcount=0;
+  unsigned int size=0;
 
   /* ok, the suffix delete plan. We want to be able to delete everything that 
      pertains 'www.powerdns.com' but we also want to be able to delete everything
@@ -227,29 +368,36 @@ int PacketCache::purge(const string &match)
      'www.userpowerdns.com'
 
   */
-  if(ends_with(match, "$")) {
-    string suffix(match);
-    suffix.resize(suffix.size()-1);
-
-    cmap_t::const_iterator iter = d_map.lower_bound(tie(suffix));
-    cmap_t::const_iterator start=iter;
-    string dotsuffix = "."+suffix;
-
-    for(; iter != d_map.end(); ++iter) {
-      if(!pdns_iequals(iter->qname, suffix) && !iends_with(iter->qname, dotsuffix)) {
-        //	cerr<<"Stopping!"<<endl;
-        break;
+  typedef cmap_t::nth_index<2>::type name_t;
+  for(vector<MapCombo*>::iterator i=d_maps.begin(); i != d_maps.end(); ++i) {
+    WriteLock l(&(*i)->d_mut);
+    name_t& nidx=(*i)->d_map.get<2>();
+
+    if(ends_with(match, "$")) {
+      string suffix(match);
+      suffix.resize(suffix.size()-1);
+
+      name_t::iterator iter = nidx.lower_bound(suffix);
+      name_t::iterator start=iter;
+      string dotsuffix = "."+suffix;
+
+      for(; iter != nidx.end(); ++iter) {
+        if(!pdns_iequals(iter->qname, suffix) && !iends_with(iter->qname, dotsuffix)) {
+          //	cerr<<"Stopping!"<<endl;
+          break;
+        }
+        delcount++;
       }
-      delcount++;
+      nidx.erase(start, iter);
     }
-    d_map.erase(start, iter);
-  }
-  else {
-    delcount=d_map.count(tie(match));
-    pair<cmap_t::iterator, cmap_t::iterator> range = d_map.equal_range(tie(match));
-    d_map.erase(range.first, range.second);
+    else {
+      pair<name_t::iterator, name_t::iterator> range = nidx.equal_range(match);
+      delcount+=distance(range.first, range.second);
+      nidx.erase(range.first, range.second);
+    }
+    size+=(*i)->d_map.size();
   }
-  *d_statnumentries=d_map.size();
+  *d_statnumentries=size;
   return delcount;
 }
 // called from ueberbackend
@@ -263,24 +411,31 @@ bool PacketCache::getEntry(const string &qname, const QType& qtype, CacheEntryTy
     cleanup();
   }
 
-  TryReadLock l(&d_mut); // take a readlock here
+  uint32_t hash=hashKey(qname, qtype.getCode(), cet, zoneID, meritsRecursion, maxReplyLen, dnssecOk);
+  MapCombo& mc=getMap(hash);
+  TryReadLock l(&mc.d_mut); // take a readlock here
   if(!l.gotIt()) {
     S.inc( "deferred-cache-lookup");
     return false;
   }
 
-  return getEntryLocked(qname, qtype, cet, value, zoneID, meritsRecursion, maxReplyLen, dnssecOk);
+  return getEntryLocked(mc, hash, qname, qtype, cet, value, zoneID, meritsRecursion, maxReplyLen, dnssecOk);
 }
 
 
-bool PacketCache::getEntryLocked(const string &qname, const QType& qtype, CacheEntryType cet, string& value, int zoneID, bool meritsRecursion,
-  unsigned int maxReplyLen, bool dnssecOK)
+bool PacketCache::getEntryLocked(MapCombo& mc, uint32_t hash, const string &qname, const QType& qtype, CacheEntryType cet, string& value, int zoneID, 
+  bool meritsRecursion, unsigned int maxReplyLen, bool dnssecOK)
 {
   uint16_t qt = qtype.getCode();
   //cerr<<"Lookup for maxReplyLen: "<<maxReplyLen<<endl;
-  cmap_t::const_iterator i=d_map.find(tie(qname, qt, cet, zoneID, meritsRecursion, maxReplyLen, dnssecOK));
+  cmap_t::const_iterator i, end;
+  for(tie(i, end)=mc.d_map.equal_range(hash); i != end; ++i) {
+    if(i->qtype == qt && i->ctype == cet && i->zoneID == zoneID && i->meritsRecursion == meritsRecursion &&
+       i->maxReplyLen == maxReplyLen && i->dnssecOk == dnssecOK && pdns_iequals(i->qname, qname))
+      break;
+  }
   time_t now=time(0);
-  bool ret=(i!=d_map.end() && i->ttd > now);
+  bool ret=(i!=end && i->ttd > now);
   if(ret)
     value = i->value;
   
@@ -289,22 +444,23 @@ bool PacketCache::getEntryLocked(const string &qname, const QType& qtype, CacheE
 
 map<char,int> PacketCache::getCounts()
 {
-  ReadLock l(&d_mut);
-
   map<char,int>ret;
   int recursivePackets=0, nonRecursivePackets=0, queryCacheEntries=0, negQueryCacheEntries=0;
 
-  for(cmap_t::const_iterator iter = d_map.begin() ; iter != d_map.end(); ++iter) {
-    if(iter->ctype == PACKETCACHE)
-      if(iter->meritsRecursion)
-        recursivePackets++;
-      else
-        nonRecursivePackets++;
-    else if(iter->ctype == QUERYCACHE) {
-      if(iter->value.empty())
-        negQueryCacheEntries++;
-      else
-        queryCacheEntries++;
+  for(vector<MapCombo*>::iterator i=d_maps.begin(); i != d_maps.end(); ++i) {
+    ReadLock l(&(*i)->d_mut);
+    for(cmap_t::const_iterator iter = (*i)->d_map.begin() ; iter != (*i)->d_map.end(); ++iter) {
+      if(iter->ctype == PACKETCACHE)
+        if(iter->meritsRecursion)
+          recursivePackets++;
+        else
+          nonRecursivePackets++;
+      else if(iter->ctype == QUERYCACHE) {
+        if(iter->value.empty())
+          negQueryCacheEntries++;
+        else
+          queryCacheEntries++;
+      }
     }
   }
   ret['!']=negQueryCacheEntries;
@@ -316,59 +472,61 @@ map<char,int> PacketCache::getCounts()
 
 int PacketCache::size()
 {
-  ReadLock l(&d_mut);
-  return d_map.size();
+  int ret=0;
+  for(vector<MapCombo*>::iterator i=d_maps.begin(); i != d_maps.end(); ++i) {
+    ReadLock l(&(*i)->d_mut);
+    ret+=(*i)->d_map.size();
+  }
+  return ret;
 }
 
-/** readlock for figuring out which iterators to delete, upgrade to writelock when actually cleaning */
+/** each shard is trimmed to its share of max-cache-entries, under its own writelock */
 void PacketCache::cleanup()
 {
-  WriteLock l(&d_mut);
+  unsigned int maxCached=::arg().asNum("max-cache-entries") / d_maps.size();
+  unsigned int totSize=0;
+  time_t now=time(0);
 
-  *d_statnumentries=d_map.size();
+  DLOG(L<<"Starting cache clean"<<endl);
+  for(vector<MapCombo*>::iterator mc=d_maps.begin(); mc != d_maps.end(); ++mc) {
+    WriteLock l(&(*mc)->d_mut);
 
-  unsigned int maxCached=::arg().asNum("max-cache-entries");
-  unsigned int toTrim=0;
-  
-  unsigned int cacheSize=*d_statnumentries;
+    unsigned int toTrim=0;
+    unsigned int cacheSize=(*mc)->d_map.size();
 
-  if(maxCached && cacheSize > maxCached) {
-    toTrim = cacheSize - maxCached;
-  }
+    if(maxCached && cacheSize > maxCached) {
+      toTrim = cacheSize - maxCached;
+    }
 
-  unsigned int lookAt=0;
-  // two modes - if toTrim is 0, just look through 10%  of the cache and nuke everything that is expired
-  // otherwise, scan first 5*toTrim records, and stop once we've nuked enough
-  if(toTrim)
-    lookAt=5*toTrim;
-  else
-    lookAt=cacheSize/10;
+    unsigned int lookAt=0;
+    // two modes - if toTrim is 0, just look through 10%  of the cache and nuke everything that is expired
+    // otherwise, scan first 5*toTrim records, and stop once we've nuked enough
+    if(toTrim)
+      lookAt=5*toTrim;
+    else
+      lookAt=cacheSize/10;
 
-  //  cerr<<"cacheSize: "<<cacheSize<<", lookAt: "<<lookAt<<", toTrim: "<<toTrim<<endl;
-  time_t now=time(0);
+    //  cerr<<"cacheSize: "<<cacheSize<<", lookAt: "<<lookAt<<", toTrim: "<<toTrim<<endl;
 
-  DLOG(L<<"Starting cache clean"<<endl);
-  if(d_map.empty())
-    return; // clean
-
-  typedef cmap_t::nth_index<1>::type sequence_t;
-  sequence_t& sidx=d_map.get<1>();
-  unsigned int erased=0, lookedAt=0;
-  for(sequence_t::iterator i=sidx.begin(); i != sidx.end(); lookedAt++) {
-    if(i->ttd < now) {
-      sidx.erase(i++);
-      erased++;
-    }
-    else
-      ++i;
+    typedef cmap_t::nth_index<1>::type sequence_t;
+    sequence_t& sidx=(*mc)->d_map.get<1>();
+    unsigned int erased=0, lookedAt=0;
+    for(sequence_t::iterator i=sidx.begin(); i != sidx.end(); lookedAt++) {
+      if(i->ttd < now) {
+        sidx.erase(i++);
+        erased++;
+      }
+      else
+        ++i;
 
-    if(toTrim && erased > toTrim)
-      break;
+      if(toTrim && erased > toTrim)
+        break;
 
-    if(lookedAt > lookAt)
-      break;
+      if(lookedAt > lookAt)
+        break;
+    }
+    totSize+=(*mc)->d_map.size();
   }
-  //  cerr<<"erased: "<<erased<<endl;
-  *d_statnumentries=d_map.size();
+  *d_statnumentries=totSize;
   DLOG(L<<"Done with cache clean"<<endl);
 }
@@ -22,9 +22,10 @@
 #include <string>
 #include <utility>
 #include <map>
-#include <map>
+#include <vector>
 #include "dns.hh"
 #include <boost/version.hpp>
+#include <boost/multi_index/hashed_index.hpp>
 #include "namespaces.hh"
 using namespace ::boost::multi_index;
 
@@ -40,8 +41,9 @@ using namespace ::boost::multi_index;
 
     Locking! 
 
-    The cache itself is protected by a read/write lock. Because deleting is a two step process, which 
-    first marks and then sweeps, a second lock is present to prevent simultaneous inserts and deletes.
+    The cache is split into one or more shards, each protected by its own read/write lock. An entry lives
+    in the shard picked by the case insensitive hash of its full key, so threads looking up different
+    questions rarely touch the same lock. Use setShards() to pick the number of shards before launching threads.
 */
 
 struct CIBackwardsStringCompare: public std::binary_function<string, string, bool>  
@@ -69,12 +71,15 @@ public:
   ~PacketCache();
   enum CacheEntryType { PACKETCACHE, QUERYCACHE};
 
+  void setShards(unsigned int shards); //!< empties the cache and splits it into this many shards. Not thread safe, call before launching threads
+
   void insert(DNSPacket *q, DNSPacket *r, unsigned int maxttl=UINT_MAX);  //!< We copy the contents of *p into our cache. Do not needlessly call this to insert questions already in the cache as it wastes resources
 
   void insert(const string &qname, const QType& qtype, CacheEntryType cet, const string& value, unsigned int ttl, int zoneID=-1, bool meritsRecursion=false,
     unsigned int maxReplyLen=512, bool dnssecOk=false);
 
   int get(DNSPacket *p, DNSPacket *q); //!< We return a dynamically allocated copy out of our cache. You need to delete it. You also need to spoof in the right ID with the DNSPacket.spoofID() method.
+  bool getFromWire(const char *query, unsigned int len, string& response); //!< Lookup straight from a raw UDP question, without building a DNSPacket. On a hit, response is ready to send
   bool getEntry(const string &content, const QType& qtype, CacheEntryType cet, string& entry, int zoneID=-1, 
     bool meritsRecursion=false, unsigned int maxReplyLen=512, bool dnssecOk=false);
 
@@ -85,11 +90,9 @@ public:
 
   map<char,int> getCounts();
 private:
-  bool getEntryLocked(const string &content, const QType& qtype, CacheEntryType cet, string& entry, int zoneID=-1, 
-    bool meritsRecursion=false, unsigned int maxReplyLen=512, bool dnssecOk=false);
   struct CacheEntry
   {
-    CacheEntry() { qtype = ctype = 0; zoneID = -1; meritsRecursion=false; dnssecOk=false;}
+    CacheEntry() { qtype = ctype = 0; zoneID = -1; meritsRecursion=false; dnssecOk=false; hash=0;}
 
     string qname;
     uint16_t qtype;
@@ -99,36 +102,43 @@ private:
     bool meritsRecursion;
     unsigned int maxReplyLen;
     bool dnssecOk;
+    uint32_t hash;
     string value;
   };
 
-  void getTTLS();
-
+  /* index 0 finds entries by the hash of their key, index 1 is the cleanup order, index 2 is only
+     there so purge() can find all entries for a name or for everything below a suffix */
   typedef multi_index_container<
     CacheEntry,
     indexed_by <
-                ordered_unique<
-                      composite_key< 
-                        CacheEntry,
-                        member<CacheEntry,string,&CacheEntry::qname>,
-                        member<CacheEntry,uint16_t,&CacheEntry::qtype>,
-                        member<CacheEntry,uint16_t, &CacheEntry::ctype>,
-                        member<CacheEntry,int, &CacheEntry::zoneID>,
-                        member<CacheEntry,bool, &CacheEntry::meritsRecursion>,
-                        member<CacheEntry,unsigned int, &CacheEntry::maxReplyLen>,
-                        member<CacheEntry,bool, &CacheEntry::dnssecOk>
-                        >,
-                        composite_key_compare<CIBackwardsStringCompare, std::less<uint16_t>, std::less<uint16_t>, std::less<int>, std::less<bool>, 
-                          std::less<unsigned int>, std::less<bool> >
-                            >,
-                           sequenced<>
-                           >
+                hashed_non_unique<member<CacheEntry,uint32_t,&CacheEntry::hash> >,
+                sequenced<>,
+                ordered_non_unique<member<CacheEntry,string,&CacheEntry::qname>, CIBackwardsStringCompare>
+               >
   > cmap_t;
 
+  struct MapCombo
+  {
+    MapCombo() : d_statnumhit(0), d_statnummiss(0) { pthread_rwlock_init(&d_mut, 0); }
+    ~MapCombo() { pthread_rwlock_destroy(&d_mut); }
+
+    pthread_rwlock_t d_mut;
+    cmap_t d_map;
+    unsigned int *d_statnumhit;
+    unsigned int *d_statnummiss;
+  };
 
-  cmap_t d_map;
+  static uint32_t hashKey(const string &qname, uint16_t qtype, uint16_t ctype, int zoneID, bool meritsRecursion,
+    unsigned int maxReplyLen, bool dnssecOk);
+  MapCombo& getMap(uint32_t hash)
+  {
+    return *d_maps[hash % d_maps.size()];
+  }
+  bool getEntryLocked(MapCombo& mc, uint32_t hash, const string &content, const QType& qtype, CacheEntryType cet, string& entry, int zoneID=-1, 
+    bool meritsRecursion=false, unsigned int maxReplyLen=512, bool dnssecOk=false);
+  void getTTLS();
 
-  pthread_rwlock_t d_mut;
+  vector<MapCombo*> d_maps;
 
   AtomicCounter d_ops;
   int d_ttl;
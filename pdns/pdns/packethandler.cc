@@ -847,6 +847,39 @@ DNSPacket *PacketHandler::question(DNSPacket *p)
   return ret;
 }
 
+/* questions may share an answer when the PacketCache would have served them the same entry. On top of that, 
+   answers depending on the remote (recursion, EDNS subnet) or that are signed (TSIG) are never shared */
+bool PacketHandler::getCoalesceKey(DNSPacket *p, string* key)
+{
+  static bool doRecursion=::arg().mustDo("recursor");
+  static bool doCache=::arg().asNum("cache-ttl") > 0;
+
+  if(!doCache || p->d_tcp || p->d.opcode != Opcode::Query || ntohs(p->d.qdcount) != 1 || !p->couldBeCached() 
+     || p->d_havetsig || p->hasEDNSSubnet() || (doRecursion && p->d.rd))
+    return false;
+
+  key->assign(toLower(p->qdomain));
+  key->append(1, '\0');
+  uint16_t qtype=p->qtype.getCode(), maxReplyLen=p->getMaxReplyLen();
+  key->append((const char*)&qtype, sizeof(qtype));
+  key->append((const char*)&maxReplyLen, sizeof(maxReplyLen));
+  key->append(1, p->d_dnssecOk ? '1' : '0');
+  return true;
+}
+
+DNSPacket *PacketHandler::coalescedAnswer(DNSPacket *a, DNSPacket *q)
+{
+  DNSPacket *r=new DNSPacket(*a);
+  r->setRemote(&q->d_remote);
+  r->setSocket(q->getSocket());
+  r->d.rd=q->d.rd;
+  r->d.id=q->d.id;
+  r->d_dt=q->d_dt;
+  r->commitD();
+  r->spoofQuestion(q->qdomain); // for correct case
+  return r;
+}
+
 void PacketHandler::synthesiseRRSIGs(DNSPacket* p, DNSPacket* r)
 {
   DLOG(L<<"Need to fake up the RRSIGs if someone asked for them explicitly"<<endl);
@@ -76,6 +76,8 @@ public:
   PacketHandler(); 
   ~PacketHandler(); // defined in packethandler.cc, and does --count
   static int numRunning(){return s_count;}; //!< Returns the number of running PacketHandlers. Called by Distributor
+  static bool getCoalesceKey(DNSPacket *p, string* key); //!< Called by Distributor, fills key if p may share its answer with identical questions
+  static DNSPacket *coalescedAnswer(DNSPacket *a, DNSPacket *q); //!< Called by Distributor, turns the answer a into an answer for q
  
   void soaMagic(DNSResourceRecord *rr);
   DNSBackend *getBackend();
@@ -29,8 +29,10 @@
 
 #include <pthread.h>
 #include "recpacketcache.hh"
+#include "recsnapshot.hh"
 #include "utility.hh" 
 #include "dns_random.hh"
+#include "spscring.hh"
 #include <iostream>
 #include <errno.h>
 #include <map>
@@ -55,6 +57,9 @@
 #include <boost/function.hpp>
 #include <boost/algorithm/string.hpp>
 #include <netinet/tcp.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #include "dnsparser.hh"
 #include "dnswriter.hh"
 #include "dnsrecords.hh"
@@ -81,6 +86,14 @@ __thread RemoteKeeper* t_remotes;
 
 RecursorControlChannel s_rcc; // only active in thread 0
 
+//! a question on its way from the distributing thread to a worker, see distributeQuestion()
+struct DistributedQuestion
+{
+  string question;  //!< assigned to, so the slot reuses its buffer
+  ComboAddress fromaddr;
+  int fd;
+};
+
 // for communicating with our threads
 struct ThreadPipeSet
 {
@@ -88,16 +101,25 @@ struct ThreadPipeSet
   int readToThread;
   int writeFromThread;
   int readFromThread;
+  SPSCRing<DistributedQuestion>* questions; //!< only with pdns-distributes-queries
+  int questionsWakeRead;  //!< an eventfd, so both are the same, or a pipe
+  int questionsWakeWrite;
 };
 
 vector<ThreadPipeSet> g_pipes; // effectively readonly after startup
+static const unsigned int s_distributedQuestionsRingSize=2048;
 
 SyncRes::domainmap_t* g_initialDomainMap; // new threads needs this to be setup
 
 #include "namespaces.hh"
 
 __thread MemRecursorCache* t_RC;
+MemRecursorCache* g_sharedRC; //!< if set, all threads share() the records of this one
+SyncRes::InfraCache* g_sharedInfra; //!< if set, all threads share() what we know about the authoritatives
+SyncRes::NegCache* g_sharedNegCache; //!< if set, all threads share() what we know does not exist
 __thread RecursorPacketCache* t_packetCache;
+static string* g_snapshot; //!< read by main() from 'load-cache', every thread takes its part, the last one frees it
+static AtomicCounter g_snapshotPending;
 RecursorStats g_stats;
 bool g_quiet;
 
@@ -125,7 +147,7 @@ unsigned int g_numThreads;
 //! used to send information to a newborn mthread
 struct DNSComboWriter {
   DNSComboWriter(const char* data, uint16_t len, const struct timeval& now) : d_mdp(data, len), d_now(now), 
-        											        d_tcp(false), d_socket(-1)
+        											        d_tcp(false), d_socket(-1), d_qhashed(false)
   {}
   MOADNSParser d_mdp;
   void setRemote(const ComboAddress* sa)
@@ -148,6 +170,9 @@ struct DNSComboWriter {
   bool d_tcp;
   int d_socket;
   shared_ptr<TCPConnection> d_tcpConnection;
+  bool d_qhashed; // if set, d_qhash and d_ednsSize are the packet cache key of the question
+  uint32_t d_qhash;
+  uint16_t d_ednsSize;
 };
 
 
@@ -259,10 +284,34 @@ static void setSocketSendBuffer(int fd, uint32_t size)
 // you can ask this class for a UDP socket to send a query from
 // this socket is not yours, don't even think about deleting it
 // but after you call 'returnSocket' on it, don't assume anything anymore
+
+/* By default, each query gets a fresh socket on a random port, which is connected to the remote and closed again
+   once the answer is in. With 'outgoing-socket-pool-size' set, queries are instead sent from a pool of that many
+   unconnected sockets per address family, each on its own random port, and picked at random for every query.
+   Queries to different remotes can be outstanding on a pooled socket, answers are matched on remote, id and question
+   as always. If the socket picked already waits for the same remote, the query gets a socket of its own instead.
+
+   This is weaker against spoofing than the default: a port learned from one query stays good for the next ones, so
+   an attacker only has to guess the id. To limit that, a pooled socket is replaced by a fresh one after it has sent
+   'outgoing-socket-reuse' queries, and closed once the last of these is answered or timed out. */
+unsigned int g_outgoingSocketPoolSize, g_outgoingSocketReuse;
+
 class UDPClientSocks
 {
   unsigned int d_numsocks;
   unsigned int d_maxsocks;
+
+  struct PooledSocket
+  {
+    PooledSocket() : d_uses(0), d_retired(false)
+    {}
+    set<ComboAddress> d_remotes; //!< where the queries sent from it that have not been returned went, one each
+    unsigned int d_uses;         //!< queries sent from it in total
+    bool d_retired;              //!< no longer handed out, closed when d_remotes is empty
+  };
+  typedef map<int, PooledSocket> pool_t;
+  pool_t d_pool;                 //!< all pooled sockets, including retired ones still waiting for answers
+  vector<int> d_poolCurrent[2];  //!< the pooled sockets being handed out, for IPv4 and IPv6
 public:
   UDPClientSocks() : d_numsocks(0), d_maxsocks(5000)
   {
@@ -274,14 +323,19 @@ public:
   // returning -1 means: temporary OS error (ie, out of files), -2 means OS error
   int getSocket(const ComboAddress& toaddr, int* fd)
   {
+    if(g_outgoingSocketPoolSize && getPooledSocket(toaddr, fd))
+      return 0;
+
     *fd=makeClientSocket(toaddr.sin4.sin_family);
     if(*fd < 0) // temporary error - receive exception otherwise
       return -1;
+    g_stats.outgoingSocketsOpened++;
 
     if(connect(*fd, (struct sockaddr*)(&toaddr), toaddr.getSocklen()) < 0) {
       int err = errno;
       //      returnSocket(*fd);
       Utility::closesocket(*fd);
+      g_stats.outgoingSocketsClosed++;
       if(err==ENETUNREACH) // Seth "My Interfaces Are Like A Yo Yo" Arnold special
         return -2;
       return -1;
@@ -292,8 +346,23 @@ public:
     return 0;
   }
 
-  void returnSocket(int fd)
+  //! pooled sockets are not connected, and are in t_fdm for as long as they are open
+  bool isPooled(int fd) const
   {
+    return d_pool.count(fd);
+  }
+
+  //! remote is where the query sent from fd went
+  void returnSocket(int fd, const ComboAddress& remote)
+  {
+    pool_t::iterator p=d_pool.find(fd);
+    if(p != d_pool.end()) {
+      p->second.d_remotes.erase(remote);
+      if(p->second.d_retired && p->second.d_remotes.empty())
+        closePooledSocket(p);
+      return;
+    }
+
     socks_t::iterator i=d_socks.find(fd);
     if(i==d_socks.end()) {
       throw AhuException("Trying to return a socket (fd="+lexical_cast<string>(fd)+") not in the pool");
@@ -314,11 +383,18 @@ public:
       // we sometimes return a socket that has not yet been assigned to t_fdm
     }
     Utility::closesocket(*i);
+    g_stats.outgoingSocketsClosed++;
     
     d_socks.erase(i++);
     --d_numsocks;
   }
 
+  //! number of pooled sockets, including retired ones that are still open
+  uint64_t getPooledSockets() const
+  {
+    return d_pool.size();
+  }
+
   // returns -1 for errors which might go away, throws for ones that won't
   static int makeClientSocket(int family)
   {
@@ -352,14 +428,58 @@ public:
     Utility::setNonBlocking(ret);
     return ret;
   }
+
+private:
+  /** picks a pooled socket at random, opening one if that slot is still empty. Returns false if the socket picked
+      already waits for an answer from toaddr, or no socket could be opened, the caller then uses one of its own */
+  bool getPooledSocket(const ComboAddress& toaddr, int* fd)
+  {
+    int family=toaddr.sin4.sin_family;
+    vector<int>& current=d_poolCurrent[family == AF_INET6];
+    unsigned int n=dns_random(g_outgoingSocketPoolSize);
+    if(n >= current.size()) {
+      *fd=makeClientSocket(family);
+      if(*fd < 0)
+        return false;
+      g_stats.outgoingSocketsOpened++;
+      t_fdm->addReadFD(*fd, handleUDPServerResponse);
+      d_pool[*fd];
+      current.push_back(*fd);
+      n=current.size()-1;
+    }
+
+    PooledSocket& ps=d_pool[current[n]];
+    if(!ps.d_remotes.insert(toaddr).second)
+      return false;
+    *fd=current[n];
+    if(++ps.d_uses >= g_outgoingSocketReuse) {
+      ps.d_retired=true;
+      current[n]=current.back();
+      current.pop_back();
+    }
+    return true;
+  }
+
+  void closePooledSocket(pool_t::iterator& p)
+  {
+    t_fdm->removeReadFD(p->first);
+    Utility::closesocket(p->first);
+    g_stats.outgoingSocketsClosed++;
+    d_pool.erase(p);
+  }
 };
 
 static __thread UDPClientSocks* t_udpclientsocks;
 
+uint64_t* pleaseGetPooledSockets()
+{
+  return new uint64_t(t_udpclientsocks->getPooledSockets());
+}
+
 /* these two functions are used by LWRes */
 // -2 is OS error, -1 is error that depends on the remote, > 0 is success
 int asendto(const char *data, int len, int flags, 
-            const ComboAddress& toaddr, uint16_t id, const string& domain, uint16_t qtype, int* fd) 
+            const ComboAddress& toaddr, uint16_t id, const string& domain, uint16_t qtype, int ednsLevel, string* ping, int* fd) 
 {
 
   PacketID pident;
@@ -367,17 +487,19 @@ int asendto(const char *data, int len, int flags,
   pident.remote = toaddr;
   pident.type = qtype;
 
-  // see if there is an existing outstanding request we can chain on to, using partial equivalence function
-  pair<MT_t::waiters_t::iterator, MT_t::waiters_t::iterator> chain=MT->d_waiters.equal_range(pident, PacketIDBirthdayCompare());
+  /* see if there is an existing outstanding request we can chain on to, using partial equivalence function. It 
+     has to have gone out with the same EDNS level, or the answer would teach SyncRes the wrong things about the remote */
+  pair<MT_t::waiters_by_partial_key_t::iterator, MT_t::waiters_by_partial_key_t::iterator> chain=MT->d_waiters.get<PartialKeyTag>().equal_range(pident);
 
   for(; chain.first != chain.second; chain.first++) {
-    if(chain.first->key.fd > -1) { // don't chain onto existing chained waiter!
+    if(chain.first->key.fd > -1 && chain.first->key.ednsLevel == ednsLevel && !chain.first->key.chain.count(id)) { // don't chain onto existing chained waiter!
       /*
       cerr<<"Orig: "<<pident.domain<<", "<<pident.remote.toString()<<", id="<<id<<endl;
       cerr<<"Had hit: "<< chain.first->key.domain<<", "<<chain.first->key.remote.toString()<<", id="<<chain.first->key.id
           <<", count="<<chain.first->key.chain.size()<<", origfd: "<<chain.first->key.fd<<endl;
       */
       chain.first->key.chain.insert(id); // we can chain
+      *ping=chain.first->key.ping;       // the answer will carry the nonce of the query that went out
       *fd=-1;                            // gets used in waitEvent / sendEvent later on
       return 1;
     }
@@ -390,13 +512,17 @@ int asendto(const char *data, int len, int flags,
   pident.fd=*fd;
   pident.id=id;
   
-  t_fdm->addReadFD(*fd, handleUDPServerResponse, pident);
-  ret = send(*fd, data, len, 0);
+  if(t_udpclientsocks->isPooled(*fd))
+    ret = sendto(*fd, data, len, 0, (struct sockaddr*)&toaddr, toaddr.getSocklen());
+  else {
+    t_fdm->addReadFD(*fd, handleUDPServerResponse, pident);
+    ret = send(*fd, data, len, 0);
+  }
 
   int tmp = errno;
 
   if(ret < 0)
-    t_udpclientsocks->returnSocket(*fd);
+    t_udpclientsocks->returnSocket(*fd, toaddr);
 
   errno = tmp; // this is for logging purposes only
   return ret;
@@ -404,7 +530,7 @@ int asendto(const char *data, int len, int flags,
 
 // -1 is error, 0 is timeout, 1 is success
 int arecvfrom(char *data, int len, int flags, const ComboAddress& fromaddr, int *d_len, 
-              uint16_t id, const string& domain, uint16_t qtype, int fd, struct timeval* now)
+              uint16_t id, const string& domain, uint16_t qtype, int ednsLevel, const string& ping, int fd, struct timeval* now)
 {
   static optional<unsigned int> nearMissLimit;
   if(!nearMissLimit) 
@@ -416,6 +542,8 @@ int arecvfrom(char *data, int len, int flags, const ComboAddress& fromaddr, int
   pident.domain=domain;
   pident.type = qtype;
   pident.remote=fromaddr;
+  pident.ednsLevel=ednsLevel;
+  pident.ping=ping;
 
   string packet;
   int ret=MT->waitEvent(pident, &packet, g_networkTimeoutMsec, now);
@@ -434,7 +562,7 @@ int arecvfrom(char *data, int len, int flags, const ComboAddress& fromaddr, int
   }
   else {
     if(fd >= 0)
-      t_udpclientsocks->returnSocket(fd);
+      t_udpclientsocks->returnSocket(fd, fromaddr);
   }
   return ret;
 }
@@ -486,6 +614,70 @@ void updateRcodeStats(int res)
   }
 }
 
+//! the authoritatives could not be reached, see if we have an answer that expired less than serve-stale seconds ago
+static void tryServeStale(const DNSComboWriter* dc, vector<DNSResourceRecord>& ret, int& res)
+{
+  SyncRes sr(dc->d_now);
+  sr.setServeStale(MemRecursorCache::s_serveStale);
+  
+  vector<DNSResourceRecord> stale;
+  int staleRes=sr.beginResolve(dc->d_mdp.d_qname, QType(dc->d_mdp.d_qtype), dc->d_mdp.d_qclass, stale);
+  if(staleRes < 0 || staleRes == RCode::ServFail || stale.empty())
+    return;
+
+  for(vector<DNSResourceRecord>::iterator i=stale.begin(); i != stale.end(); ++i)
+    i->ttl=min(i->ttl, 30U); // as recommended by RFC 8767, so clients come back for fresh data soon
+  ret.swap(stale);
+  res=staleRes;
+  g_stats.staleAnswers++;
+}
+
+struct RefreshRequest
+{
+  string qname;
+  QType qtype;
+};
+
+typedef set<pair<string, uint16_t> > refreshing_t;
+__thread refreshing_t* t_refreshing; // refreshes in progress in this thread
+
+void doRefresh(void* p)
+{
+  RefreshRequest* rr=(RefreshRequest*)p;
+  try {
+    struct timeval now;
+    Utility::gettimeofday(&now, 0);
+    SyncRes sr(now);
+    sr.setId(MT->getTid());
+    sr.setRefresh();
+    vector<DNSResourceRecord> ret;
+    sr.beginResolve(rr->qname, rr->qtype, 1, ret);
+  }
+  catch(AhuException &ae) {
+    L<<Logger::Error<<"Refreshing '"<<rr->qname<<"|"<<rr->qtype.getName()<<"': "<<ae.reason<<endl;
+  }
+  catch(std::exception& e) {
+    L<<Logger::Error<<"STL error refreshing '"<<rr->qname<<"|"<<rr->qtype.getName()<<"': "<<e.what()<<endl;
+  }
+  t_refreshing->erase(make_pair(rr->qname, rr->qtype.getCode()));
+  delete rr;
+}
+
+//! resolve qname|qtype again in the background, so the next client does not have to wait for it to expire
+static void scheduleRefresh(const string& qname, const QType& qtype)
+{
+  if(!t_refreshing)
+    t_refreshing=new refreshing_t;
+  if(MT->numProcesses() > g_maxMThreads || !t_refreshing->insert(make_pair(qname, qtype.getCode())).second)
+    return;
+
+  RefreshRequest* rr=new RefreshRequest;
+  rr->qname=qname;
+  rr->qtype=qtype;
+  g_stats.cacheRefreshes++;
+  MT->makeThread(doRefresh, rr); // deletes rr
+}
+
 void startDoResolve(void *p)
 {
   DNSComboWriter* dc=(DNSComboWriter *)p;
@@ -521,9 +713,15 @@ void startDoResolve(void *p)
     int res;
 
     bool variableAnswer = false;
+    vector<MemRecursorCache::WireRecord> wire;
+    // without a PowerDNSLua to consult, a plain cache hit gets copied into the answer without parsing it first
+    if(!t_pdl->get() && sr.getCachedWireAnswer(dc->d_mdp.d_qname, QType(dc->d_mdp.d_qtype), dc->d_mdp.d_qclass, wire)) 
+      res = RCode::NoError;
     // if there is a PowerDNSLua active, and it 'took' the query in preResolve, we don't launch beginResolve
-    if(!t_pdl->get() || !(*t_pdl)->preresolve(dc->d_remote, g_listenSocketsAddresses[dc->d_socket], dc->d_mdp.d_qname, QType(dc->d_mdp.d_qtype), ret, res, &variableAnswer)) {
+    else if(!t_pdl->get() || !(*t_pdl)->preresolve(dc->d_remote, g_listenSocketsAddresses[dc->d_socket], dc->d_mdp.d_qname, QType(dc->d_mdp.d_qtype), ret, res, &variableAnswer)) {
        res = sr.beginResolve(dc->d_mdp.d_qname, QType(dc->d_mdp.d_qtype), dc->d_mdp.d_qclass, ret);
+      if(res == RCode::ServFail && MemRecursorCache::s_serveStale)
+        tryServeStale(dc, ret, res);
 
       if(t_pdl->get()) {
         if(res == RCode::NoError) {
@@ -553,7 +751,23 @@ void startDoResolve(void *p)
       pw.getHeader()->rcode=res;
       updateRcodeStats(res);
     
-      if(ret.size()) {
+      if(!wire.empty()) {
+        random_shuffle(wire.begin(), wire.end());
+
+        for(vector<MemRecursorCache::WireRecord>::const_iterator i=wire.begin(); i!=wire.end(); ++i) {
+          uint32_t ttl=i->d_ttd - dc->d_now.tv_sec;
+          pw.startRecord(dc->d_mdp.d_qname, dc->d_mdp.d_qtype, ttl, 1, DNSPacketWriter::ANSWER);
+          minTTL = min(minTTL, ttl);
+          pw.xfrBlob(i->d_rdata);
+          if(pw.size() > maxanswersize) {
+            pw.rollback();
+            pw.getHeader()->tc=1;
+            goto sendit;
+          }
+        }
+        pw.commit();
+      }
+      else if(ret.size()) {
         orderAndShuffle(ret);
         
         for(vector<DNSResourceRecord>::const_iterator i=ret.begin(); i!=ret.end(); ++i) {
@@ -581,8 +795,8 @@ void startDoResolve(void *p)
   sendit:;
     if(!dc->d_tcp) {
       sendto(dc->d_socket, (const char*)&*packet.begin(), packet.size(), 0, (struct sockaddr *)(&dc->d_remote), dc->d_remote.getSocklen());
-      if(!SyncRes::s_nopacketcache && !variableAnswer ) {
-        t_packetCache->insertResponsePacket(string((const char*)&*packet.begin(), packet.size()), g_now.tv_sec, 
+      if(!SyncRes::s_nopacketcache && !variableAnswer && dc->d_qhashed) {
+        t_packetCache->insertResponsePacket(dc->d_qhash, dc->d_ednsSize, string((const char*)&*packet.begin(), packet.size()), g_now.tv_sec, 
         				   min(minTTL, 
         				       (pw.getHeader()->rcode == RCode::ServFail) ? SyncRes::s_packetcacheservfailttl : SyncRes::s_packetcachettl
         				       ) 
@@ -632,6 +846,8 @@ void startDoResolve(void *p)
     }
 
     sr.d_outqueries ? t_RC->cacheMisses++ : t_RC->cacheHits++; 
+    if(!sr.d_refreshQname.empty())
+      scheduleRefresh(sr.d_refreshQname, sr.d_refreshQtype);
     float spent=makeFloat(sr.d_now-dc->d_now);
     if(spent < 0.001)
       g_stats.answers0_1++;
@@ -703,7 +919,7 @@ void makeControlChannelSocket(int processNum=-1)
 
 void handleRunningTCPQuestion(int fd, FDMultiplexer::funcparam_t& var)
 {
-  shared_ptr<TCPConnection> conn=any_cast<shared_ptr<TCPConnection> >(var);
+  shared_ptr<TCPConnection> conn=funcparam_cast<shared_ptr<TCPConnection> >(var);
 
   if(conn->state==TCPConnection::BYTE0) {
     int bytes=recv(conn->getFD(), conn->data, 2, 0);
@@ -817,22 +1033,22 @@ string* doProcessUDPQuestion(const std::string& question, const ComboAddress& fr
 {
   ++g_stats.qcounter;
 
-  string response;
+  char response[1680]; // the most startDoResolve() will ever put in a UDP answer
+  unsigned int responseLen=sizeof(response);
+  uint32_t qhash=0;
+  uint16_t ednsSize=0;
+  bool qhashed=!SyncRes::s_nopacketcache && RecursorPacketCache::getQuestionHash(question.c_str(), question.length(), &qhash, &ednsSize);
   try {
-    uint32_t age;
-    if(!SyncRes::s_nopacketcache && t_packetCache->getResponsePacket(question, g_now.tv_sec, &response, &age)) {
+    if(qhashed && t_packetCache->getResponsePacket(qhash, question.c_str(), question.length(), g_now.tv_sec, response, &responseLen)) {
       if(!g_quiet)
 	L<<Logger::Error<<t_id<< " question answered from packet cache from "<<fromaddr.toString()<<endl;
 
       g_stats.packetCacheHits++;
       SyncRes::s_queries++;
-      ageDNSPacket(response, age);
-      sendto(fd, response.c_str(), response.length(), 0, (struct sockaddr*) &fromaddr, fromaddr.getSocklen());
-      if(response.length() >= sizeof(struct dnsheader)) {
-        struct dnsheader dh;
-        memcpy(&dh, response.c_str(), sizeof(dh));
-        updateRcodeStats(dh.rcode);
-      }
+      sendto(fd, response, responseLen, 0, (struct sockaddr*) &fromaddr, fromaddr.getSocklen());
+      struct dnsheader dh;
+      memcpy(&dh, response, sizeof(dh));
+      updateRcodeStats(dh.rcode);
       g_stats.avgLatencyUsec=(uint64_t)((1-0.0001)*g_stats.avgLatencyUsec + 0); // we assume 0 usec
       return 0;
     }
@@ -851,12 +1067,17 @@ string* doProcessUDPQuestion(const std::string& question, const ComboAddress& fr
   DNSComboWriter* dc = new DNSComboWriter(question.c_str(), question.size(), g_now);
   dc->setSocket(fd);
   dc->setRemote(&fromaddr);
+  dc->d_qhashed=qhashed;
+  dc->d_qhash=qhash;
+  dc->d_ednsSize=ednsSize;
 
   dc->d_tcp=false;
   MT->makeThread(startDoResolve, (void*) dc); // deletes dc
   return 0;
 } 
  
+static void distributeQuestion(const char* data, unsigned int len, const ComboAddress& fromaddr, int fd);
+
 void handleNewUDPQuestion(int fd, FDMultiplexer::funcparam_t& var)
 {
   int len;
@@ -882,11 +1103,10 @@ void handleNewUDPQuestion(int fd, FDMultiplexer::funcparam_t& var)
           L<<Logger::Error<<"Ignoring answer from "<<fromaddr.toString()<<" on server socket!"<<endl;
       }
       else {
-	string question(data, len);
 	if(g_weDistributeQueries)
-	  distributeAsyncFunction(boost::bind(doProcessUDPQuestion, question, fromaddr, fd));
+	  distributeQuestion(data, len, fromaddr, fd);
 	else
-	  doProcessUDPQuestion(question, fromaddr, fd);
+	  doProcessUDPQuestion(string(data, len), fromaddr, fd);
       }
     }
     catch(MOADNSException& mde) {
@@ -903,7 +1123,7 @@ void handleNewUDPQuestion(int fd, FDMultiplexer::funcparam_t& var)
 }
 
 
-typedef vector<pair<int, function< void(int, any&) > > > deferredAdd_t;
+typedef vector<pair<int, function< void(int, FDMultiplexer::funcparam_t&) > > > deferredAdd_t;
 deferredAdd_t deferredAdd;
 
 void makeTCPServerSockets()
@@ -1104,7 +1324,6 @@ static void houseKeeping(void *)
 try
 {
   static __thread time_t last_stat, last_rootupdate, last_prune;
-  static __thread int cleanCounter=0;
   struct timeval now;
   Utility::gettimeofday(&now, 0);
 
@@ -1113,19 +1332,17 @@ try
   if(now.tv_sec - last_prune > (time_t)(5 + t_id)) { 
     DTime dt;
     dt.setTimeval(now);
-    t_RC->doPrune(); // this function is local to a thread, so fine anyhow
+    if(!t_RC->isShared() || !t_id)
+      t_RC->doPrune(); // a private cache is local to a thread, a shared one locks its shards
     t_packetCache->doPruneTo(::arg().asNum("max-packetcache-entries") / g_numThreads);
     
-    pruneCollection(t_sstorage->negcache, ::arg().asNum("max-cache-entries") / (g_numThreads * 10), 200);
+    if(!t_sstorage->negcache->isShared())
+      t_sstorage->negcache->prune(::arg().asNum("max-negcache-entries") / g_numThreads);
+    else if(!t_id)
+      t_sstorage->negcache->prune(::arg().asNum("max-negcache-entries"));
     
-    if(!((cleanCounter++)%40)) {  // this is a full scan!
-      time_t limit=now.tv_sec-300;
-      for(SyncRes::nsspeeds_t::iterator i = t_sstorage->nsSpeeds.begin() ; i!= t_sstorage->nsSpeeds.end(); )
-        if(i->second.stale(limit))
-          t_sstorage->nsSpeeds.erase(i++);
-        else
-          ++i;
-    }
+    if(!t_sstorage->infra->isShared() || !t_id)
+      t_sstorage->infra->pruneSpeeds(now.tv_sec-300);
 //    L<<Logger::Warning<<"Spent "<<dt.udiff()/1000<<" msec cleaning"<<endl;
     last_prune=time(0);
   }
@@ -1159,6 +1376,41 @@ catch(AhuException& ae)
 }
 ;
 
+//! an eventfd where we have it, a pipe otherwise
+static void makeWakeup(int* readfd, int* writefd)
+{
+#ifdef __linux__
+  int efd=eventfd(0, 0);
+  if(efd >= 0) {
+    Utility::setNonBlocking(efd);
+    Utility::setCloseOnExec(efd);
+    *readfd=*writefd=efd;
+    return;
+  }
+#endif
+  int fd[2];
+  if(pipe(fd) < 0)
+    unixDie("Creating pipe for inter-thread communications");
+  Utility::setNonBlocking(fd[0]);
+  Utility::setNonBlocking(fd[1]);
+  *readfd=fd[0];
+  *writefd=fd[1];
+}
+
+static void wakeup(int writefd)
+{
+  uint64_t one=1;
+  if(write(writefd, &one, sizeof(one)) < 0 && errno != EAGAIN) // a full pipe has enough wakeups in it
+    unixDie("write to thread wakeup returned error");
+}
+
+static void drainWakeups(int readfd)
+{
+  char buf[64];
+  while(read(readfd, buf, sizeof(buf)) > 0)
+    ;
+}
+
 void makeThreadPipes()
 {
   for(unsigned int n=0; n < g_numThreads; ++n) {
@@ -1174,6 +1426,13 @@ void makeThreadPipes()
       unixDie("Creating pipe for inter-thread communications");
     tps.readFromThread = fd[0];
     tps.writeFromThread = fd[1];
+
+    tps.questions=0;
+    tps.questionsWakeRead=tps.questionsWakeWrite=-1;
+    if(g_weDistributeQueries && n) {
+      tps.questions=new SPSCRing<DistributedQuestion>(s_distributedQuestionsRingSize);
+      makeWakeup(&tps.questionsWakeRead, &tps.questionsWakeWrite);
+    }
     
     g_pipes.push_back(tps);
   }
@@ -1212,10 +1471,8 @@ void broadcastFunction(const pipefunc_t& func, bool skipSelf)
     }
   }
 }
-void distributeAsyncFunction(const pipefunc_t& func)
+static void asyncFunctionToThread(unsigned int target, const pipefunc_t& func)
 {
-  static unsigned int counter;
-  unsigned int target = 1 + (++counter % (g_pipes.size()-1));
   // cerr<<"Sending to: "<<target<<endl;
   if(target == t_id) {
     func();
@@ -1228,7 +1485,66 @@ void distributeAsyncFunction(const pipefunc_t& func)
   
   if(write(tps.writeToThread, &tmsg, sizeof(tmsg)) != sizeof(tmsg))
     unixDie("write to thread pipe returned wrong size or error");
-    
+}
+
+void distributeAsyncFunction(const pipefunc_t& func)
+{
+  static unsigned int counter;
+  asyncFunctionToThread(1 + (++counter % (g_pipes.size()-1)), func);
+}
+
+//! case insensitive hash of the qname in a question, without parsing it fully
+static uint32_t hashQuestionName(const char* packet, unsigned int len)
+{
+  if(len <= sizeof(dnsheader))
+    return 0;
+  unsigned int pos=sizeof(dnsheader);
+  while(pos < len && packet[pos])
+    pos+=(unsigned char)packet[pos] + 1;
+  return pdns_ihash(packet + sizeof(dnsheader), min(pos, len) - sizeof(dnsheader));
+}
+
+/* hands a question to the worker thread its qname hashes to, so a name is always resolved, and cached, by the same
+   thread. The question goes into that thread's ring, which only needs a wakeup when it was empty. Should the ring
+   be full, the question takes the slow road through the thread pipe, to the same thread */
+static void distributeQuestion(const char* data, unsigned int len, const ComboAddress& fromaddr, int fd)
+{
+  unsigned int target = 1 + hashQuestionName(data, len) % (g_pipes.size()-1);
+  ThreadPipeSet& tps = g_pipes[target];
+
+  DistributedQuestion* dq=tps.questions->producerSlot();
+  if(!dq) {
+    asyncFunctionToThread(target, boost::bind(doProcessUDPQuestion, string(data, len), fromaddr, fd));
+    return;
+  }
+  dq->question.assign(data, len);
+  dq->fromaddr=fromaddr;
+  dq->fd=fd;
+  if(tps.questions->produce())
+    wakeup(tps.questionsWakeWrite);
+}
+
+//! runs in the worker threads, on a wakeup from distributeQuestion()
+void handleDistributedQuestions(int fd, FDMultiplexer::funcparam_t& var)
+{
+  drainWakeups(fd);
+
+  SPSCRing<DistributedQuestion>* ring=g_pipes[t_id].questions;
+  for(unsigned int n=0; n < ring->capacity(); ++n) {
+    DistributedQuestion* dq=ring->consumerSlot();
+    if(!dq)
+      return;
+    try {
+      doProcessUDPQuestion(dq->question, dq->fromaddr, dq->fd);
+    }
+    catch(MOADNSException& mde) {
+      g_stats.clientParseError++; 
+      if(g_logCommonErrors)
+        L<<Logger::Error<<"Unable to parse packet from remote UDP client "<<dq->fromaddr.toString() <<": "<<mde.what()<<endl;
+    }
+    ring->consume();
+  }
+  wakeup(g_pipes[t_id].questionsWakeWrite); // there is more, but let our other fds have a go first
 }
 
 void handlePipeRequest(int fd, FDMultiplexer::funcparam_t& var)
@@ -1322,7 +1638,7 @@ void handleRCC(int fd, FDMultiplexer::funcparam_t& var)
 
 void handleTCPClientReadable(int fd, FDMultiplexer::funcparam_t& var)
 {
-  PacketID* pident=any_cast<PacketID>(&var);
+  PacketID* pident=funcparam_cast<PacketID>(&var);
   //  cerr<<"handleTCPClientReadable called for fd "<<fd<<", pident->inNeeded: "<<pident->inNeeded<<", "<<pident->sock->getHandle()<<endl;
 
   shared_array<char> buffer(new char[pident->inNeeded]);
@@ -1353,7 +1669,7 @@ void handleTCPClientReadable(int fd, FDMultiplexer::funcparam_t& var)
 
 void handleTCPClientWritable(int fd, FDMultiplexer::funcparam_t& var)
 {
-  PacketID* pid=any_cast<PacketID>(&var);
+  PacketID* pid=funcparam_cast<PacketID>(&var);
   int ret=send(fd, pid->outMSG.c_str() + pid->outPos, pid->outMSG.size() - pid->outPos,0);
   if(ret > 0) {
     pid->outPos+=ret;
@@ -1389,7 +1705,6 @@ void doResends(MT_t::waiters_t::iterator& iter, PacketID resend, const string& c
 
 void handleUDPServerResponse(int fd, FDMultiplexer::funcparam_t& var)
 {
-  PacketID pid=any_cast<PacketID>(var);
   int len;
   char data[1500];
   ComboAddress fromaddr;
@@ -1407,7 +1722,11 @@ void handleUDPServerResponse(int fd, FDMultiplexer::funcparam_t& var)
           ": packet smalller than DNS header"<<endl;
     }
 
-    t_udpclientsocks->returnSocket(fd);
+    PacketID* pident=funcparam_cast<PacketID>(&var);
+    if(!pident) // a pooled socket, we can't tell which question this was meant for, it will time out
+      return;
+    PacketID pid=*pident;
+    t_udpclientsocks->returnSocket(fd, pid.remote);
     string empty;
 
     MT_t::waiters_t::iterator iter=MT->d_waiters.find(pid);
@@ -1473,7 +1792,7 @@ void handleUDPServerResponse(int fd, FDMultiplexer::funcparam_t& var)
       }
     }
     else if(fd >= 0) {
-      t_udpclientsocks->returnSocket(fd);
+      t_udpclientsocks->returnSocket(fd, fromaddr);
     }
   }
   else
@@ -1705,6 +2024,8 @@ int serviceMain(int argc, char*argv[])
 
   SyncRes::s_nopacketcache = ::arg().mustDo("disable-packetcache");
 
+  SyncRes::s_refreshAhead=min(::arg().asNum("refresh-ahead"), 100);
+  MemRecursorCache::s_serveStale=::arg().asNum("serve-stale");
   SyncRes::s_maxnegttl=::arg().asNum("max-negative-ttl");
   SyncRes::s_maxcachettl=::arg().asNum("max-cache-ttl");
   SyncRes::s_packetcachettl=::arg().asNum("packetcache-ttl");
@@ -1717,12 +2038,36 @@ int serviceMain(int argc, char*argv[])
   }
   
   g_networkTimeoutMsec = ::arg().asNum("network-timeout");
+  g_outgoingSocketPoolSize = ::arg().asNum("outgoing-socket-pool-size");
+  g_outgoingSocketReuse = max(1, ::arg().asNum("outgoing-socket-reuse"));
+  if(g_outgoingSocketPoolSize)
+    L<<Logger::Warning<<"Sending outgoing queries from a pool of "<<g_outgoingSocketPoolSize<<" sockets per thread, which is weaker against spoofing than a fresh port per query"<<endl;
 
   g_initialDomainMap = parseAuthAndForwards();
  
     
   g_logCommonErrors=::arg().mustDo("log-common-errors");
   
+  if(!::arg()["load-cache"].empty()) {
+    string fname=::arg()["load-cache"];
+    ifstream ifs(fname.c_str(), std::ios::binary);
+    if(!ifs) {
+      L<<Logger::Warning<<"Could not open cache snapshot '"<<fname<<"', starting with an empty cache"<<endl;
+    }
+    else {
+      g_snapshot=new string((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+      try {
+        time_t written=checkSnapshot(*g_snapshot);
+        L<<Logger::Warning<<"Loading cache snapshot '"<<fname<<"' of "<<g_snapshot->length()<<" bytes, written "<<(time(0)-written)<<" seconds ago"<<endl;
+      }
+      catch(AhuException& ae) {
+        L<<Logger::Error<<"Not loading cache snapshot '"<<fname<<"': "<<ae.reason<<endl;
+        delete g_snapshot;
+        g_snapshot=0;
+      }
+    }
+  }
+
   makeUDPServerSockets();
   makeTCPServerSockets();
 
@@ -1765,6 +2110,8 @@ int serviceMain(int argc, char*argv[])
 
   Utility::dropPrivs(newuid, newgid);
   g_numThreads = ::arg().asNum("threads") + ::arg().mustDo("pdns-distributes-queries");
+  for(unsigned int n=0; g_snapshot && n < g_numThreads; ++n)
+    ++g_snapshotPending;
   
   makeThreadPipes();
   
@@ -1772,6 +2119,23 @@ int serviceMain(int argc, char*argv[])
   g_maxTCPPerClient=::arg().asNum("max-tcp-per-client");
   g_maxMThreads=::arg().asNum("max-mthreads");
 
+  if(::arg().mustDo("share-record-cache")) {
+    g_sharedRC = new MemRecursorCache(::arg().asNum("record-cache-shards"));
+    L<<Logger::Warning<<"All threads share one record cache, in "<<::arg().asNum("record-cache-shards")<<" shards"<<endl;
+  }
+
+  if(::arg().mustDo("share-infra-cache")) {
+    g_sharedInfra = new SyncRes::InfraCache(::arg().asNum("infra-cache-shards"));
+    L<<Logger::Warning<<"All threads share their throttles, nameserver speeds and EDNS status, in "<<::arg().asNum("infra-cache-shards")<<" shards"<<endl;
+  }
+
+  if(::arg().mustDo("share-negcache")) {
+    g_sharedNegCache = new SyncRes::NegCache(::arg().asNum("negcache-shards"));
+    L<<Logger::Warning<<"All threads share one negative cache, in "<<::arg().asNum("negcache-shards")<<" shards"<<endl;
+    if(!g_sharedRC)
+      L<<Logger::Warning<<"Without share-record-cache, a thread can only answer from the shared negative cache if it has the SOA record itself"<<endl;
+  }
+
   if(g_numThreads == 1) {
     L<<Logger::Warning<<"Operating unthreaded"<<endl;
     recursorThread(0);
@@ -1804,6 +2168,22 @@ try
   t_packetCache = new RecursorPacketCache();
   
   L<<Logger::Warning<<"Done priming cache with root hints"<<endl;
+
+  if(g_snapshot) {
+    DTime dt;
+    dt.set();
+    try {
+      uint64_t loaded=loadThreadSnapshot(*g_snapshot);
+      L<<Logger::Warning<<"Thread "<<t_id<<" loaded "<<loaded<<" entries from cache snapshot in "<<dt.udiff()/1000<<" msec"<<endl;
+    }
+    catch(AhuException& ae) {
+      L<<Logger::Error<<"Thread "<<t_id<<" stopped loading cache snapshot: "<<ae.reason<<endl;
+    }
+    if(!--g_snapshotPending) {
+      delete g_snapshot;
+      g_snapshot=0;
+    }
+  }
     
   t_RC->d_followRFC2181=::arg().mustDo("auth-can-lower-ttl");
   t_pdl = new shared_ptr<PowerDNSLua>();
@@ -1827,7 +2207,7 @@ try
     memset(&t_remotes->remotes[0], 0, t_remotes->remotes.size() * sizeof(RemoteKeeper::remotes_t::value_type));
   
   
-  MT=new MTasker<PacketID,string>(::arg().asNum("stack-size"));
+  MT=new MT_t(::arg().asNum("stack-size"));
   
   PacketID pident;
 
@@ -1836,6 +2216,8 @@ try
     L<<Logger::Error<<"Enabled '"<< t_fdm->getName() << "' multiplexer"<<endl;
 
   t_fdm->addReadFD(g_pipes[t_id].readToThread, handlePipeRequest);
+  if(g_pipes[t_id].questions)
+    t_fdm->addReadFD(g_pipes[t_id].questionsWakeRead, handleDistributedQuestions);
 
   if(!g_weDistributeQueries || !t_id)  // if we distribute queries, only t_id = 0 listens
     for(deferredAdd_t::const_iterator i=deferredAdd.begin(); i!=deferredAdd.end(); ++i) 
@@ -1862,7 +2244,7 @@ try
       expired_t expired=t_fdm->getTimeouts(g_now);
         
       for(expired_t::iterator i=expired.begin() ; i != expired.end(); ++i) {
-        shared_ptr<TCPConnection> conn=any_cast<shared_ptr<TCPConnection> >(i->second);
+        shared_ptr<TCPConnection> conn=funcparam_cast<shared_ptr<TCPConnection> >(i->second);
         if(g_logCommonErrors)
           L<<Logger::Warning<<"Timeout from remote TCP client "<< conn->d_remote.toString() <<endl;
         t_fdm->removeReadFD(i->first);
@@ -1989,6 +2371,16 @@ int main(int argc, char **argv)
     ::arg().set("max-tcp-clients","Maximum number of simultaneous TCP clients")="128";
     ::arg().set("hint-file", "If set, load root hints from this file")="";
     ::arg().set("max-cache-entries", "If set, maximum number of entries in the main cache")="1000000";
+    ::arg().set("share-record-cache", "If set, all threads use one record cache instead of each having their own")="no";
+    ::arg().set("load-cache", "Fill the caches from this snapshot, as written by 'rec_control save-cache', at startup")="";
+    ::arg().set("record-cache-shards", "Number of locks the shared record cache is striped over")="1024";
+    ::arg().set("share-infra-cache", "If set, all threads share throttles, nameserver speeds and EDNS status instead of each learning their own")="no";
+    ::arg().set("infra-cache-shards", "Number of locks the shared throttles, nameserver speeds and EDNS status are striped over")="64";
+    ::arg().set("max-negcache-entries", "Maximum number of entries in the negative cache")="100000";
+    ::arg().set("share-negcache", "If set, all threads use one negative cache instead of each having their own")="no";
+    ::arg().set("negcache-shards", "Number of locks the shared negative cache is striped over")="64";
+    ::arg().set("refresh-ahead", "Refresh cache entries in the background when hit in the last this many percent of their TTL, 0 to disable")="0";
+    ::arg().set("serve-stale", "If the authoritatives can't be reached, answer with records that expired up to this many seconds ago")="0";
     ::arg().set("max-negative-ttl", "maximum number of seconds to keep a negative cached entry in memory")="3600";
     ::arg().set("max-cache-ttl", "maximum number of seconds to keep a cached entry in memory")="86400";
     ::arg().set("packetcache-ttl", "maximum number of seconds to keep a cached entry in packetcache")="3600";
@@ -2004,6 +2396,8 @@ int main(int argc, char **argv)
     ::arg().set("max-tcp-per-client", "If set, maximum number of TCP sessions per client (IP address)")="0";
     ::arg().set("spoof-nearmiss-max", "If non-zero, assume spoofing after this many near misses")="20";
     ::arg().set("single-socket", "If set, only use a single socket for outgoing queries")="off";
+    ::arg().set("outgoing-socket-pool-size", "If non-zero, send outgoing UDP queries from a pool of this many sockets per thread and address family, instead of a fresh socket each")="0";
+    ::arg().set("outgoing-socket-reuse", "Replace a pooled outgoing socket after it sent this many queries")="20";
     ::arg().set("auth-zones", "Zones for which we have authoritative data, comma separated domain=file pairs ")="";
     ::arg().set("forward-zones", "Zones for which we forward queries, comma separated domain=ip pairs")="";
     ::arg().set("forward-zones-recurse", "Zones for which we forward queries with recursion bit, comma separated domain=ip pairs")="";
@@ -10,41 +10,46 @@
 #include "namespaces.hh"
 
 
-static FDMultiplexer* make()
+class PollFDMultiplexer : public FDMultiplexer
 {
-  return new PollFDMultiplexer();
-}
-
-static struct RegisterOurselves
-{
-  RegisterOurselves() {
-    FDMultiplexer::getMultiplexerMap().insert(make_pair(1, &make));
+public:
+  PollFDMultiplexer()
+  {}
+  virtual ~PollFDMultiplexer()
+  {}
+
+  virtual int run(struct timeval* tv);
+
+  virtual void addFD(callbacktable_t& cbtable, int fd, callbackfunc_t toDo, const funcparam_t& parameter);
+  virtual void removeFD(callbacktable_t& cbtable, int fd);
+  string getName()
+  {
+    return "poll";
   }
-} doIt;
+private:
+  vector<struct pollfd> d_pollfds;
+};
 
-void PollFDMultiplexer::addFD(callbackmap_t& cbmap, int fd, callbackfunc_t toDo, const boost::any& parameter)
+static FDMultiplexer* makePoll()
 {
-  Callback cb;
-  cb.d_callback=toDo;
-  cb.d_parameter=parameter;
-  memset(&cb.d_ttd, 0, sizeof(cb.d_ttd));
-  if(cbmap.count(fd))
-    throw FDMultiplexerException("Tried to add fd "+lexical_cast<string>(fd)+ " to multiplexer twice");
-  cbmap[fd]=cb;
+  return new PollFDMultiplexer();
 }
 
-void PollFDMultiplexer::removeFD(callbackmap_t& cbmap, int fd)
+static struct PollRegisterOurselves
 {
-  if(d_inrun && d_iter->first==fd)  // trying to remove us!
-    d_iter++;
+  PollRegisterOurselves() {
+    FDMultiplexer::getMultiplexerMap().insert(make_pair(1, &makePoll));
+  }
+} doItPoll;
 
-  if(!cbmap.erase(fd))
-    throw FDMultiplexerException("Tried to remove unlisted fd "+lexical_cast<string>(fd)+ " from multiplexer");
+void PollFDMultiplexer::addFD(callbacktable_t& cbtable, int fd, callbackfunc_t toDo, const funcparam_t& parameter)
+{
+  accountingAddFD(cbtable, fd, toDo, parameter);
 }
 
-bool pollfdcomp(const struct pollfd& a, const struct pollfd& b)
+void PollFDMultiplexer::removeFD(callbacktable_t& cbtable, int fd)
 {
-  return a.fd < b.fd;
+  accountingRemoveFD(cbtable, fd);
 }
 
 int PollFDMultiplexer::run(struct timeval* now)
@@ -53,46 +58,39 @@ int PollFDMultiplexer::run(struct timeval* now)
     throw FDMultiplexerException("FDMultiplexer::run() is not reentrant!\n");
   }
   
-  vector<struct pollfd> pollfds;
+  d_pollfds.clear();
   
   struct pollfd pollfd;
-  for(callbackmap_t::const_iterator i=d_readCallbacks.begin(); i != d_readCallbacks.end(); ++i) {
-    pollfd.fd = i->first;
-    pollfd.events = POLLIN;
-    pollfds.push_back(pollfd);
+  for(unsigned int fd=0; fd < d_readCallbacks.size(); ++fd) {
+    if(d_readCallbacks[fd].d_active) {
+      pollfd.fd = fd;
+      pollfd.events = POLLIN;
+      d_pollfds.push_back(pollfd);
+    }
   }
 
-  for(callbackmap_t::const_iterator i=d_writeCallbacks.begin(); i != d_writeCallbacks.end(); ++i) {
-    pollfd.fd = i->first;
-    pollfd.events = POLLOUT;
-    pollfds.push_back(pollfd);
+  for(unsigned int fd=0; fd < d_writeCallbacks.size(); ++fd) {
+    if(d_writeCallbacks[fd].d_active) {
+      pollfd.fd = fd;
+      pollfd.events = POLLOUT;
+      d_pollfds.push_back(pollfd);
+    }
   }
 
-  int ret=poll(&pollfds[0], pollfds.size(), 500);
+  int ret=poll(d_pollfds.empty() ? 0 : &d_pollfds[0], d_pollfds.size(), 500);
   Utility::gettimeofday(now, 0); // MANDATORY!
   
   if(ret < 0 && errno!=EINTR)
     throw FDMultiplexerException("poll returned error: "+stringerror());
 
-  d_iter=d_readCallbacks.end();
+  if(ret < 1) // nothing
+    return 0;
+
   d_inrun=true;
   
-  for(unsigned int n = 0; n < pollfds.size(); ++n) {  
-    if(pollfds[n].revents == POLLIN) {
-      d_iter=d_readCallbacks.find(pollfds[n].fd);
-    
-      if(d_iter != d_readCallbacks.end()) {
-        d_iter->second.d_callback(d_iter->first, d_iter->second.d_parameter);
-        continue; // so we don't refind ourselves as writable!
-      }
-    }
-    else if(pollfds[n].revents == POLLOUT) {
-      d_iter=d_writeCallbacks.find(pollfds[n].fd);
-    
-      if(d_iter != d_writeCallbacks.end()) {
-        d_iter->second.d_callback(d_iter->first, d_iter->second.d_parameter);
-      }
-    }
+  for(unsigned int n = 0; n < d_pollfds.size(); ++n) {  
+    if(d_pollfds[n].revents) // errors and hangups are reported to the callback too, its read or write will tell
+      dispatch(d_pollfds[n].events == POLLIN ? d_readCallbacks : d_writeCallbacks, d_pollfds[n].fd);
   }
   d_inrun=false;
   return 0;
@@ -100,10 +98,10 @@ int PollFDMultiplexer::run(struct timeval* now)
 
 #if 0
 
-void acceptData(int fd, boost::any& parameter)
+void acceptData(int fd, FDMultiplexer::funcparam_t& parameter)
 {
   cout<<"Have data on fd "<<fd<<endl;
-  Socket* sock=boost::any_cast<Socket*>(parameter);
+  Socket* sock=funcparam_cast<Socket*>(parameter);
   string packet;
   IPEndpoint rem;
   sock->recvFrom(packet, rem);
@@ -25,8 +25,8 @@ public:
 
   virtual int run(struct timeval* tv);
 
-  virtual void addFD(callbackmap_t& cbmap, int fd, callbackfunc_t toDo, const boost::any& parameter);
-  virtual void removeFD(callbackmap_t& cbmap, int fd);
+  virtual void addFD(callbacktable_t& cbtable, int fd, callbackfunc_t toDo, const funcparam_t& parameter);
+  virtual void removeFD(callbacktable_t& cbtable, int fd);
   string getName()
   {
     return "solaris completion ports";
@@ -59,20 +59,19 @@ PortsFDMultiplexer::PortsFDMultiplexer() : d_pevents(new port_event_t[s_maxevent
     throw FDMultiplexerException("Setting up port: "+stringerror());
 }
 
-void PortsFDMultiplexer::addFD(callbackmap_t& cbmap, int fd, callbackfunc_t toDo, const boost::any& parameter)
+void PortsFDMultiplexer::addFD(callbacktable_t& cbtable, int fd, callbackfunc_t toDo, const funcparam_t& parameter)
 {
-  accountingAddFD(cbmap, fd, toDo, parameter);
+  accountingAddFD(cbtable, fd, toDo, parameter);
 
-  if(port_associate(d_portfd, PORT_SOURCE_FD, fd, (&cbmap == &d_readCallbacks) ? POLLIN : POLLOUT, 0) < 0) {
-    cbmap.erase(fd);
+  if(port_associate(d_portfd, PORT_SOURCE_FD, fd, (&cbtable == &d_readCallbacks) ? POLLIN : POLLOUT, 0) < 0) {
+    accountingRemoveFD(cbtable, fd);
     throw FDMultiplexerException("Adding fd to port set: "+stringerror());
   }
 }
 
-void PortsFDMultiplexer::removeFD(callbackmap_t& cbmap, int fd)
+void PortsFDMultiplexer::removeFD(callbacktable_t& cbtable, int fd)
 {
-  if(!cbmap.erase(fd))
-    throw FDMultiplexerException("Tried to remove unlisted fd "+lexical_cast<string>(fd)+ " from multiplexer");
+  accountingRemoveFD(cbtable, fd);
 
   if(port_dissociate(d_portfd, PORT_SOURCE_FD, fd) < 0 && errno != ENOENT) // it appears under some circumstances, ENOENT will be returned, without this being an error. Apache has this same "fix"
     throw FDMultiplexerException("Removing fd from port set: "+stringerror());
@@ -109,25 +108,17 @@ int PortsFDMultiplexer::run(struct timeval* now)
   d_inrun=true;
 
   for(unsigned int n=0; n < numevents; ++n) {
-    d_iter=d_readCallbacks.find(d_pevents[n].portev_object);
-    
-    if(d_iter != d_readCallbacks.end()) {
-      d_iter->second.d_callback(d_iter->first, d_iter->second.d_parameter);
-      if(d_readCallbacks.count(d_pevents[n].portev_object) && port_associate(d_portfd, PORT_SOURCE_FD, d_pevents[n].portev_object, 
-        		POLLIN, 0) < 0)
+    int fd=d_pevents[n].portev_object;
+    if(dispatch(d_readCallbacks, fd)) {
+      if(getCallback(d_readCallbacks, fd) && port_associate(d_portfd, PORT_SOURCE_FD, fd, POLLIN, 0) < 0)
         throw FDMultiplexerException("Unable to add fd back to ports (read): "+stringerror());
       continue; // so we don't find ourselves as writable again
     }
 
-    d_iter=d_writeCallbacks.find(d_pevents[n].portev_object);
-    
-    if(d_iter != d_writeCallbacks.end()) {
-      d_iter->second.d_callback(d_iter->first, d_iter->second.d_parameter);
-      if(d_writeCallbacks.count(d_pevents[n].portev_object) && port_associate(d_portfd, PORT_SOURCE_FD, d_pevents[n].portev_object, 
-        		POLLOUT, 0) < 0)
+    if(dispatch(d_writeCallbacks, fd)) {
+      if(getCallback(d_writeCallbacks, fd) && port_associate(d_portfd, PORT_SOURCE_FD, fd, POLLOUT, 0) < 0)
         throw FDMultiplexerException("Unable to add fd back to ports (write): "+stringerror());
     }
-
   }
 
   d_inrun=false;
@@ -135,10 +126,10 @@ int PortsFDMultiplexer::run(struct timeval* now)
 }
 
 #if 0
-void acceptData(int fd, boost::any& parameter)
+void acceptData(int fd, FDMultiplexer::funcparam_t& parameter)
 {
   cout<<"Have data on fd "<<fd<<endl;
-  Socket* sock=boost::any_cast<Socket*>(parameter);
+  Socket* sock=funcparam_cast<Socket*>(parameter);
   string packet;
   IPEndpoint rem;
   sock->recvFrom(packet, rem);
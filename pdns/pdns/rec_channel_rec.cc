@@ -6,6 +6,7 @@
 #include "misc.hh"
 #include "recursor_cache.hh"
 #include "syncres.hh"
+#include "recsnapshot.hh"
 #include <boost/function.hpp>
 #include <boost/optional.hpp>
 #include <boost/tuple/tuple.hpp>
@@ -110,23 +111,26 @@ string doGetParameter(T begin, T end)
 }
 
 
-static uint64_t dumpNegCache(SyncRes::negcache_t& negcache, int fd)
+static uint64_t dumpNegCache(SyncRes::NegCache& negcache, int fd)
 {
   FILE* fp=fdopen(dup(fd), "w");
   if(!fp) { // dup probably failed
     return 0;
   }
-  fprintf(fp, "; negcache dump from thread follows\n;\n");
+  fprintf(fp, negcache.isShared() ? "; shared negcache dump follows\n;\n" : "; negcache dump from thread follows\n;\n");
   time_t now = time(0);
   
   typedef SyncRes::negcache_t::nth_index<1>::type sequence_t;
-  sequence_t& sidx=negcache.get<1>();
 
   uint64_t count=0;
-  BOOST_FOREACH(const NegCacheEntry& neg, sidx)
-  {
-    ++count;
-    fprintf(fp, "%s IN %s %d VIA %s\n", neg.d_name.c_str(), neg.d_qtype.getName().c_str(), (unsigned int) (neg.d_ttd - now), neg.d_qname.c_str());
+  for(unsigned int n=0; n < negcache.numShards(); ++n) {
+    SyncRes::NegCache::ShardLock l(negcache, negcache.getShard(n));
+    sequence_t& sidx=negcache.getShard(n).d_cache.get<1>();
+    BOOST_FOREACH(const NegCacheEntry& neg, sidx)
+    {
+      ++count;
+      fprintf(fp, "%s IN %s %d VIA %s\n", neg.d_name.c_str(), neg.d_qtype.getName().c_str(), (unsigned int) (neg.d_ttd - now), neg.d_qname.c_str());
+    }
   }
   fclose(fp);
   return count;
@@ -134,7 +138,7 @@ static uint64_t dumpNegCache(SyncRes::negcache_t& negcache, int fd)
 
 static uint64_t* pleaseDump(int fd)
 {
-  return new uint64_t(t_RC->doDump(fd) + dumpNegCache(t_sstorage->negcache, fd));
+  return new uint64_t((t_RC->isShared() ? 0 : t_RC->doDump(fd)) + (t_sstorage->negcache->isShared() ? 0 : dumpNegCache(*t_sstorage->negcache, fd)));
 }
 
 template<typename T>
@@ -151,7 +155,11 @@ string doDumpCache(T begin, T end)
     return "Error opening dump file for writing: "+string(strerror(errno))+"\n";
   uint64_t total = 0;
   try {
-    total = broadcastAccFunction<uint64_t>(boost::bind(pleaseDump, fd));
+    if(t_RC->isShared()) // all threads see the same records, dump them only once
+      total = t_RC->doDump(fd);
+    if(t_sstorage->negcache->isShared())
+      total += dumpNegCache(*t_sstorage->negcache, fd);
+    total += broadcastAccFunction<uint64_t>(boost::bind(pleaseDump, fd));
   }
   catch(...){}
   
@@ -159,6 +167,51 @@ string doDumpCache(T begin, T end)
   return "dumped "+lexical_cast<string>(total)+" records\n";
 }
 
+static uint64_t* pleaseSaveSnapshot(SnapshotWriter* sw)
+{
+  return new uint64_t(writeThreadSnapshot(*sw));
+}
+
+//! writes a snapshot next to the target file, and only renames it into place once it is complete
+template<typename T>
+string doSaveCache(T begin, T end)
+{
+  if(begin==end)
+    return "Need a filename to save the cache to\n";
+  string fname=*begin, tmpname=fname+".tmp";
+
+  FILE* fp=fopen(tmpname.c_str(), "w");
+  if(!fp)
+    return "Error opening snapshot file for writing: "+string(strerror(errno))+"\n";
+  setvbuf(fp, 0, _IOFBF, 1<<20);
+
+  uint64_t total = 0;
+  try {
+    SnapshotWriter sw(fp);
+    writeSnapshotHeader(sw);
+    total = broadcastAccFunction<uint64_t>(boost::bind(pleaseSaveSnapshot, &sw));
+  }
+  catch(...) {
+    fclose(fp);
+    unlink(tmpname.c_str());
+    return "Error writing snapshot\n";
+  }
+
+  if(fflush(fp) || fsync(fileno(fp)) || ferror(fp)) {
+    string err=strerror(errno);
+    fclose(fp);
+    unlink(tmpname.c_str());
+    return "Error writing snapshot: "+err+"\n";
+  }
+  fclose(fp);
+  if(rename(tmpname.c_str(), fname.c_str()) < 0) {
+    string err=strerror(errno);
+    unlink(tmpname.c_str());
+    return "Error moving snapshot into place: "+err+"\n";
+  }
+  return "saved "+lexical_cast<string>(total)+" entries\n";
+}
+
 template<typename T>
 string doDumpEDNSStatus(T begin, T end)
 {
@@ -185,10 +238,7 @@ uint64_t* pleaseWipeCache(const std::string& canon)
 
 static uint64_t* pleaseWipeAndCountNegCache(const std::string& canon)
 {
-  uint64_t res = t_sstorage->negcache.count(tie(canon));
-  pair<SyncRes::negcache_t::iterator, SyncRes::negcache_t::iterator> range=t_sstorage->negcache.equal_range(tie(canon));
-  t_sstorage->negcache.erase(range.first, range.second);
-  return new uint64_t(res);
+  return new uint64_t(t_sstorage->negcache->wipe(canon));
 }
 
 template<typename T>
@@ -198,7 +248,10 @@ string doWipeCache(T begin, T end)
   for(T i=begin; i != end; ++i) {
     string canon=toCanonic("", *i);
     count+= broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeCache, canon));
-    countNeg+=broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeAndCountNegCache, canon));
+    if(t_sstorage->negcache->isShared())
+      countNeg+=t_sstorage->negcache->wipe(canon);
+    else
+      countNeg+=broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeAndCountNegCache, canon));
   }
 
   return "wiped "+lexical_cast<string>(count)+" records, "+lexical_cast<string>(countNeg)+" negative records\n";
@@ -254,32 +307,38 @@ static string doCurrentQueries()
 
 uint64_t* pleaseGetThrottleSize()
 {
-  return new uint64_t(t_sstorage->throttle.size());
+  return new uint64_t(t_sstorage->infra->throttleSize());
 }
 
 static uint64_t getThrottleSize()
 {
+  if(t_sstorage->infra->isShared())
+    return t_sstorage->infra->throttleSize();
   return broadcastAccFunction<uint64_t>(pleaseGetThrottleSize);
 }
 
 uint64_t* pleaseGetNegCacheSize()
 {
-  uint64_t tmp=t_sstorage->negcache.size();
+  uint64_t tmp=t_sstorage->negcache->size();
   return new uint64_t(tmp);
 }
 
 uint64_t getNegCacheSize()
 {
+  if(t_sstorage->negcache->isShared())
+    return t_sstorage->negcache->size();
   return broadcastAccFunction<uint64_t>(pleaseGetNegCacheSize);
 }
 
 uint64_t* pleaseGetNsSpeedsSize()
 {
-  return new uint64_t(t_sstorage->nsSpeeds.size());
+  return new uint64_t(t_sstorage->infra->nsSpeedsSize());
 }
 
 uint64_t getNsSpeedsSize()
 {
+  if(t_sstorage->infra->isShared())
+    return t_sstorage->infra->nsSpeedsSize();
   return broadcastAccFunction<uint64_t>(pleaseGetNsSpeedsSize);
 }
 
@@ -293,6 +352,51 @@ static uint64_t getConcurrentQueries()
   return broadcastAccFunction<uint64_t>(pleaseGetConcurrentQueries);
 }
 
+uint64_t* pleaseGetMThreadSwitches()
+{
+  return new uint64_t(MT->getSwitches());
+}
+
+static uint64_t getMThreadSwitches()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetMThreadSwitches);
+}
+
+uint64_t* pleaseGetMThreadStacks()
+{
+  return new uint64_t(MT->getStacksAllocated());
+}
+
+static uint64_t getMThreadStacks()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetMThreadStacks);
+}
+
+uint64_t* pleaseGetArenaAllocations()
+{
+  return new uint64_t(t_arenaAllocations);
+}
+
+static uint64_t getArenaAllocations()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetArenaAllocations);
+}
+
+uint64_t* pleaseGetArenaHeapAllocations()
+{
+  return new uint64_t(t_arenaHeapAllocations);
+}
+
+static uint64_t getArenaHeapAllocations()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetArenaHeapAllocations);
+}
+
+static uint64_t getPooledSockets()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetPooledSockets);
+}
+
 uint64_t* pleaseGetCacheSize()
 {
   return new uint64_t(t_RC->size());
@@ -306,11 +410,15 @@ uint64_t* pleaseGetCacheBytes()
 
 uint64_t doGetCacheSize()
 {
+  if(t_RC->isShared())
+    return t_RC->size();
   return broadcastAccFunction<uint64_t>(pleaseGetCacheSize);
 }
 
 uint64_t doGetCacheBytes()
 {
+  if(t_RC->isShared())
+    return t_RC->bytes();
   return broadcastAccFunction<uint64_t>(pleaseGetCacheBytes);
 }
 
@@ -399,8 +507,12 @@ RecursorControlParser::RecursorControlParser()
   addGetStat("packetcache-misses", doGetPacketCacheMisses); 
   addGetStat("packetcache-entries", doGetPacketCacheSize); 
   addGetStat("packetcache-bytes", doGetPacketCacheBytes); 
+  addGetStat("cache-refreshes", &g_stats.cacheRefreshes);
+  addGetStat("stale-answers", &g_stats.staleAnswers);
   
   addGetStat("malloc-bytes", doGetMallocated);
+  addGetStat("arena-allocations", boost::bind(getArenaAllocations));
+  addGetStat("arena-heap-allocations", boost::bind(getArenaHeapAllocations));
   
   addGetStat("servfail-answers", &g_stats.servFails);
   addGetStat("nxdomain-answers", &g_stats.nxDomains);
@@ -431,8 +543,12 @@ RecursorControlParser::RecursorControlParser()
   addGetStat("no-packet-error", &g_stats.noPacketError);
   addGetStat("dlg-only-drops", &SyncRes::s_nodelegated);
   addGetStat("max-mthread-stack", &g_stats.maxMThreadStackUsage);
+  addGetStat("mthread-switches", boost::bind(getMThreadSwitches));
+  addGetStat("mthread-stacks", boost::bind(getMThreadStacks));
   
   addGetStat("negcache-entries", boost::bind(getNegCacheSize));
+  addGetStat("negcache-hits", &SyncRes::s_negcachehits);
+  addGetStat("negcache-parent-hits", &SyncRes::s_negcacheparenthits);
   addGetStat("throttle-entries", boost::bind(getThrottleSize)); 
 
   addGetStat("nsspeeds-entries", boost::bind(getNsSpeedsSize));
@@ -447,6 +563,9 @@ RecursorControlParser::RecursorControlParser()
   addGetStat("throttled-out", &SyncRes::s_throttledqueries);
   addGetStat("unreachables", &SyncRes::s_unreachables);
   addGetStat("chain-resends", &g_stats.chainResends);
+  addGetStat("outgoing-sockets-opened", &g_stats.outgoingSocketsOpened);
+  addGetStat("outgoing-sockets-closed", &g_stats.outgoingSocketsClosed);
+  addGetStat("outgoing-sockets-pooled", boost::bind(getPooledSockets));
   addGetStat("tcp-clients", boost::bind(TCPConnection::getCurrentConnections));
 
   addGetStat("edns-ping-matches", &g_stats.ednsPingMatches);
@@ -567,6 +686,9 @@ string RecursorControlParser::getAnswer(const string& question, RecursorControlP
   if(cmd=="dump-cache") 
     return doDumpCache(begin, end);
 
+  if(cmd=="save-cache") 
+    return doSaveCache(begin, end);
+
   if(cmd=="dump-ednsstatus" || cmd=="dump-edns") 
     return doDumpEDNSStatus(begin, end);
 
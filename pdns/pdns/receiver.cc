@@ -545,6 +545,7 @@ int main(int argc, char **argv)
     DynListener::registerFunc("REDISCOVER",&DLRediscoverHandler, "discover any new zones");
     DynListener::registerFunc("VERSION",&DLVersionHandler, "get instance version");
     DynListener::registerFunc("PURGE",&DLPurgeHandler, "purge entries from packet cache", "[<record>]");
+    DynListener::registerFunc("PURGE-SIGNATURES",&DLPurgeSignaturesHandler, "purge cached RRSIGs of zones, or all of them", "[<zone>]");
     DynListener::registerFunc("CCOUNTS",&DLCCHandler, "get cache statistics");
     DynListener::registerFunc("SET",&DLSettingsHandler, "set config variables", "<var> <value>");
     DynListener::registerFunc("RETRIEVE",&DLNotifyRetrieveHandler, "retrieve slave domain", "<domain>");
@@ -560,6 +561,15 @@ int main(int argc, char **argv)
     ::arg().parse(argc,argv);
     UeberBackend::go();
     N=new UDPNameserver; // this fails when we are not root, throws exception
+    if(::arg().mustDo("reuseport")) {
+      if(UDPNameserver::canReusePort()) {
+        g_udpReceivers.push_back(N);
+        for(int n=1; n < ::arg().asNum("receiver-threads"); ++n)
+          g_udpReceivers.push_back(new UDPNameserver(true));
+      }
+      else
+        L<<Logger::Warning<<"reuseport is set, but this platform lacks SO_REUSEPORT, receiver threads will share their UDP sockets"<<endl;
+    }
     
     if(!::arg().mustDo("disable-tcp"))
       TN=new TCPNameserver; 
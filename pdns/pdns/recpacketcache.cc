@@ -2,7 +2,9 @@
 #include <boost/foreach.hpp>
 #include "recpacketcache.hh"
 #include "cachecleaner.hh"
+#include "recsnapshot.hh"
 #include "dns.hh"
+#include "misc.hh"
 #include "namespaces.hh"
 #include "lock.hh"
 
@@ -12,26 +14,144 @@ RecursorPacketCache::RecursorPacketCache()
   d_hits = d_misses = 0;
 }
 
-bool RecursorPacketCache::getResponsePacket(const std::string& queryPacket, time_t now, 
-  std::string* responsePacket, uint32_t* age)
+/* Finds where the single question of packet ends, and the EDNS buffer size if the question is followed by
+   nothing but an OPT record. Returns false for anything we don't want to cache */
+static bool parseQuestion(const char* packet, unsigned int len, unsigned int* qend, uint16_t* ednsSize)
 {
-  struct Entry e;
-  e.d_packet=queryPacket;
-  
-  packetCache_t::const_iterator iter = d_packetCache.find(e);
+  if(len < sizeof(dnsheader))
+    return false;
+  dnsheader dh;
+  memcpy(&dh, packet, sizeof(dh));
+  if(ntohs(dh.qdcount) != 1)
+    return false;
+
+  unsigned int pos=sizeof(dnsheader);
+  unsigned char labellen;
+  while(pos < len && (labellen=packet[pos])) {
+    if(labellen & 0xc0)
+      return false;
+    pos+=labellen+1;
+  }
+  pos+=5; // trailing 0, qtype, qclass
+  if(pos > len)
+    return false;
+  *qend=pos;
+
+  *ednsSize=0;
+  if(ntohs(dh.arcount)==1 && !dh.ancount && !dh.nscount && pos + 5 <= len && !packet[pos] && 
+     packet[pos+1]==0 && packet[pos+2]==QType::OPT)
+    *ednsSize=(unsigned char)packet[pos+3]*256 + (unsigned char)packet[pos+4];
+  return true;
+}
+
+//! records the offsets of all TTLs in packet, up to the OPT record, returns false if the packet does not parse
+static bool getTTLOffsets(const string& packet, vector<uint16_t>& offsets)
+{
+  dnsheader dh;
+  memcpy(&dh, packet.c_str(), sizeof(dh));
+  unsigned int numrecords=ntohs(dh.ancount) + ntohs(dh.nscount) + ntohs(dh.arcount);
+  unsigned int pos=sizeof(dnsheader), len=packet.length();
+  const unsigned char* p=(const unsigned char*)packet.c_str();
+
+  offsets.clear();
+  for(unsigned int n=0; n < numrecords + ntohs(dh.qdcount); ++n) {
+    unsigned char labellen;
+    while(pos < len && (labellen=p[pos])) {
+      if(labellen >= 0xc0) {
+        pos++;
+        break;
+      }
+      pos+=labellen+1;
+    }
+    pos++;
+    if(n < ntohs(dh.qdcount)) {
+      pos+=4;
+      continue;
+    }
+    if(pos + 10 > len)
+      return false;
+    if(p[pos]*256 + p[pos+1] == QType::OPT) // not aging that one with a stick
+      break;
+    offsets.push_back(pos+4);
+    pos+=10 + p[pos+8]*256 + p[pos+9];
+  }
+  return pos <= len;
+}
+
+static uint32_t hashQuestion(const char* packet, unsigned int qend, uint16_t ednsSize)
+{
+  dnsheader dh;
+  memcpy(&dh, packet, sizeof(dh));
+  uint32_t typeclass;
+  memcpy(&typeclass, packet + qend - 4, 4); // qtype and qclass are compared exactly, only the qname ignores case
+  uint32_t ret=pdns_hashmix(pdns_ihash(packet + sizeof(dnsheader), qend - 4 - sizeof(dnsheader)), typeclass);
+  return pdns_hashmix(ret, dh.opcode | (dh.rd << 4) | (ednsSize << 16));
+}
+
+bool RecursorPacketCache::getQuestionHash(const char* queryPacket, unsigned int len, uint32_t* hash, uint16_t* ednsSize)
+{
+  unsigned int qend;
+  if(!parseQuestion(queryPacket, len, &qend, ednsSize))
+    return false;
+  *hash=hashQuestion(queryPacket, qend, *ednsSize);
+  return true;
+}
+
+//! finds the entry for the question that ends at qend in packet, or end()
+RecursorPacketCache::packetCache_t::iterator RecursorPacketCache::find(uint32_t hash, const char* packet, unsigned int qend,
+                                                                       uint8_t opcode, bool rd, uint16_t ednsSize)
+{
+  packetCache_t::iterator iter, end;
+  for(tie(iter, end)=d_packetCache.equal_range(hash); iter != end; ++iter) {
+    const char* stored=iter->d_packet.c_str();
+    if(iter->d_ednsSize != ednsSize || ((const dnsheader*)stored)->opcode != opcode || ((const dnsheader*)stored)->rd != rd || 
+       iter->d_packet.length() < qend)
+      continue;
+
+    unsigned int n;
+    for(n=sizeof(dnsheader); n < qend - 4; ++n)
+      if(dns_tolower(stored[n]) != dns_tolower(packet[n]))
+        break;
+    if(n == qend - 4 && !memcmp(stored + n, packet + n, 4))
+      return iter;
+  }
+  return d_packetCache.end();
+}
+
+/* On a hit, the stored response is copied to response, with the ID and question of queryPacket and the TTLs aged.
+   responseLen holds the size of response on input, a stored packet that does not fit is a miss. */
+bool RecursorPacketCache::getResponsePacket(uint32_t hash, const char* queryPacket, unsigned int queryLen, time_t now,
+                                            char* response, unsigned int* responseLen)
+{
+  unsigned int qend;
+  uint16_t ednsSize;
+  packetCache_t::iterator iter = d_packetCache.end();
+  if(parseQuestion(queryPacket, queryLen, &qend, &ednsSize)) {
+    const dnsheader* dh=(const dnsheader*)queryPacket;
+    iter = find(hash, queryPacket, qend, dh->opcode, dh->rd, ednsSize);
+  }
   
   if(iter == d_packetCache.end()) {
     d_misses++;
     return false;
   }
     
-  if((uint32_t)now < iter->d_ttd) { // it is fresh!
+  if((uint32_t)now < iter->d_ttd && iter->d_packet.length() <= *responseLen) { // it is fresh!
 //    cerr<<"Fresh for another "<<iter->d_ttd - now<<" seconds!"<<endl;
-    *age = now - iter->d_creation;
-    uint16_t id;
-    memcpy(&id, queryPacket.c_str(), 2); 
-    *responsePacket = iter->d_packet;
-    responsePacket->replace(0, 2, (char*)&id, 2);
+    uint32_t age = now - iter->d_creation;
+
+    *responseLen=iter->d_packet.length();
+    memcpy(response, iter->d_packet.c_str(), *responseLen);
+    memcpy(response, queryPacket, 2); // id
+    memcpy(response + sizeof(dnsheader), queryPacket + sizeof(dnsheader), qend - sizeof(dnsheader)); // keep the case of the question
+    if(age) {
+      for(vector<uint16_t>::const_iterator i=iter->d_ttlOffsets.begin(); i != iter->d_ttlOffsets.end(); ++i) {
+        uint32_t ttl;
+        memcpy(&ttl, response + *i, sizeof(ttl));
+        ttl=htonl(ntohl(ttl) - age);
+        memcpy(response + *i, &ttl, sizeof(ttl));
+      }
+    }
     d_hits++;
     moveCacheItemToBack(d_packetCache, iter);
 
@@ -42,17 +162,30 @@ bool RecursorPacketCache::getResponsePacket(const std::string& queryPacket, time
   return false;
 }
 
-void RecursorPacketCache::insertResponsePacket(const std::string& responsePacket, time_t now, uint32_t ttl)
+//! hash and ednsSize are those getQuestionHash() found for the question that responsePacket answers
+void RecursorPacketCache::insertResponsePacket(uint32_t hash, uint16_t ednsSize, const std::string& responsePacket, time_t now, uint32_t ttl)
 {
+  unsigned int qend;
+  uint16_t ignored;
+  if(!parseQuestion(responsePacket.c_str(), responsePacket.length(), &qend, &ignored))
+    return;
+
   struct Entry e;
+  e.d_hash = hash;
+  e.d_ednsSize = ednsSize;
   e.d_packet = responsePacket;
   e.d_ttd = now+ttl;
   e.d_creation = now;
-  packetCache_t::iterator iter = d_packetCache.find(e);
+  if(!getTTLOffsets(e.d_packet, e.d_ttlOffsets))
+    return;
+
+  const dnsheader* dh=(const dnsheader*)responsePacket.c_str();
+  packetCache_t::iterator iter = find(hash, responsePacket.c_str(), qend, dh->opcode, dh->rd, ednsSize);
   
   if(iter != d_packetCache.end()) {
-    iter->d_packet = responsePacket;
-    iter->d_ttd = now + ttl;
+    iter->d_packet.swap(e.d_packet);
+    iter->d_ttlOffsets.swap(e.d_ttlOffsets);
+    iter->d_ttd = e.d_ttd;
     iter->d_creation = now;
   }
   else 
@@ -68,7 +201,7 @@ uint64_t RecursorPacketCache::bytes()
 {
   uint64_t sum=0;
   BOOST_FOREACH(const struct Entry& e, d_packetCache) {
-    sum += sizeof(e) + e.d_packet.length() + 4;
+    sum += sizeof(e) + e.d_packet.length() + 2*e.d_ttlOffsets.size() + 4;
   }
   return sum;
 }
@@ -79,3 +212,37 @@ void RecursorPacketCache::doPruneTo(unsigned int maxCached)
   pruneCollection(d_packetCache, maxCached);
 }
 
+uint64_t RecursorPacketCache::saveSnapshot(SnapshotWriter& sw, uint32_t thread)
+{
+  typedef packetCache_t::nth_index<1>::type sequence_t;
+  sequence_t& sidx=d_packetCache.get<1>();
+
+  sw.startSection(SnapshotPacketCache, thread, sidx.size());
+  for(sequence_t::const_iterator i=sidx.begin(); i != sidx.end(); ++i) {
+    sw.put32(i->d_hash);
+    sw.put16(i->d_ednsSize);
+    sw.put32(i->d_ttd);
+    sw.put32(i->d_creation);
+    sw.putString(i->d_packet);
+  }
+  return sidx.size();
+}
+
+//! reads count entries as written by saveSnapshot(), leaving out those that expired in the meantime
+uint64_t RecursorPacketCache::loadSnapshot(SnapshotReader& sr, uint32_t count, time_t now)
+{
+  uint64_t loaded=0;
+  struct Entry e;
+  for(uint32_t n=0; n < count; ++n) {
+    e.d_hash=sr.get32();
+    e.d_ednsSize=sr.get16();
+    e.d_ttd=sr.get32();
+    e.d_creation=sr.get32();
+    sr.getString(e.d_packet);
+    if(e.d_ttd <= (uint32_t)now || e.d_packet.length() < sizeof(dnsheader) || !getTTLOffsets(e.d_packet, e.d_ttlOffsets))
+      continue;
+    d_packetCache.insert(e);
+    loaded++;
+  }
+  return loaded;
+}
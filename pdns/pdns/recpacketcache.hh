@@ -1,27 +1,39 @@
 #ifndef PDNS_RECPACKETCACHE_HH
 #define PDNS_RECPACKETCACHE_HH
 #include <string>
-#include <set>
+#include <vector>
 #include <inttypes.h>
 #include "dns.hh"
 #include "namespaces.hh"
 #include <iostream>
 #include <boost/multi_index_container.hpp>
-#include <boost/multi_index/ordered_index.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/member.hpp>
 #include <boost/multi_index/sequenced_index.hpp>
 
 
 using namespace ::boost::multi_index;
 
-//! Stores whole packets, ready for lobbing back at the client. Not threadsafe.
+class SnapshotWriter;
+class SnapshotReader;
+
+/* Stores whole packets, ready for lobbing back at the client. Not threadsafe.
+
+   Packets are found by a hash of everything in a question that influences the answer: the case insensitive qname,
+   qtype, qclass, opcode, RD bit and EDNS buffer size. getQuestionHash() calculates that once per incoming packet,
+   and also tells if the question can be cached at all. Hits are copied straight into the caller's buffer with 
+   only the ID, the case of the question and the TTLs patched up. */
 class RecursorPacketCache
 {
 public:
   RecursorPacketCache();
-  bool getResponsePacket(const std::string& queryPacket, time_t now, std::string* responsePacket, uint32_t* age);
-  void insertResponsePacket(const std::string& responsePacket, time_t now, uint32_t ttd);
+  static bool getQuestionHash(const char* queryPacket, unsigned int len, uint32_t* hash, uint16_t* ednsSize);
+  bool getResponsePacket(uint32_t hash, const char* queryPacket, unsigned int queryLen, time_t now, 
+                         char* response, unsigned int* responseLen);
+  void insertResponsePacket(uint32_t hash, uint16_t ednsSize, const std::string& responsePacket, time_t now, uint32_t ttl);
   void doPruneTo(unsigned int maxSize=250000);
+  uint64_t saveSnapshot(SnapshotWriter& sw, uint32_t thread);
+  uint64_t loadSnapshot(SnapshotReader& sr, uint32_t count, time_t now);
   
   void prune();
   uint64_t d_hits, d_misses;
@@ -32,11 +44,12 @@ private:
 
   struct Entry 
   {
+    uint32_t d_hash;
+    uint16_t d_ednsSize;
     mutable uint32_t d_ttd;
     mutable uint32_t d_creation;
     mutable std::string d_packet; // "I know what I am doing"
-
-    inline bool operator<(const struct Entry& rhs) const;
+    mutable std::vector<uint16_t> d_ttlOffsets; // where the TTLs are in d_packet, so we can age it without parsing
     
     uint32_t getTTD() const
     {
@@ -47,27 +60,13 @@ private:
   typedef multi_index_container<
     Entry,
     indexed_by  <
-                  ordered_unique<identity<Entry> >, 
+                  hashed_non_unique<member<Entry,uint32_t,&Entry::d_hash> >, 
                   sequenced<> 
                >
   > packetCache_t;
   
-   packetCache_t d_packetCache;
+  packetCache_t::iterator find(uint32_t hash, const char* packet, unsigned int qend, uint8_t opcode, bool rd, uint16_t ednsSize);
+  packetCache_t d_packetCache;
 };
 
-// needs to take into account: qname, qtype, opcode, rd, qdcount, EDNS size
-inline bool RecursorPacketCache::Entry::operator<(const struct RecursorPacketCache::Entry &rhs) const
-{
-  const struct dnsheader* 
-    dh=(const struct dnsheader*) d_packet.c_str(), 
-    *rhsdh=(const struct dnsheader*)rhs.d_packet.c_str();
-  if(make_tuple(dh->opcode, dh->rd, dh->qdcount) < 
-     make_tuple(rhsdh->opcode, rhsdh->rd, rhsdh->qdcount))
-    return true;
-
-  return dnspacketLessThan(d_packet, rhs.d_packet);
-}
-
-
-
 #endif
@@ -0,0 +1,199 @@
+#include "recsnapshot.hh"
+#include "syncres.hh"
+#include "recursor_cache.hh"
+#include "recpacketcache.hh"
+#include <boost/foreach.hpp>
+
+static const char s_snapshotMagic[]="PDNSSNAP";
+static const uint32_t s_snapshotVersion=1;
+static const uint32_t s_sharedThread=0xffffffff; //!< marks the sections of a shared cache
+
+void writeSnapshotHeader(SnapshotWriter& sw)
+{
+  for(const char* p=s_snapshotMagic; *p; ++p)
+    sw.put8(*p);
+  sw.put32(s_snapshotVersion);
+  sw.put32(time(0));
+}
+
+//! one section per shard, empty shards are skipped
+static uint64_t saveNegCache(SnapshotWriter& sw, SyncRes::NegCache& negcache, uint32_t thread)
+{
+  typedef SyncRes::negcache_t::nth_index<1>::type sequence_t;
+
+  uint64_t count=0;
+  for(unsigned int n=0; n < negcache.numShards(); ++n) {
+    SyncRes::NegCache::ShardLock l(negcache, negcache.getShard(n));
+    sequence_t& sidx=negcache.getShard(n).d_cache.get<1>();
+    if(sidx.empty())
+      continue;
+    sw.startSection(SnapshotNegCache, thread, sidx.size());
+    BOOST_FOREACH(const NegCacheEntry& ne, sidx) {
+      sw.putString(ne.d_name);
+      sw.put16(ne.d_qtype.getCode());
+      sw.putString(ne.d_qname);
+      sw.put32(ne.d_ttd);
+    }
+    count+=sidx.size();
+  }
+  return count;
+}
+
+static uint64_t loadNegCache(SnapshotReader& sr, uint32_t count, time_t now, SyncRes::NegCache& negcache)
+{
+  uint64_t loaded=0;
+  NegCacheEntry ne;
+  for(uint32_t n=0; n < count; ++n) {
+    sr.getString(ne.d_name);
+    ne.d_qtype=sr.get16();
+    sr.getString(ne.d_qname);
+    ne.d_ttd=sr.get32();
+    if(ne.d_ttd <= (uint32_t)now)
+      continue;
+    negcache.add(ne, now);
+    loaded++;
+  }
+  return loaded;
+}
+
+//! one section per shard, empty shards are skipped
+static uint64_t saveNSSpeeds(SnapshotWriter& sw, SyncRes::InfraCache& infra, uint32_t thread)
+{
+  uint64_t count=0;
+  for(unsigned int n=0; n < infra.numShards(); ++n) {
+    SyncRes::InfraCache::ShardLock l(infra, infra.getShard(n));
+    const SyncRes::nsspeeds_t& nsSpeeds=infra.getShard(n).nsSpeeds;
+    if(nsSpeeds.empty())
+      continue;
+    sw.startSection(SnapshotNSSpeeds, thread, nsSpeeds.size());
+    for(SyncRes::nsspeeds_t::const_iterator i=nsSpeeds.begin(); i != nsSpeeds.end(); ++i) {
+      sw.putString(i->first);
+      sw.put16(i->second.d_collection.size());
+      for(SyncRes::DecayingEwmaCollection::collection_t::const_iterator j=i->second.d_collection.begin(); j != i->second.d_collection.end(); ++j) {
+        sw.putString(string((const char*)&j->first, sizeof(j->first)));
+        float val=j->second.peek();
+        uint32_t raw;
+        memcpy(&raw, &val, sizeof(raw));
+        sw.put32(raw);
+      }
+    }
+    count+=nsSpeeds.size();
+  }
+  return count;
+}
+
+//! speeds are restored as if they were measured just now, they decay from there on
+static uint64_t loadNSSpeeds(SnapshotReader& sr, uint32_t count, const struct timeval& now, SyncRes::InfraCache& infra)
+{
+  string name, addr;
+  for(uint32_t n=0; n < count; ++n) {
+    sr.getString(name);
+    SyncRes::DecayingEwmaCollection dec;
+    uint16_t numaddrs=sr.get16();
+    for(uint16_t a=0; a < numaddrs; ++a) {
+      sr.getString(addr);
+      uint32_t raw=sr.get32();
+      if(addr.length() != sizeof(ComboAddress))
+        throw AhuException("Cache snapshot holds an address of the wrong size");
+      ComboAddress remote;
+      memcpy(&remote, addr.c_str(), sizeof(remote));
+      float val;
+      memcpy(&val, &raw, sizeof(val));
+      DecayingEwma de;
+      de.restore(val, now);
+      dec.d_collection.push_back(make_pair(remote, de));
+    }
+    infra.setSpeeds(name, dec);
+  }
+  return count;
+}
+
+//! writes the caches of the calling thread, and the shared ones if we are thread 0
+uint64_t writeThreadSnapshot(SnapshotWriter& sw)
+{
+  uint64_t count=0;
+  if(!t_RC->isShared())
+    count+=t_RC->saveSnapshot(sw, t_id);
+  else if(!t_id)
+    count+=t_RC->saveSnapshot(sw, s_sharedThread);
+
+  if(!t_sstorage->negcache->isShared())
+    count+=saveNegCache(sw, *t_sstorage->negcache, t_id);
+  else if(!t_id)
+    count+=saveNegCache(sw, *t_sstorage->negcache, s_sharedThread);
+  if(!t_sstorage->infra->isShared())
+    count+=saveNSSpeeds(sw, *t_sstorage->infra, t_id);
+  else if(!t_id)
+    count+=saveNSSpeeds(sw, *t_sstorage->infra, s_sharedThread);
+  count+=t_packetCache->saveSnapshot(sw, t_id);
+  sw.endSection();
+  return count;
+}
+
+static void readSnapshotHeader(SnapshotReader& sr, time_t* written)
+{
+  for(const char* p=s_snapshotMagic; *p; ++p)
+    if(sr.get8() != (uint8_t)*p)
+      throw AhuException("Not a cache snapshot");
+  uint32_t version=sr.get32();
+  if(version != s_snapshotVersion)
+    throw AhuException("Cache snapshot has unsupported version "+lexical_cast<string>(version));
+  *written=sr.get32();
+}
+
+//! verifies the header and the layout of all sections, returns when the snapshot was written
+time_t checkSnapshot(const string& snapshot)
+{
+  SnapshotReader sr(snapshot.c_str(), snapshot.length());
+  time_t written;
+  readSnapshotHeader(sr, &written);
+  while(!sr.done()) {
+    uint8_t kind=sr.get8();
+    if(kind < SnapshotRecordCache || kind > SnapshotPacketCache)
+      throw AhuException("Cache snapshot holds a section of unknown kind "+lexical_cast<string>((int)kind));
+    sr.get32(); // thread
+    sr.get32(); // count
+    sr.getSection(sr.get32());
+  }
+  return written;
+}
+
+/** loads the sections of a snapshot that are meant for the calling thread. Threads are matched by number modulo
+    the current number of threads, so a snapshot can be loaded with a different 'threads' setting. Sections of a
+    shared cache are loaded by thread 0 only */
+uint64_t loadThreadSnapshot(const string& snapshot)
+{
+  SnapshotReader sr(snapshot.c_str(), snapshot.length());
+  time_t written;
+  readSnapshotHeader(sr, &written);
+
+  struct timeval now;
+  Utility::gettimeofday(&now, 0);
+
+  uint64_t loaded=0;
+  while(!sr.done()) {
+    uint8_t kind=sr.get8();
+    uint32_t thread=sr.get32();
+    uint32_t count=sr.get32();
+    SnapshotReader section=sr.getSection(sr.get32());
+
+    if((thread == s_sharedThread ? 0 : thread) % g_numThreads != t_id)
+      continue;
+
+    switch(kind) {
+    case SnapshotRecordCache:
+      loaded+=t_RC->loadSnapshot(section, count, now.tv_sec);
+      break;
+    case SnapshotNegCache:
+      loaded+=loadNegCache(section, count, now.tv_sec, *t_sstorage->negcache);
+      break;
+    case SnapshotNSSpeeds:
+      loaded+=loadNSSpeeds(section, count, now, *t_sstorage->infra);
+      break;
+    case SnapshotPacketCache:
+      loaded+=t_packetCache->loadSnapshot(section, count, now.tv_sec);
+      break;
+    }
+  }
+  return loaded;
+}
@@ -0,0 +1,136 @@
+#ifndef PDNS_RECSNAPSHOT_HH
+#define PDNS_RECSNAPSHOT_HH
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "ahuexception.hh"
+#include "namespaces.hh"
+
+/* A cache snapshot, as written by 'rec_control save-cache' and loaded at startup with 'load-cache'.
+
+   It starts with a header of 8 bytes magic, an uint32_t format version and the uint32_t time it was written.
+   Sections follow, each holding (part of) one cache of one thread: an uint8_t SnapshotKind, the uint32_t
+   thread number, the uint32_t number of entries and the uint32_t length in bytes of the entries, then the 
+   entries themselves. The length allows a thread to skip over the sections that are meant for others.
+
+   Integers are written in host byte order, so a snapshot can only be loaded on the architecture that wrote it.
+   Expiry times are absolute, whatever expired while we were down is dropped on load and the rest keeps its
+   original expiry. */
+
+enum SnapshotKind { SnapshotRecordCache=1, SnapshotNegCache=2, SnapshotNSSpeeds=3, SnapshotPacketCache=4 };
+
+class SnapshotWriter
+{
+public:
+  explicit SnapshotWriter(FILE* fp) : d_fp(fp), d_sectionStart(-1)
+  {}
+
+  void put8(uint8_t val)
+  {
+    putc(val, d_fp);
+  }
+  void put16(uint16_t val)
+  {
+    fwrite(&val, sizeof(val), 1, d_fp);
+  }
+  void put32(uint32_t val)
+  {
+    fwrite(&val, sizeof(val), 1, d_fp);
+  }
+  //! strings of up to 65535 bytes, prefixed with their length
+  void putString(const string& str)
+  {
+    put16(str.length());
+    fwrite(str.c_str(), 1, str.length(), d_fp);
+  }
+  void startSection(SnapshotKind kind, uint32_t thread, uint32_t count)
+  {
+    endSection();
+    put8(kind);
+    put32(thread);
+    put32(count);
+    d_sectionStart=ftell(d_fp);
+    put32(0); // length, filled out by endSection()
+  }
+  //! fills out the length of the current section, if any. Also called by startSection()
+  void endSection()
+  {
+    if(d_sectionStart < 0)
+      return;
+    long end=ftell(d_fp);
+    uint32_t len=end - d_sectionStart - sizeof(uint32_t);
+    fseek(d_fp, d_sectionStart, SEEK_SET);
+    put32(len);
+    fseek(d_fp, end, SEEK_SET);
+    d_sectionStart=-1;
+  }
+
+private:
+  FILE* d_fp;
+  long d_sectionStart;
+};
+
+class SnapshotReader
+{
+public:
+  SnapshotReader(const char* data, size_t len) : d_pos(data), d_end(data + len)
+  {}
+
+  bool done() const
+  {
+    return d_pos == d_end;
+  }
+  uint8_t get8()
+  {
+    need(1);
+    return *d_pos++;
+  }
+  uint16_t get16()
+  {
+    uint16_t ret;
+    need(sizeof(ret));
+    memcpy(&ret, d_pos, sizeof(ret));
+    d_pos+=sizeof(ret);
+    return ret;
+  }
+  uint32_t get32()
+  {
+    uint32_t ret;
+    need(sizeof(ret));
+    memcpy(&ret, d_pos, sizeof(ret));
+    d_pos+=sizeof(ret);
+    return ret;
+  }
+  void getString(string& str)
+  {
+    uint16_t len=get16();
+    need(len);
+    str.assign(d_pos, len);
+    d_pos+=len;
+  }
+  //! returns a reader for the next len bytes, and skips over them
+  SnapshotReader getSection(uint32_t len)
+  {
+    need(len);
+    SnapshotReader ret(d_pos, len);
+    d_pos+=len;
+    return ret;
+  }
+
+private:
+  void need(size_t bytes)
+  {
+    if((size_t)(d_end - d_pos) < bytes)
+      throw AhuException("Cache snapshot is truncated");
+  }
+  const char* d_pos;
+  const char* d_end;
+};
+
+void writeSnapshotHeader(SnapshotWriter& sw);
+uint64_t writeThreadSnapshot(SnapshotWriter& sw);
+time_t checkSnapshot(const string& snapshot);
+uint64_t loadThreadSnapshot(const string& snapshot);
+
+#endif
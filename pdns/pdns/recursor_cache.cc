@@ -7,6 +7,7 @@
 #include "syncres.hh"
 #include "recursor_cache.hh"
 #include "cachecleaner.hh"
+#include "recsnapshot.hh"
 
 #include "namespaces.hh"
 #include "namespaces.hh"
@@ -86,33 +87,71 @@ string DNSRR2String(const DNSResourceRecord& rr)
   }
 }
 
+MemRecursorCache::MemRecursorCache() : d_followRFC2181(false), d_locked(false), d_cachecachevalid(false)
+{
+  cacheHits = cacheMisses = 0;
+  d_shards.push_back(shared_ptr<Shard>(new Shard));
+}
+
+MemRecursorCache::MemRecursorCache(unsigned int shards) : d_followRFC2181(false), d_locked(true), d_cachecachevalid(false)
+{
+  cacheHits = cacheMisses = 0;
+  for(unsigned int n=0; n < max(shards, 1U); ++n)
+    d_shards.push_back(shared_ptr<Shard>(new Shard));
+}
+
+//! a new handle on our records, for use by another thread
+MemRecursorCache* MemRecursorCache::share() const
+{
+  MemRecursorCache* ret=new MemRecursorCache;
+  ret->d_shards=d_shards;
+  ret->d_locked=true;
+  return ret;
+}
+
 unsigned int MemRecursorCache::size()
 {
-  return (unsigned int)d_cache.size();
+  unsigned int ret=0;
+  for(vector<shared_ptr<Shard> >::const_iterator i=d_shards.begin(); i!=d_shards.end(); ++i) {
+    ShardLock l(*this, **i);
+    ret+=(unsigned int)(*i)->d_cache.size();
+  }
+  return ret;
 }
 
 unsigned int MemRecursorCache::bytes()
 {
   unsigned int ret=0;
 
-  for(cache_t::const_iterator i=d_cache.begin(); i!=d_cache.end(); ++i) {
-    ret+=sizeof(struct CacheEntry);
-    ret+=(unsigned int)i->d_qname.length();
-    for(vector<StoredRecord>::const_iterator j=i->d_records.begin(); j!= i->d_records.end(); ++j)
-      ret+=j->size();
+  for(vector<shared_ptr<Shard> >::const_iterator s=d_shards.begin(); s!=d_shards.end(); ++s) {
+    ShardLock l(*this, **s);
+    for(cache_t::const_iterator i=(*s)->d_cache.begin(); i!=(*s)->d_cache.end(); ++i) {
+      ret+=sizeof(struct CacheEntry);
+      ret+=(unsigned int)i->d_qname.length();
+      for(vector<StoredRecord>::const_iterator j=i->d_records.begin(); j!= i->d_records.end(); ++j)
+        ret+=j->size();
+    }
   }
   return ret;
 }
 
-int MemRecursorCache::get(time_t now, const string &qname, const QType& qt, set<DNSResourceRecord>* res)
+unsigned int MemRecursorCache::s_serveStale;
+
+//! origTTL, if passed, is set to the TTL the (last) matching RRset had when it was stored
+int MemRecursorCache::get(time_t now, const string &qname, const QType& qt, set<DNSResourceRecord>* res, uint32_t* origTTL)
 {
   unsigned int ttd=0;
   //  cerr<<"looking up "<< qname+"|"+qt.getName()<<"\n";
+  Shard& shard=getShard(qname);
+  cache_t& cache=shard.d_cache;
+  ShardLock l(*this, shard);
 
-  if(!d_cachecachevalid || !pdns_iequals(d_cachedqname, qname)) {
+  if(d_locked)
+    d_cachecache=cache.equal_range(tie(qname));
+  else if(!d_cachecachevalid || !pdns_iequals(d_cachedqname, qname)) {
     //    cerr<<"had cache cache miss"<<endl;
     d_cachedqname=qname;
-    d_cachecache=d_cache.equal_range(tie(qname));
+    d_cachecache=cache.equal_range(tie(qname));
     d_cachecachevalid=true;
   }
   else
@@ -127,6 +166,8 @@ int MemRecursorCache::get(time_t now, const string &qname, const QType& qt, set<
       if(i->d_qtype == qt.getCode() || qt.getCode()==QType::ANY || 
          (qt.getCode()==QType::ADDR && (i->d_qtype == QType::A || i->d_qtype == QType::AAAA) )
          ) {     
+        if(origTTL)
+          *origTTL=i->d_stored ? i->getEarliestTTD() - i->d_stored : 0;
         for(vector<StoredRecord>::const_iterator k=i->d_records.begin(); k != i->d_records.end(); ++k) {
           if(k->d_ttd < 1000000000 || k->d_ttd > (uint32_t) now) {  // FIXME what does the 100000000 number mean?
             ttd=k->d_ttd;
@@ -138,9 +179,9 @@ int MemRecursorCache::get(time_t now, const string &qname, const QType& qt, set<
         }
         if(res) {
           if(res->empty())
-            moveCacheItemToFront(d_cache, i);
+            moveCacheItemToFront(cache, i);
           else
-            moveCacheItemToBack(d_cache, i);
+            moveCacheItemToBack(cache, i);
         }
         if(qt.getCode()!=QType::ANY && qt.getCode()!=QType::ADDR) // normally if we have a hit, we are done
           break;
@@ -152,6 +193,50 @@ int MemRecursorCache::get(time_t now, const string &qname, const QType& qt, set<
   return -1;
 }
 
+/* Hands out the stored rdata of qname|qt without turning it into zone format first, so it can be copied straight
+   into an answer. Only succeeds if every record of the RRset is still valid and qname has no live CNAME that should
+   have been followed instead. Beware that the rdata of NS, CNAME, PTR, MX and SOA records may hold compression 
+   pointers relative to qname, see DNSRR2String() */
+int MemRecursorCache::getWire(time_t now, const string& qname, const QType& qt, vector<WireRecord>* res, uint32_t* origTTL)
+{
+  Shard& shard=getShard(qname);
+  cache_t& cache=shard.d_cache;
+  ShardLock l(*this, shard);
+
+  res->clear();
+  pair<cache_t::iterator, cache_t::iterator> range=cache.equal_range(tie(qname));
+  cache_t::iterator found=cache.end();
+
+  for(cache_t::iterator i=range.first; i != range.second; ++i) {
+    if(i->d_qtype == qt.getCode())
+      found=i;
+    else if(i->d_qtype == QType::CNAME) 
+      for(vector<StoredRecord>::const_iterator k=i->d_records.begin(); k != i->d_records.end(); ++k)
+        if(k->d_ttd > (uint32_t) now)
+          return -1;
+  }
+
+  if(found == cache.end() || found->d_records.empty())
+    return -1;
+
+  uint32_t ttd=std::numeric_limits<uint32_t>::max();
+  for(vector<StoredRecord>::const_iterator k=found->d_records.begin(); k != found->d_records.end(); ++k) {
+    if(k->d_ttd <= (uint32_t) now) {
+      res->clear();
+      return -1;
+    }
+    WireRecord wr;
+    wr.d_ttd=k->d_ttd;
+    wr.d_rdata=k->d_string;
+    res->push_back(wr);
+    ttd=min(ttd, k->d_ttd);
+  }
+  if(origTTL)
+    *origTTL=found->d_stored ? ttd - found->d_stored : 0;
+  moveCacheItemToBack(cache, found);
+  return (int)ttd-now;
+}
+
 
  
 bool MemRecursorCache::attemptToRefreshNSTTL(const QType& qt, const set<DNSResourceRecord>& content, const CacheEntry& stored)
@@ -188,12 +273,15 @@ bool MemRecursorCache::attemptToRefreshNSTTL(const QType& qt, const set<DNSResou
 void MemRecursorCache::replace(time_t now, const string &qname, const QType& qt,  const set<DNSResourceRecord>& content, bool auth)
 {
   d_cachecachevalid=false;
+  Shard& shard=getShard(qname);
+  cache_t& cache=shard.d_cache;
+  ShardLock l(*this, shard);
   tuple<string, uint16_t> key=make_tuple(qname, qt.getCode());
-  cache_t::iterator stored=d_cache.find(key);
+  cache_t::iterator stored=cache.find(key);
 
   bool isNew=false;
-  if(stored == d_cache.end()) {
-    stored=d_cache.insert(CacheEntry(key,vector<StoredRecord>(), auth)).first;
+  if(stored == cache.end()) {
+    stored=cache.insert(CacheEntry(key,vector<StoredRecord>(), auth)).first;
     isNew=true;
   }
   pair<vector<StoredRecord>::iterator, vector<StoredRecord>::iterator> range;
@@ -276,33 +364,105 @@ void MemRecursorCache::replace(time_t now, const string &qname, const QType& qt,
   if(ce.d_records.capacity() != ce.d_records.size())
     vector<StoredRecord>(ce.d_records).swap(ce.d_records);
   
-  d_cache.replace(stored, ce);
+  ce.d_stored=now;
+  cache.replace(stored, ce);
+}
+
+//! writes a snapshot section per shard, with the entries in least recently used order
+uint64_t MemRecursorCache::saveSnapshot(SnapshotWriter& sw, uint32_t thread)
+{
+  typedef cache_t::nth_index<1>::type sequence_t;
+
+  uint64_t count=0;
+  for(vector<shared_ptr<Shard> >::const_iterator s=d_shards.begin(); s!=d_shards.end(); ++s) {
+    ShardLock l(*this, **s);
+    sequence_t& sidx=(*s)->d_cache.get<1>();
+    sw.startSection(SnapshotRecordCache, thread, sidx.size());
+    for(sequence_t::const_iterator i=sidx.begin(); i != sidx.end(); ++i) {
+      sw.putString(i->d_qname);
+      sw.put16(i->d_qtype);
+      sw.put8(i->d_auth);
+      sw.put32(i->d_stored);
+      sw.put16(i->d_records.size());
+      for(vector<StoredRecord>::const_iterator j=i->d_records.begin(); j != i->d_records.end(); ++j) {
+        sw.put32(j->d_ttd);
+        sw.putString(j->d_string);
+      }
+    }
+    count+=sidx.size();
+  }
+  return count;
+}
+
+//! reads count entries as written by saveSnapshot(), leaving out records that expired in the meantime
+uint64_t MemRecursorCache::loadSnapshot(SnapshotReader& sr, uint32_t count, time_t now)
+{
+  d_cachecachevalid=false;
+
+  uint64_t loaded=0;
+  string qname;
+  StoredRecord dr;
+  for(uint32_t n=0; n < count; ++n) {
+    sr.getString(qname);
+    uint16_t qtype=sr.get16();
+    bool auth=sr.get8();
+    uint32_t stored=sr.get32();
+    uint16_t numrecords=sr.get16();
+
+    vector<StoredRecord> records;
+    records.reserve(numrecords);
+    for(uint16_t r=0; r < numrecords; ++r) {
+      dr.d_ttd=sr.get32();
+      sr.getString(dr.d_string);
+      if(dr.d_ttd + s_serveStale > (uint32_t)now)
+        records.push_back(dr);
+    }
+    if(records.empty())
+      continue;
+
+    CacheEntry ce(make_tuple(qname, qtype), records, auth);
+    ce.d_stored=stored;
+
+    Shard& shard=getShard(qname);
+    ShardLock l(*this, shard);
+    pair<cache_t::iterator, bool> res=shard.d_cache.insert(ce);
+    if(!res.second)
+      shard.d_cache.replace(res.first, ce);
+    loaded++;
+  }
+  return loaded;
 }
 
 int MemRecursorCache::doWipeCache(const string& name, uint16_t qtype)
 {
   int count=0;
   d_cachecachevalid=false;
+  Shard& shard=getShard(name);
+  cache_t& cache=shard.d_cache;
+  ShardLock l(*this, shard);
   pair<cache_t::iterator, cache_t::iterator> range;
   if(qtype==0xffff)
-    range=d_cache.equal_range(tie(name));
+    range=cache.equal_range(tie(name));
   else
-    range=d_cache.equal_range(tie(name, qtype));
+    range=cache.equal_range(tie(name, qtype));
 
   for(cache_t::const_iterator i=range.first; i != range.second; ) {
     count++;
-    d_cache.erase(i++);
+    cache.erase(i++);
   }
   return count;
 }
 
 bool MemRecursorCache::doAgeCache(time_t now, const string& name, uint16_t qtype, int32_t newTTL)
 {
-  cache_t::iterator iter = d_cache.find(tie(name, qtype));
-  if(iter == d_cache.end()) 
+  Shard& shard=getShard(name);
+  cache_t& cache=shard.d_cache;
+  ShardLock l(*this, shard);
+  cache_t::iterator iter = cache.find(tie(name, qtype));
+  if(iter == cache.end()) 
     return false;
 
-  int32_t ttl = iter->getTTD() - now;
+  int32_t ttl = iter->getEarliestTTD() - now;
   if(ttl < 0) 
     return false;  // would be dead anyhow
 
@@ -317,7 +477,7 @@ bool MemRecursorCache::doAgeCache(time_t now, const string& name, uint16_t qtype
       j->d_ttd = newTTD;
     }
     
-    d_cache.replace(iter, ce);
+    cache.replace(iter, ce);
     return true;
   }
   return false;
@@ -330,21 +490,24 @@ uint64_t MemRecursorCache::doDump(int fd)
   if(!fp) { // dup probably failed
     return 0;
   }
-  fprintf(fp, "; main record cache dump from thread follows\n;\n");
+  fprintf(fp, d_locked ? "; main record cache dump follows\n;\n" : "; main record cache dump from thread follows\n;\n");
   typedef cache_t::nth_index<1>::type sequence_t;
-  sequence_t& sidx=d_cache.get<1>();
 
   uint64_t count=0;
   time_t now=time(0);
-  for(sequence_t::const_iterator i=sidx.begin(); i != sidx.end(); ++i) {
-    for(vector<StoredRecord>::const_iterator j=i->d_records.begin(); j != i->d_records.end(); ++j) {
-      count++;
-      try {
-        DNSResourceRecord rr=String2DNSRR(i->d_qname, QType(i->d_qtype), j->d_string, j->d_ttd - now);
-        fprintf(fp, "%s %d IN %s %s\n", rr.qname.c_str(), rr.ttl, rr.qtype.getName().c_str(), rr.content.c_str());
-      }
-      catch(...) {
-        fprintf(fp, "; error printing '%s'\n", i->d_qname.c_str());
+  for(vector<shared_ptr<Shard> >::const_iterator s=d_shards.begin(); s!=d_shards.end(); ++s) {
+    ShardLock l(*this, **s);
+    sequence_t& sidx=(*s)->d_cache.get<1>();
+    for(sequence_t::const_iterator i=sidx.begin(); i != sidx.end(); ++i) {
+      for(vector<StoredRecord>::const_iterator j=i->d_records.begin(); j != i->d_records.end(); ++j) {
+        count++;
+        try {
+          DNSResourceRecord rr=String2DNSRR(i->d_qname, QType(i->d_qtype), j->d_string, j->d_ttd - now);
+          fprintf(fp, "%s %d IN %s %s\n", rr.qname.c_str(), rr.ttl, rr.qtype.getName().c_str(), rr.content.c_str());
+        }
+        catch(...) {
+          fprintf(fp, "; error printing '%s'\n", i->d_qname.c_str());
+        }
       }
     }
   }
@@ -356,7 +519,11 @@ void MemRecursorCache::doPrune(void)
 {
   d_cachecachevalid=false;
 
-  unsigned int maxCached=::arg().asNum("max-cache-entries") / g_numThreads;
-  pruneCollection(d_cache, maxCached);
+  // a shared cache gets all of max-cache-entries, a private one its thread's share
+  unsigned int maxCached=::arg().asNum("max-cache-entries") / (d_locked ? 1 : g_numThreads) / d_shards.size();
+  for(vector<shared_ptr<Shard> >::const_iterator s=d_shards.begin(); s!=d_shards.end(); ++s) {
+    ShardLock l(*this, **s);
+    pruneCollection((*s)->d_cache, maxCached);
+  }
 }
 
@@ -2,12 +2,14 @@
 #define RECURSOR_CACHE_HH
 #include <string>
 #include <set>
+#include <vector>
 #include "dns.hh"
 #include "qtype.hh"
 #include "misc.hh"
 #include <iostream>
 
 #include <boost/utility.hpp>
+#include <pthread.h>
 #undef L
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
@@ -22,26 +24,47 @@
 #include "namespaces.hh"
 using namespace ::boost::multi_index;
 
+class SnapshotWriter;
+class SnapshotReader;
+
+/* Normally every thread has a cache of its own. A cache made with a number of shards however can be share()d 
+   between threads: all handles see the same records, which are striped over the shards by qname, each with 
+   its own lock. Hit and miss counters and settings stay per handle */
 class MemRecursorCache : public boost::noncopyable //  : public RecursorCache
 {
 public:
-  MemRecursorCache() : d_followRFC2181(false), d_cachecachevalid(false)
+  MemRecursorCache();
+  explicit MemRecursorCache(unsigned int shards);
+  MemRecursorCache* share() const;
+  bool isShared() const
   {
-    cacheHits = cacheMisses = 0;
+    return d_locked;
   }
+
   unsigned int size();
   unsigned int bytes();
-  int get(time_t, const string &qname, const QType& qt, set<DNSResourceRecord>* res);
+  int get(time_t, const string &qname, const QType& qt, set<DNSResourceRecord>* res, uint32_t* origTTL=0);
+
+
+  //! a cached record in the form it goes out on the wire, as handed out by getWire()
+  struct WireRecord
+  {
+    uint32_t d_ttd;
+    string d_rdata;
+  };
+  int getWire(time_t now, const string& qname, const QType& qt, vector<WireRecord>* res, uint32_t* origTTL=0);
 
-  int getDirect(time_t now, const char* qname, const QType& qt, uint32_t ttd[10], char* data[10], uint16_t len[10]);
   void replace(time_t, const string &qname, const QType& qt,  const set<DNSResourceRecord>& content, bool auth);
   void doPrune(void);
   void doSlash(int perc);
   uint64_t doDump(int fd);
+  uint64_t saveSnapshot(SnapshotWriter& sw, uint32_t thread);
+  uint64_t loadSnapshot(SnapshotReader& sr, uint32_t count, time_t now);
   int doWipeCache(const string& name, uint16_t qtype=0xffff);
   bool doAgeCache(time_t now, const string& name, uint16_t qtype, int32_t newTTL);
   uint64_t cacheHits, cacheMisses;
   bool d_followRFC2181;
+  static unsigned int s_serveStale; // seconds expired records are kept around for, in case they can't be refreshed
 
 private:
   struct StoredRecord
@@ -65,12 +88,12 @@ private:
   struct CacheEntry
   {
     CacheEntry(const tuple<string, uint16_t>& key, const vector<StoredRecord>& records, bool auth) : 
-      d_qname(key.get<0>()), d_qtype(key.get<1>()), d_auth(auth), d_records(records)
+      d_qname(key.get<0>()), d_qtype(key.get<1>()), d_auth(auth), d_stored(0), d_records(records)
     {}
 
     typedef vector<StoredRecord> records_t;
 
-    uint32_t getTTD() const
+    uint32_t getEarliestTTD() const
     {
       if(d_records.size()==1)
         return d_records.begin()->d_ttd;
@@ -81,9 +104,16 @@ private:
       return earliest;
     }
 
+    //! for pruneCollection(), which should leave expired records alone as long as we might serve them stale
+    uint32_t getTTD() const
+    {
+      return getEarliestTTD() + s_serveStale;
+    }
+
     string d_qname;
     uint16_t d_qtype;
     bool d_auth;
+    uint32_t d_stored; // when replace() last wrote to us
     records_t d_records;
   };
 
@@ -102,7 +132,43 @@ private:
                >
   > cache_t;
 
-  cache_t d_cache;
+  struct Shard : public boost::noncopyable
+  {
+    Shard()
+    {
+      pthread_mutex_init(&d_mutex, 0);
+    }
+    cache_t d_cache;
+    pthread_mutex_t d_mutex;
+  };
+
+  //! locks a shard, but only if it is shared with other threads
+  class ShardLock : public boost::noncopyable
+  {
+  public:
+    ShardLock(const MemRecursorCache& rc, Shard& shard) : d_mutex(rc.d_locked ? &shard.d_mutex : 0)
+    {
+      if(d_mutex)
+        pthread_mutex_lock(d_mutex);
+    }
+    ~ShardLock()
+    {
+      if(d_mutex)
+        pthread_mutex_unlock(d_mutex);
+    }
+  private:
+    pthread_mutex_t* d_mutex;
+  };
+
+  Shard& getShard(const string& qname)
+  {
+    return *d_shards[d_shards.size()==1 ? 0 : pdns_ihash(qname) % d_shards.size()];
+  }
+
+  vector<shared_ptr<Shard> > d_shards;
+  bool d_locked;
+
+  // only used for caches of a single thread, a shared cache can change behind our back
   pair<cache_t::iterator, cache_t::iterator> d_cachecache;
   string d_cachedqname;
   bool d_cachecachevalid;
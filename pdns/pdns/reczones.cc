@@ -27,7 +27,7 @@ void primeHints(void)
   // prime root cache
   set<DNSResourceRecord>nsset;
   if(!t_RC)
-    t_RC = new MemRecursorCache();
+    t_RC = g_sharedRC ? g_sharedRC->share() : new MemRecursorCache();
 
   if(::arg()["hint-file"].empty()) {
     static const char*ips[]={"198.41.0.4", "192.228.79.201", "192.33.4.12", "128.8.10.90", "192.203.230.10", "192.5.5.241", 
@@ -215,7 +215,7 @@ void convertServersForAD(const std::string& input, SyncRes::AuthDomain& ad, cons
 
 void* pleaseWipeNegCache()
 {
-  t_sstorage->negcache.clear();   
+  t_sstorage->negcache->clear();
   return 0;
 }
 
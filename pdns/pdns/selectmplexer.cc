@@ -22,24 +22,14 @@ static struct RegisterOurselves
   }
 } doIt;
 
-void SelectFDMultiplexer::addFD(callbackmap_t& cbmap, int fd, callbackfunc_t toDo, const boost::any& parameter)
+void SelectFDMultiplexer::addFD(callbacktable_t& cbtable, int fd, callbackfunc_t toDo, const funcparam_t& parameter)
 {
-  Callback cb;
-  cb.d_callback=toDo;
-  cb.d_parameter=parameter;
-  memset(&cb.d_ttd, 0, sizeof(cb.d_ttd));
-  if(cbmap.count(fd))
-    throw FDMultiplexerException("Tried to add fd "+lexical_cast<string>(fd)+ " to multiplexer twice");
-  cbmap[fd]=cb;
+  accountingAddFD(cbtable, fd, toDo, parameter);
 }
 
-void SelectFDMultiplexer::removeFD(callbackmap_t& cbmap, int fd)
+void SelectFDMultiplexer::removeFD(callbacktable_t& cbtable, int fd)
 {
-  if(d_inrun && d_iter->first==fd)  // trying to remove us!
-    d_iter++;
-
-  if(!cbmap.erase(fd))
-    throw FDMultiplexerException("Tried to remove unlisted fd "+lexical_cast<string>(fd)+ " from multiplexer");
+  accountingRemoveFD(cbtable, fd);
 }
 
 int SelectFDMultiplexer::run(struct timeval* now)
@@ -53,14 +43,18 @@ int SelectFDMultiplexer::run(struct timeval* now)
   
   int fdmax=0;
 
-  for(callbackmap_t::const_iterator i=d_readCallbacks.begin(); i != d_readCallbacks.end(); ++i) {
-    FD_SET(i->first, &readfds);
-    fdmax=max(i->first, fdmax);
+  for(unsigned int fd=0; fd < d_readCallbacks.size(); ++fd) {
+    if(d_readCallbacks[fd].d_active) {
+      FD_SET(fd, &readfds);
+      fdmax=max((int)fd, fdmax);
+    }
   }
 
-  for(callbackmap_t::const_iterator i=d_writeCallbacks.begin(); i != d_writeCallbacks.end(); ++i) {
-    FD_SET(i->first, &writefds);
-    fdmax=max(i->first, fdmax);
+  for(unsigned int fd=0; fd < d_writeCallbacks.size(); ++fd) {
+    if(d_writeCallbacks[fd].d_active) {
+      FD_SET(fd, &writefds);
+      fdmax=max((int)fd, fdmax);
+    }
   }
   
   struct timeval tv={0,500000};
@@ -73,23 +67,13 @@ int SelectFDMultiplexer::run(struct timeval* now)
   if(ret < 1) // nothing - thanks AB
     return 0;
 
-  d_iter=d_readCallbacks.end();
   d_inrun=true;
   
-  for(callbackmap_t::iterator i=d_readCallbacks.begin(); i != d_readCallbacks.end() && i->first <= fdmax; ) {
-    d_iter=i++;
-
-    if(FD_ISSET(d_iter->first, &readfds)) {
-      d_iter->second.d_callback(d_iter->first, d_iter->second.d_parameter);
+  for(int fd=0; fd <= fdmax; ++fd) {
+    if(FD_ISSET(fd, &readfds) && dispatch(d_readCallbacks, fd))
       continue;  // so we don't refind ourselves as writable
-    }
-  }
-
-  for(callbackmap_t::iterator i=d_writeCallbacks.begin(); i != d_writeCallbacks.end() && i->first <= fdmax; ) {
-    d_iter=i++;
-    if(FD_ISSET(d_iter->first, &writefds)) {
-      d_iter->second.d_callback(d_iter->first, d_iter->second.d_parameter);
-    }
+    if(FD_ISSET(fd, &writefds))
+      dispatch(d_writeCallbacks, fd);
   }
 
   d_inrun=false;
@@ -98,10 +82,10 @@ int SelectFDMultiplexer::run(struct timeval* now)
 
 #if 0
 
-void acceptData(int fd, boost::any& parameter)
+void acceptData(int fd, FDMultiplexer::funcparam_t& parameter)
 {
   cout<<"Have data on fd "<<fd<<endl;
-  Socket* sock=boost::any_cast<Socket*>(parameter);
+  Socket* sock=funcparam_cast<Socket*>(parameter);
   string packet;
   IPEndpoint rem;
   sock->recvFrom(packet, rem);
@@ -5,9 +5,19 @@
 #include "dnsrecords.hh"
 #include <boost/format.hpp>
 #include "config.h"
+#include "recpacketcache.hh"
+#include "mtasker.hh"
 #ifndef RECURSOR
 #include "statbag.hh"
+#include "packetcache.hh"
+#include "arguments.hh"
+#include "distributor.hh"
 StatBag S;
+ArgvMap theArg;
+ArgvMap &arg()
+{
+  return theArg;
+}
 #endif
 
 volatile bool g_ret; // make sure the optimizer does not get too smart
@@ -45,6 +55,51 @@ template<typename C> void doRun(const C& cmd, int mseconds=100)
   g_totalRuns += runs;
 }
 
+template<typename C> struct ThreadedRunParams
+{
+  const C* cmd;
+  uint64_t runs;
+};
+
+template<typename C> void* threadedRunner(void* arg)
+{
+  ThreadedRunParams<C>* trp=(ThreadedRunParams<C>*)arg;
+  while(!g_stop) {
+    (*trp->cmd)();
+    trp->runs++;
+  }
+  return 0;
+}
+
+/* like doRun, but runs cmd from several threads at once for mseconds of wall clock time, 
+   so this measures how well cmd scales, not how fast it is */
+template<typename C> void doThreadedRun(const C& cmd, unsigned int threads, int mseconds=250)
+{
+  vector<pthread_t> tids(threads);
+  vector<ThreadedRunParams<C> > params(threads);
+  g_stop=false;
+  DTime dt;
+  dt.set();
+  for(unsigned int n=0; n < threads; ++n) {
+    params[n].cmd=&cmd;
+    params[n].runs=0;
+    pthread_create(&tids[n], 0, threadedRunner<C>, &params[n]);
+  }
+  usleep(mseconds*1000);
+  g_stop=true;
+
+  uint64_t runs=0;
+  for(unsigned int n=0; n < threads; ++n) {
+    pthread_join(tids[n], 0);
+    runs+=params[n].runs;
+  }
+  double delta=dt.udiff()/1000000.0;
+  boost::format fmt("'%s' %d threads %.02f seconds: %.1f runs/s, %.1f runs/s/thread");
+
+  cerr<< (fmt % cmd.getName() % threads % delta % (runs/delta) % (runs/delta/threads)) << endl;
+  g_totalRuns += runs;
+}
+
 struct ARecordTest
 {
   explicit ARecordTest(int records) : d_records(records) {}
@@ -744,6 +799,311 @@ struct StrcasecmpTest
 };
 
 
+/* the recursor packet cache used to be looked up like this: ordered on the raw question packets,
+   with the answer copied out into a string. Kept here to compare RecursorPacketCache against */
+struct DNSPacketLess
+{
+  bool operator()(const string& a, const string& b) const
+  {
+    return dnspacketLessThan(a, b);
+  }
+};
+
+struct RecPacketCacheTest
+{
+  explicit RecPacketCacheTest(bool hashed, unsigned int names) : d_hashed(hashed), d_lookups(0)
+  {
+    for(unsigned int n=0; n < names; ++n) {
+      vector<uint8_t> packet;
+      DNSPacketWriter pw(packet, "host"+lexical_cast<string>(n)+".ds9a.nl", QType::A);
+      pw.getHeader()->rd=1;
+      d_queries.push_back(string((const char*)&*packet.begin(), packet.size()));
+
+      pw.getHeader()->qr=1;
+      pw.startRecord("host"+lexical_cast<string>(n)+".ds9a.nl", QType::A, 3600);
+      pw.xfrIP(htonl(0x01020304));
+      pw.commit();
+      string response((const char*)&*packet.begin(), packet.size());
+
+      uint32_t hash;
+      uint16_t ednsSize;
+      RecursorPacketCache::getQuestionHash(d_queries.back().c_str(), d_queries.back().length(), &hash, &ednsSize);
+      d_rpc.insertResponsePacket(hash, ednsSize, response, time(0), 3600);
+      d_ordered[d_queries.back()]=response;
+    }
+  }
+
+  string getName() const
+  {
+    return (boost::format("recursor packetcache lookup, %s, %d names") % (d_hashed ? "hashed" : "ordered") % d_queries.size()).str();
+  }
+
+  void operator()() const
+  {
+    const string& query=d_queries[d_lookups++ % d_queries.size()];
+    if(d_hashed) {
+      char response[1680];
+      unsigned int len=sizeof(response);
+      uint32_t hash;
+      uint16_t ednsSize;
+      g_ret=RecursorPacketCache::getQuestionHash(query.c_str(), query.length(), &hash, &ednsSize) && 
+        d_rpc.getResponsePacket(hash, query.c_str(), query.length(), time(0), response, &len);
+    }
+    else {
+      map<string, string, DNSPacketLess>::const_iterator iter=d_ordered.find(query);
+      string response=iter->second;
+      response.replace(0, 2, query.c_str(), 2);
+      g_ret=response.length();
+    }
+  }
+
+  bool d_hashed;
+  mutable unsigned int d_lookups;
+  vector<string> d_queries;
+  mutable RecursorPacketCache d_rpc;
+  map<string, string, DNSPacketLess> d_ordered;
+};
+
+static string makeRecQuestion(const string& qname, uint16_t qtype, bool response)
+{
+  vector<uint8_t> packet;
+  DNSPacketWriter pw(packet, qname, qtype);
+  pw.getHeader()->rd=1;
+  if(response) {
+    pw.getHeader()->qr=1;
+    pw.startRecord(qname, qtype, 3600);
+    pw.xfrBlob(string("\x00\x01\x00", 3));
+    pw.commit();
+  }
+  return string((const char*)&*packet.begin(), packet.size());
+}
+
+//! not a speed test: the qname is looked up case insensitively, qtype and qclass must match exactly
+void checkRecPacketCacheCase()
+{
+  RecursorPacketCache rpc;
+  string response=makeRecQuestion("host.ds9a.nl", 97, true);
+  uint32_t hash;
+  uint16_t ednsSize;
+  RecursorPacketCache::getQuestionHash(response.c_str(), response.length(), &hash, &ednsSize);
+  rpc.insertResponsePacket(hash, ednsSize, response, time(0), 3600);
+
+  struct { const char* qname; uint16_t qtype; bool hit; } checks[]={
+    { "host.ds9a.nl", 97, true },
+    { "HOST.ds9A.nl", 97, true },
+    { "host.ds9a.nl", 65, false }, // 'a' and 'A', HTTPS must not get the answer for type 97
+    { "HOST.DS9A.NL", 65, false }
+  };
+  for(unsigned int n=0; n < sizeof(checks)/sizeof(checks[0]); ++n) {
+    string query=makeRecQuestion(checks[n].qname, checks[n].qtype, false);
+    char buffer[1680];
+    unsigned int len=sizeof(buffer);
+    bool hit=RecursorPacketCache::getQuestionHash(query.c_str(), query.length(), &hash, &ednsSize) &&
+      rpc.getResponsePacket(hash, query.c_str(), query.length(), time(0), buffer, &len);
+    if(hit != checks[n].hit)
+      throw runtime_error((boost::format("recursor packetcache %s for %s|%d") % (hit ? "hit" : "miss") % checks[n].qname % checks[n].qtype).str());
+  }
+}
+
+//! stands in for the recursor PacketID: remote, question and id of an outstanding query
+struct MTaskerTestKey
+{
+  ComboAddress remote;
+  string domain;
+  uint16_t id;
+
+  bool operator<(const MTaskerTestKey& b) const
+  {
+    if(remote < b.remote)
+      return true;
+    if(b.remote < remote)
+      return false;
+    if(pdns_ilexicographical_compare(domain, b.domain))
+      return true;
+    if(pdns_ilexicographical_compare(b.domain, domain))
+      return false;
+    return id < b.id;
+  }
+  bool operator==(const MTaskerTestKey& b) const
+  {
+    return remote == b.remote && pdns_iequals(domain, b.domain) && id == b.id;
+  }
+};
+
+inline size_t hash_value(const MTaskerTestKey& key)
+{
+  return pdns_hashmix(key.remote.hash(pdns_ihash(key.domain)), key.id);
+}
+
+/** each run wakes one of many waiting mthreads, which then waits again with a fresh timeout, like the recursor does for answers.
+    With miss set, events are sent for keys nobody waits for, which only measures finding waiters */
+struct MTaskerEventTest
+{
+  explicit MTaskerEventTest(unsigned int waiters, bool miss=false) : d_miss(miss), d_events(0)
+  {
+    s_mt=new MTasker<MTaskerTestKey, int>(16384);
+    for(unsigned int n=0; n < waiters; ++n) {
+      MTaskerTestKey key;
+      key.remote=ComboAddress("192.0.2."+lexical_cast<string>(n % 200), 53);
+      key.domain="host"+lexical_cast<string>(n)+".ds9a.nl";
+      key.id=n;
+      d_keys.push_back(key);
+    }
+    for(unsigned int n=0; n < waiters; ++n)
+      s_mt->makeThread(waiter, (void*)&d_keys[n]);
+    struct timeval now;
+    gettimeofday(&now, 0);
+    while(s_mt->schedule(&now));
+    random_shuffle(d_keys.begin(), d_keys.end()); // answers do not arrive in order
+    if(d_miss)
+      for(vector<MTaskerTestKey>::iterator i=d_keys.begin(); i != d_keys.end(); ++i)
+        i->id++;
+  }
+
+  ~MTaskerEventTest()
+  {
+    delete s_mt;
+  }
+
+  static void waiter(void* p)
+  {
+    MTaskerTestKey key=*(MTaskerTestKey*)p;
+    int val;
+    for(;;)
+      s_mt->waitEvent(key, &val, 1500 + key.id % 1000);
+  }
+
+  string getName() const
+  {
+    return (boost::format("mtasker sendEvent%s, %d waiters") % (d_miss ? " without waiter" : "") % d_keys.size()).str();
+  }
+
+  void operator()() const
+  {
+    int val=1;
+    g_ret=s_mt->sendEvent(d_keys[d_events++ % d_keys.size()], &val);
+    if(!(d_events % 64)) {
+      struct timeval now;
+      gettimeofday(&now, 0);
+      s_mt->schedule(&now);
+    }
+  }
+
+  static MTasker<MTaskerTestKey, int>* s_mt;
+  bool d_miss;
+  vector<MTaskerTestKey> d_keys;
+  mutable unsigned int d_events;
+};
+MTasker<MTaskerTestKey, int>* MTaskerEventTest::s_mt;
+
+#ifndef RECURSOR
+__thread unsigned int t_pclookups;
+
+struct PacketCacheLookupTest
+{
+  explicit PacketCacheLookupTest(PacketCache& pc, unsigned int shards, unsigned int names) 
+    : d_pc(pc), d_shards(shards)
+  {
+    for(unsigned int n=0; n < names; ++n) 
+      d_names.push_back("host"+lexical_cast<string>(n)+".ds9a.nl");
+  }
+
+  string getName() const
+  {
+    return (boost::format("packetcache lookup, %d shards") % d_shards).str();
+  }
+
+  void operator()() const
+  {
+    string value;
+    const string& qname=d_names[t_pclookups++ % d_names.size()];
+    g_ret=d_pc.getEntry(qname, QType(QType::A), PacketCache::QUERYCACHE, value, 1);
+  }
+
+  PacketCache& d_pc;
+  unsigned int d_shards;
+  vector<string> d_names;
+};
+
+void doPacketCacheRuns(unsigned int shards)
+{
+  PacketCache pc;
+  pc.setShards(shards);
+  PacketCacheLookupTest plt(pc, shards, 10000);
+  for(vector<string>::const_iterator i=plt.d_names.begin(); i != plt.d_names.end(); ++i) 
+    pc.insert(*i, QType(QType::A), PacketCache::QUERYCACHE, "1.2.3.4", 3600, 1);
+  for(unsigned int threads=1; threads <= 32; threads*=2)
+    doThreadedRun(plt, threads);
+}
+
+struct NopQuestion
+{
+  NopQuestion()
+  {
+    d_dt.set();
+  }
+  DTime d_dt;
+};
+
+struct NopAnswer
+{
+};
+
+struct NopBackend
+{
+  NopAnswer* question(NopQuestion*)
+  {
+    return 0;
+  }
+  static int numRunning()
+  {
+    return 1000000; // keep the Distributor from spawning replacement threads
+  }
+  static bool getCoalesceKey(NopQuestion*, string*)
+  {
+    return false;
+  }
+  static NopAnswer* coalescedAnswer(NopAnswer*, NopQuestion*)
+  {
+    return 0;
+  }
+};
+
+typedef Distributor<NopAnswer, NopQuestion, NopBackend> NopDistributor;
+AtomicCounter g_distanswered;
+
+void distributorCallback(const NopDistributor::AnswerData&)
+{
+  ++g_distanswered;
+}
+
+/* feeds a Distributor with a no-op backend from a single thread, like a receiver thread does, for mseconds of wall clock
+   time. Distributor threads are never stopped, so every run leaves its threads parked behind */
+void doDistributorRun(int threads, int mseconds=250)
+{
+  NopDistributor* distributor=new NopDistributor(threads);
+  NopQuestion question;
+  unsigned int asked=0, before=g_distanswered;
+
+  DTime dt;
+  dt.set();
+  while(dt.udiffNoReset() < mseconds*1000) {
+    for(unsigned int n=0; n < 100; ++n) {
+      if(asked - (g_distanswered - before) < 1000) {
+        distributor->question(&question, distributorCallback);
+        ++asked;
+      }
+    }
+  }
+  while(g_distanswered - before != asked)
+    ;
+  double delta=dt.udiff()/1000000.0;
+  boost::format fmt("'distributor, %d backend threads' %.02f seconds: %.1f questions/s");
+  cerr<< (fmt % threads % delta % (asked/delta)) << endl;
+  g_totalRuns += asked;
+}
+#endif
+
 struct NOPTest
 {
   string getName() const
@@ -836,11 +1196,37 @@ try
   doRun(SOARecordTest(4));
   doRun(SOARecordTest(64));
 
+  checkRecPacketCacheCase();
+  doRun(RecPacketCacheTest(false, 10000));
+  doRun(RecPacketCacheTest(true, 10000));
+
+  doRun(MTaskerEventTest(100));
+  doRun(MTaskerEventTest(20000));
+  doRun(MTaskerEventTest(20000, true));
+
+#ifndef RECURSOR
+  ::arg().set("cache-ttl","Seconds to store packets in the PacketCache")="20";
+  ::arg().set("recursive-cache-ttl","Seconds to store packets for recursive queries in the PacketCache")="10";
+  ::arg().set("recursor","If recursion is desired, IP address of a recursing nameserver")="no"; 
+  ::arg().set("max-cache-entries", "Maximum number of cache entries")="1000000";
+  S.declare("deferred-cache-inserts");
+  S.declare("deferred-cache-lookup");
+  doPacketCacheRuns(1);
+  doPacketCacheRuns(32);
+
+  ::arg().set("queue-limit","Maximum number of milliseconds to queue a query")="0";
+  ::arg().set("overload-queue-length","Maximum queuelength moving to packetcache only")="0";
+  ::arg().set("max-queue-length","Maximum queuelength before considering situation lost")="5000";
+  for(int threads=2; threads <= 16; threads*=2)
+    doDistributorRun(threads);
+#endif
+
   cerr<<"Total runs: " << g_totalRuns<<endl;
 
 }
 catch(std::exception &e)
 {
   cerr<<"Fatal: "<<e.what()<<endl;
+  return 1;
 }
 
@@ -0,0 +1,93 @@
+#ifndef PDNS_SPSCRING_HH
+#define PDNS_SPSCRING_HH
+#include <vector>
+#include <inttypes.h>
+#include <boost/utility.hpp>
+
+/* A fixed size ring that passes items from one thread to another without locks, for exactly one producer and one
+   consumer. Slots are reused, the producer fills one in place and then publishes it, the consumer works on it
+   in place and then releases it.
+
+   produce() tells if the ring was empty before, which is when the consumer may have gone to sleep and needs a wakeup.
+   For that to be reliable, both sides put a full barrier between publishing their own index and reading the other's,
+   so that either the producer sees the consumer emptied the ring, or the consumer sees the new item. */
+
+class SPSCRingBase
+{
+protected:
+  static void fullBarrier()
+  {
+#if defined( __GNUC__ ) && ( defined( __i386__ ) || defined( __x86_64__ ) )
+    __asm__ __volatile__("mfence" ::: "memory"); // __sync_synchronize is not universally available on i386
+#else
+    __sync_synchronize();
+#endif
+  }
+};
+
+template<typename T>
+class SPSCRing : public SPSCRingBase, public boost::noncopyable
+{
+public:
+  //! capacity is rounded up to a power of two
+  explicit SPSCRing(unsigned int capacity) : d_head(0), d_tail(0)
+  {
+    unsigned int size=1;
+    while(size < capacity)
+      size <<= 1;
+    d_slots.resize(size);
+    d_mask=size-1;
+  }
+
+  //! producer: the slot to fill, or 0 if the ring is full
+  T* producerSlot()
+  {
+    if(d_head - d_tail > d_mask)
+      return 0;
+    return &d_slots[d_head & d_mask];
+  }
+
+  //! producer: publishes the slot returned by producerSlot(), returns true if the ring was empty before
+  bool produce()
+  {
+    uint32_t head=d_head;
+    fullBarrier(); // the slot is written before it is published
+    d_head=head+1;
+    fullBarrier(); // and published before we look at d_tail
+    return d_tail == head;
+  }
+
+  //! consumer: the oldest slot, or 0 if the ring is empty
+  T* consumerSlot()
+  {
+    if(d_tail == d_head)
+      return 0;
+    fullBarrier(); // don't read the slot before we saw it was published
+    return &d_slots[d_tail & d_mask];
+  }
+
+  //! consumer: hands the slot returned by consumerSlot() back to the producer
+  void consume()
+  {
+    uint32_t tail=d_tail;
+    fullBarrier(); // done with the slot before it is released
+    d_tail=tail+1;
+    fullBarrier(); // and released before we look at d_head again
+  }
+
+  unsigned int capacity() const
+  {
+    return d_mask+1;
+  }
+
+private:
+  std::vector<T> d_slots;
+  uint32_t d_mask;
+  char d_pad1[64];
+  volatile uint32_t d_head; //!< written by the producer only
+  char d_pad2[64];
+  volatile uint32_t d_tail; //!< written by the consumer only
+  char d_pad3[64];
+};
+
+#endif
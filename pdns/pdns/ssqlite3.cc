@@ -7,6 +7,7 @@
 #include "pdns/utility.hh"
 #include <string>
 #include "ssqlite3.hh"
+#include "pdns/misc.hh"
 #include <iostream>
 
 #ifdef WIN32
@@ -28,6 +29,7 @@ SSQLite3::SSQLite3( const std::string & database, bool creat )
   if ( sqlite3_open( database.c_str(), &m_pDB)!=SQLITE_OK )
     throw sPerrorException( "Could not connect to the SQLite database '" + database + "'" );
   m_pStmt = 0;
+  m_stmtPrepared = false;
   sqlite3_busy_handler(m_pDB, busyHandler, 0);
 }
 
@@ -35,6 +37,11 @@ SSQLite3::SSQLite3( const std::string & database, bool creat )
 SSQLite3::~SSQLite3()
 {
   int ret;
+  for(std::vector<sqlite3_stmt*>::iterator i = m_prepared.begin(); i != m_prepared.end(); ++i)
+    sqlite3_finalize(*i);
+  if(m_stmtPrepared)
+    m_pStmt = 0;
+
   for(int n = 0; n < 2 ; ++n) {
     if((ret =sqlite3_close( m_pDB )) != SQLITE_OK) {
       if(n || !m_pStmt || ret != SQLITE_BUSY) { // if we have SQLITE_BUSY, and a working m_Pstmt, try finalize
@@ -85,52 +92,84 @@ int SSQLite3::doQuery( const std::string & query )
   if ( sqlite3_prepare( m_pDB, query.c_str(), -1, &m_pStmt, &pTail ) != SQLITE_OK )   
 #endif
     throw sPerrorException( string("Unable to compile SQLite statement : ")+ sqlite3_errmsg( m_pDB ) );
+  m_stmtPrepared = false;
 
   return 0;
 }
 
+// Compiles a statement for repeated use.
+int SSQLite3::prepare( const std::string & query, int nparams )
+{
+  sqlite3_stmt *pStmt;
+  const char *pTail;
+
+#if SQLITE_VERSION_NUMBER >=  3003009
+  if ( sqlite3_prepare_v2( m_pDB, query.c_str(), -1, &pStmt, &pTail ) != SQLITE_OK )
+#else
+  if ( sqlite3_prepare( m_pDB, query.c_str(), -1, &pStmt, &pTail ) != SQLITE_OK )   
+#endif
+    throw sPerrorException( string("Unable to compile SQLite statement : ")+ sqlite3_errmsg( m_pDB ) );
+
+  if ( sqlite3_bind_parameter_count( pStmt ) != nparams ) {
+    sqlite3_finalize( pStmt );
+    throw sPerrorException( "SQLite statement '"+query+"' does not have "+itoa(nparams)+" parameters" );
+  }
+
+  m_prepared.push_back( pStmt );
+  return m_prepared.size() - 1;
+}
+
+// Runs a prepared statement.
+void SSQLite3::execute( int statement, const std::vector<std::string> & params )
+{
+  sqlite3_stmt *pStmt = m_prepared.at( statement );
+
+  sqlite3_reset( pStmt ); // in case the previous user did not read all rows
+  for ( std::vector<std::string>::size_type n = 0; n < params.size(); ++n )
+    if ( sqlite3_bind_text( pStmt, n + 1, params[n].c_str(), params[n].size(), SQLITE_TRANSIENT ) != SQLITE_OK )
+      throw sPerrorException( string("Unable to bind SQLite parameter : ")+ sqlite3_errmsg( m_pDB ) );
+
+  m_pStmt = pStmt;
+  m_stmtPrepared = true;
+}
+
+// Done with the current statement.
+void SSQLite3::releaseStatement()
+{
+  if ( m_stmtPrepared )
+    sqlite3_reset( m_pStmt );
+  else
+    sqlite3_finalize( m_pStmt );
+  m_pStmt = 0;
+  m_stmtPrepared = false;
+}
+
 int SSQLite3::busyHandler(void*, int)
 {
   usleep(1000);
   return 1;
 }
 
-// Returns a row from the result set.
-bool SSQLite3::getRow( row_t & row )
+// Steps to the next row of the result set.
+bool SSQLite3::nextRow()
 {
-  int  numCols;
   int  rc;
-  const char *pData;
-
-  row.clear();
 
   rc = sqlite3_step( m_pStmt );
 
   if ( rc == SQLITE_ROW )
-  {
-    numCols = sqlite3_column_count( m_pStmt );
-    // Another row received, process it.
-    for ( int i = 0; i < numCols; i++ )
-    {
-      pData = (const char*) sqlite3_column_text( m_pStmt, i );
-      row.push_back( pData ? pData : "" ); // NULL value to "".
-    }
-
     return true;
-  }
 
   if ( rc == SQLITE_DONE )
   {
     // We're done, clean up.
-    sqlite3_finalize( m_pStmt );
-    m_pStmt = NULL;
+    releaseStatement();
     return false;
   }
   
   if(rc == SQLITE_CANTOPEN) {
     string error ="CANTOPEN error in sqlite3, often caused by unwritable sqlite3 db *directory*: "+string(sqlite3_errmsg(m_pDB));
-    sqlite3_finalize(m_pStmt);
-    m_pStmt = 0;
+    releaseStatement();
     throw sPerrorException(error);
   }
   
@@ -142,6 +181,23 @@ bool SSQLite3::getRow( row_t & row )
 }
 
 
+// Number of columns in the result set.
+unsigned int SSQLite3::getFieldCount()
+{
+  return sqlite3_column_count( m_pStmt );
+}
+
+// Returns a column of the current row.
+SSqlField SSQLite3::getField( unsigned int n )
+{
+  const char *pData = (const char*) sqlite3_column_text( m_pStmt, n );
+  if ( !pData )
+    return SSqlField(); // NULL value to "".
+
+  return SSqlField( pData, sqlite3_column_bytes( m_pStmt, n ) );
+}
+
+
 // Escape a SQL query.
 std::string SSQLite3::escape( const std::string & name)
 {
@@ -19,6 +19,14 @@ private:
   //! Pointer to the SQLite virtual machine executing a query.
   sqlite3_stmt *m_pStmt;
 
+  //! Statements compiled by prepare(), m_pStmt may point at one of these.
+  std::vector<sqlite3_stmt*> m_prepared;
+
+  //! Is m_pStmt one of m_prepared? Then it is reset instead of finalized when done.
+  bool m_stmtPrepared;
+
+  void releaseStatement();
+
   static int busyHandler(void*, int);
 protected:
 public:
@@ -42,7 +50,25 @@ public:
   }
   
   //! Returns a row from a result set.
-  bool getRow( row_t & row );
+  bool getRow( row_t & row )
+  {
+    return copyRow( row );
+  }
+
+  //! Steps to the next row, without copying it.
+  bool nextRow();
+
+  //! Number of columns in the current row.
+  unsigned int getFieldCount();
+
+  //! A column of the current row, straight from SQLite.
+  SSqlField getField( unsigned int n );
+
+  //! Compiles a query once, so it can be run with execute() without parsing it again.
+  int prepare( const std::string & query, int nparams );
+
+  //! Binds the parameters to a prepared statement, caller can retrieve answers with getRow
+  void execute( int statement, const std::vector<std::string> & params );
 
   //! Escapes the SQL query.
   std::string escape( const std::string & query );
@@ -41,6 +41,7 @@
 __thread SyncRes::StaticStorage* t_sstorage;
 
 unsigned int SyncRes::s_maxnegttl;
+unsigned int SyncRes::s_refreshAhead;
 unsigned int SyncRes::s_maxcachettl;
 unsigned int SyncRes::s_packetcachettl;
 unsigned int SyncRes::s_packetcacheservfailttl;
@@ -52,6 +53,8 @@ unsigned int SyncRes::s_throttledqueries;
 unsigned int SyncRes::s_dontqueries;
 unsigned int SyncRes::s_nodelegated;
 unsigned int SyncRes::s_unreachables;
+unsigned int SyncRes::s_negcachehits;
+unsigned int SyncRes::s_negcacheparenthits;
 bool SyncRes::s_doIPv6;
 bool SyncRes::s_nopacketcache;
 
@@ -67,10 +70,12 @@ bool SyncRes::s_doAAAAAdditionalProcessing;
 
 SyncRes::SyncRes(const struct timeval& now) :  d_outqueries(0), d_tcpoutqueries(0), d_throttledqueries(0), d_timeouts(0), d_unreachables(0),
         					 d_now(now),
-        					 d_cacheonly(false), d_nocache(false), d_doEDNS0(false) 
+        					 d_cacheonly(false), d_nocache(false), d_refresh(false), d_stale(false), d_doEDNS0(false) 
 { 
   if(!t_sstorage) {
     t_sstorage = new StaticStorage();
+    t_sstorage->infra = g_sharedInfra ? g_sharedInfra->share() : new InfraCache();
+    t_sstorage->negcache = g_sharedNegCache ? g_sharedNegCache->share() : new NegCache();
   }
 }
 
@@ -120,13 +125,51 @@ int SyncRes::beginResolve(const string &qname, const QType &qtype, uint16_t qcla
   else if(qclass!=1)
     return -1;
   
-  set<GetBestNSAnswer> beenthere;
+  beenthere_t beenthere(std::less<GetBestNSAnswer>(), &d_arena);
   int res=doResolve(qname, qtype, ret, 0, beenthere);
   if(!res && s_doAdditionalProcessing)
     addCruft(qname, ret);
   return res;
 }
 
+/* Most questions are for a single RRset that is sitting in the record cache. This hands out that RRset in wire format,
+   so the caller can copy it into the answer as is. Returns false whenever beginResolve() would have to do anything
+   more than that: special names, CNAMEs, negative answers, additional processing or rdata that would get compressed */
+bool SyncRes::getCachedWireAnswer(const string &qname, const QType &qtype, uint16_t qclass, vector<MemRecursorCache::WireRecord>& ret)
+{
+  if(d_cacheonly || qclass!=1 || s_doAdditionalProcessing)
+    return false;
+
+  switch(qtype.getCode()) {
+  case QType::ANY:
+  case QType::ADDR:
+  case QType::AXFR:
+  case QType::NS:
+  case QType::CNAME:
+  case QType::PTR:
+  case QType::MX:
+  case QType::SOA:
+    return false;
+  case QType::A:
+    if(qname.length()==10 && pdns_iequals(qname, "localhost."))
+      return false;
+  }
+
+  // doCacheCheck() answers from the negative cache, including the NXDOMAIN of a name above qname
+  NegCacheEntry ne;
+  if(t_sstorage->negcache->get(qname, qtype, d_now.tv_sec, &ne))
+    return false;
+
+  uint32_t origTTL;
+  int ttl=t_RC->getWire(d_now.tv_sec, qname, qtype, &ret, &origTTL);
+  if(ttl <= 0)
+    return false;
+  checkRefreshAhead(qname, qtype, origTTL, ttl);
+
+  s_queries++;
+  return true;
+}
+
 //! This is the 'out of band resolver', in other words, the authoritative server
 bool SyncRes::doOOBResolve(const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret, int depth, int& res)
 {
@@ -233,13 +276,261 @@ void SyncRes::doEDNSDumpAndClose(int fd)
   FILE* fp=fdopen(fd, "w");
   fprintf(fp,"IP Address\tMode\tMode last updated at\n");
 
-  for(ednsstatus_t::const_iterator iter = t_sstorage->ednsstatus.begin(); iter != t_sstorage->ednsstatus.end(); ++iter) {
-    fprintf(fp, "%s\t%d\t%s", iter->first.toString().c_str(), (int)iter->second.mode, ctime(&iter->second.modeSetAt));
+  InfraCache& infra=*t_sstorage->infra;
+  for(unsigned int n=0; n < infra.numShards(); ++n) {
+    InfraCache::ShardLock l(infra, infra.getShard(n));
+    const ednsstatus_t& ednsstatus=infra.getShard(n).ednsstatus;
+    for(ednsstatus_t::const_iterator iter = ednsstatus.begin(); iter != ednsstatus.end(); ++iter) {
+      fprintf(fp, "%s\t%d\t%s", iter->first.toString().c_str(), (int)iter->second.mode, ctime(&iter->second.modeSetAt));
+    }
   }
 
   fclose(fp);
 }
 
+SyncRes::InfraCache::InfraCache() : d_locked(false)
+{
+  d_shards.push_back(shared_ptr<Shard>(new Shard));
+}
+
+SyncRes::InfraCache::InfraCache(unsigned int shards) : d_locked(false)
+{
+  for(unsigned int n=0; n < max(shards, 1U); ++n)
+    d_shards.push_back(shared_ptr<Shard>(new Shard));
+}
+
+//! a handle on the same shards, for another thread
+SyncRes::InfraCache* SyncRes::InfraCache::share() const
+{
+  InfraCache* ret=new InfraCache;
+  ret->d_shards=d_shards;
+  ret->d_locked=true;
+  return ret;
+}
+
+bool SyncRes::InfraCache::shouldThrottle(time_t now, const throttlekey_t& t)
+{
+  Shard& shard=getShardFor(ThrottleKeyHash()(t));
+  ShardLock l(*this, shard);
+  return shard.throttle.shouldThrottle(now, t);
+}
+
+void SyncRes::InfraCache::throttle(time_t now, const throttlekey_t& t, unsigned int ttl, unsigned int tries)
+{
+  Shard& shard=getShardFor(ThrottleKeyHash()(t));
+  ShardLock l(*this, shard);
+  shard.throttle.throttle(now, t, ttl, tries);
+}
+
+void SyncRes::InfraCache::submitSpeed(const string& nsname, const ComboAddress& remote, int usecs, struct timeval* now)
+{
+  Shard& shard=getShardFor(pdns_ihash(nsname));
+  ShardLock l(*this, shard);
+  shard.nsSpeeds[nsname].submit(remote, usecs, now);
+}
+
+double SyncRes::InfraCache::getSpeed(const string& nsname, struct timeval* now)
+{
+  Shard& shard=getShardFor(pdns_ihash(nsname));
+  ShardLock l(*this, shard);
+  return shard.nsSpeeds[nsname].get(now);
+}
+
+bool SyncRes::InfraCache::getBestAddress(const string& nsname, ComboAddress* best)
+{
+  Shard& shard=getShardFor(pdns_ihash(nsname));
+  ShardLock l(*this, shard);
+  nsspeeds_t::const_iterator i=shard.nsSpeeds.find(nsname);
+  if(i == shard.nsSpeeds.end())
+    return false;
+  *best=i->second.d_best;
+  return true;
+}
+
+void SyncRes::InfraCache::setSpeeds(const string& nsname, const DecayingEwmaCollection& dec)
+{
+  Shard& shard=getShardFor(pdns_ihash(nsname));
+  ShardLock l(*this, shard);
+  shard.nsSpeeds[nsname]=dec;
+}
+
+struct NSSpeedsStale
+{
+  explicit NSSpeedsStale(time_t limit) : d_limit(limit)
+  {}
+  bool operator()(const SyncRes::nsspeeds_t::value_type& v) const
+  {
+    return v.second.stale(d_limit);
+  }
+  time_t d_limit;
+};
+
+//! looks at a fortieth of each table, called from houseKeeping() this gets round as often as the full scan we used to do
+void SyncRes::InfraCache::pruneSpeeds(time_t limit)
+{
+  for(vector<shared_ptr<Shard> >::const_iterator i=d_shards.begin(); i!=d_shards.end(); ++i) {
+    ShardLock l(*this, **i);
+    (*i)->nsSpeeds.expire((*i)->nsSpeeds.capacity()/40 + 1, NSSpeedsStale(limit));
+  }
+}
+
+//! what the reset in asyncresolveWrapper() would do anyway, and entries that never learned anything
+struct EDNSStatusExpired
+{
+  explicit EDNSStatusExpired(time_t now) : d_now(now)
+  {}
+  bool operator()(const SyncRes::ednsstatus_t::value_type& v) const
+  {
+    if(!v.second.modeSetAt)
+      return v.second.mode == SyncRes::EDNSStatus::UNKNOWN;
+    return v.second.modeSetAt + 3600 < d_now;
+  }
+  time_t d_now;
+};
+
+SyncRes::EDNSStatus SyncRes::InfraCache::getEDNSStatus(const ComboAddress& remote, time_t now)
+{
+  Shard& shard=getShardFor(remote.hash());
+  ShardLock l(*this, shard);
+  shard.ednsstatus.expire(4, EDNSStatusExpired(now));
+  ednsstatus_t::const_iterator i=shard.ednsstatus.find(remote);
+  if(i == shard.ednsstatus.end())
+    return EDNSStatus();
+  return i->second;
+}
+
+void SyncRes::InfraCache::updateEDNSStatus(const ComboAddress& remote, const EDNSStatus& was, const EDNSStatus& status)
+{
+  Shard& shard=getShardFor(remote.hash());
+  ShardLock l(*this, shard);
+  ednsstatus_t::iterator i=shard.ednsstatus.find(remote);
+  if(i == shard.ednsstatus.end()) {
+    if(was == EDNSStatus())
+      shard.ednsstatus.insert(make_pair(remote, status));
+  }
+  else if(i->second == was)
+    i->second=status;
+}
+
+uint64_t SyncRes::InfraCache::throttleSize()
+{
+  uint64_t ret=0;
+  for(vector<shared_ptr<Shard> >::const_iterator i=d_shards.begin(); i!=d_shards.end(); ++i) {
+    ShardLock l(*this, **i);
+    ret+=(*i)->throttle.size();
+  }
+  return ret;
+}
+
+uint64_t SyncRes::InfraCache::nsSpeedsSize()
+{
+  uint64_t ret=0;
+  for(vector<shared_ptr<Shard> >::const_iterator i=d_shards.begin(); i!=d_shards.end(); ++i) {
+    ShardLock l(*this, **i);
+    ret+=(*i)->nsSpeeds.size();
+  }
+  return ret;
+}
+
+SyncRes::NegCache::NegCache() : d_locked(false)
+{
+  d_shards.push_back(shared_ptr<Shard>(new Shard));
+}
+
+SyncRes::NegCache::NegCache(unsigned int shards) : d_locked(false)
+{
+  for(unsigned int n=0; n < max(shards, 1U); ++n)
+    d_shards.push_back(shared_ptr<Shard>(new Shard));
+}
+
+SyncRes::NegCache* SyncRes::NegCache::share() const
+{
+  NegCache* ret=new NegCache;
+  ret->d_shards=d_shards;
+  ret->d_locked=true;
+  return ret;
+}
+
+void SyncRes::NegCache::add(const NegCacheEntry& ne, time_t now)
+{
+  NegCacheEntry covering;
+  string parent(ne.d_name);
+  while(chopOffDotted(parent) && parent != ".")
+    if(getExact(parent, QType(0), now, &covering))
+      return;
+
+  Shard& shard=getShardFor(ne.d_name);
+  ShardLock l(*this, shard);
+  replacing_insert(shard.d_cache, ne);
+}
+
+//! a qtype of 0 finds only the NXDOMAIN of qname
+bool SyncRes::NegCache::getExact(const string& qname, const QType& qtype, time_t now, NegCacheEntry* ne)
+{
+  Shard& shard=getShardFor(qname);
+  ShardLock l(*this, shard);
+  pair<negcache_t::iterator, negcache_t::iterator> range=shard.d_cache.equal_range(tie(qname));
+  for(negcache_t::iterator ni=range.first; ni != range.second; ++ni) {
+    if(ni->d_qtype.getCode() == 0 || ni->d_qtype == qtype) {
+      if((uint32_t)now < ni->d_ttd) {
+        *ne=*ni;
+        moveCacheItemToBack(shard.d_cache, ni);
+        return true;
+      }
+      moveCacheItemToFront(shard.d_cache, ni);
+    }
+  }
+  return false;
+}
+
+bool SyncRes::NegCache::get(const string& qname, const QType& qtype, time_t now, NegCacheEntry* ne)
+{
+  if(getExact(qname, qtype, now, ne))
+    return true;
+
+  string parent(qname);
+  while(chopOffDotted(parent) && parent != ".")
+    if(getExact(parent, QType(0), now, ne))
+      return true;
+  return false;
+}
+
+uint64_t SyncRes::NegCache::wipe(const string& name)
+{
+  Shard& shard=getShardFor(name);
+  ShardLock l(*this, shard);
+  pair<negcache_t::iterator, negcache_t::iterator> range=shard.d_cache.equal_range(tie(name));
+  uint64_t ret=distance(range.first, range.second);
+  shard.d_cache.erase(range.first, range.second);
+  return ret;
+}
+
+void SyncRes::NegCache::clear()
+{
+  for(vector<shared_ptr<Shard> >::const_iterator i=d_shards.begin(); i!=d_shards.end(); ++i) {
+    ShardLock l(*this, **i);
+    (*i)->d_cache.clear();
+  }
+}
+
+void SyncRes::NegCache::prune(unsigned int maxEntries)
+{
+  for(vector<shared_ptr<Shard> >::const_iterator i=d_shards.begin(); i!=d_shards.end(); ++i) {
+    ShardLock l(*this, **i);
+    pruneCollection((*i)->d_cache, maxEntries / d_shards.size(), 200);
+  }
+}
+
+uint64_t SyncRes::NegCache::size()
+{
+  uint64_t ret=0;
+  for(vector<shared_ptr<Shard> >::const_iterator i=d_shards.begin(); i!=d_shards.end(); ++i) {
+    ShardLock l(*this, **i);
+    ret+=(*i)->d_cache.size();
+  }
+  return ret;
+}
+
 int SyncRes::asyncresolveWrapper(const ComboAddress& ip, const string& domain, int type, bool doTCP, bool sendRDQuery, struct timeval* now, LWResult* res) 
 {
   /* what is your QUEST?
@@ -277,8 +568,11 @@ int SyncRes::asyncresolveWrapper(const ComboAddress& ip, const string& domain, i
     return asyncresolve(ip, domain, type, doTCP, sendRDQuery, 0, now, res);
   }
 
-  SyncRes::EDNSStatus* ednsstatus;
-  ednsstatus = &t_sstorage->ednsstatus[ip];
+  /* we work on a copy, the table may be rehashed by other MThreads, or other threads, while we wait for the answer.
+     What we learn is only stored if nobody else learned something about this remote in the meantime */
+  const SyncRes::EDNSStatus was=t_sstorage->infra->getEDNSStatus(ip, d_now.tv_sec);
+  SyncRes::EDNSStatus status=was;
+  SyncRes::EDNSStatus* ednsstatus=&status;
 
   if(ednsstatus->modeSetAt && ednsstatus->modeSetAt + 3600 < d_now.tv_sec) {
     *ednsstatus=SyncRes::EDNSStatus();
@@ -310,7 +604,7 @@ int SyncRes::asyncresolveWrapper(const ComboAddress& ip, const string& domain, i
     ret=asyncresolve(ip, domain, type, doTCP, sendRDQuery, EDNSLevel, now, res);
     if(ret == 0 || ret < 0) {
       //      cerr<<"Transport error or timeout (ret="<<ret<<"), no change in mode"<<endl;
-      return ret;
+      break;
     }
 
     if(mode== EDNSStatus::CONFIRMEDPINGER) {  // confirmed pinger!
@@ -369,12 +663,14 @@ int SyncRes::asyncresolveWrapper(const ComboAddress& ip, const string& domain, i
       ednsstatus->modeSetAt=d_now.tv_sec;
     //        cerr<<"Result: ret="<<ret<<", EDNS-level: "<<EDNSLevel<<", haveEDNS: "<<res->d_haveEDNS<<", EDNS-PING correct: "<<res->d_pingCorrect<<", new mode: "<<mode<<endl;  
     
-    return ret;
+    break;
   }
+  if(!(status == was))
+    t_sstorage->infra->updateEDNSStatus(ip, was, status);
   return ret;
 }
 
-int SyncRes::doResolve(const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret, int depth, set<GetBestNSAnswer>& beenthere)
+int SyncRes::doResolve(const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret, int depth, beenthere_t& beenthere)
 {
   string prefix;
   if(s_log) {
@@ -383,8 +679,8 @@ int SyncRes::doResolve(const string &qname, const QType &qtype, vector<DNSResour
   }
   
   int res=0;
-  if(!(d_nocache && qtype.getCode()==QType::NS && qname==".")) {
-    if(d_cacheonly) { // very limited OOB support
+  if(!(d_nocache && qtype.getCode()==QType::NS && qname==".") && !(d_refresh && !depth)) {
+    if(d_cacheonly && !d_stale) { // very limited OOB support
       LWResult lwr;
       LOG<<prefix<<qname<<": Recursion not requested for '"<<qname<<"|"<<qtype.getName()<<"', peeking at auth/forward zones"<<endl;
       string authname(qname);
@@ -426,7 +722,7 @@ int SyncRes::doResolve(const string &qname, const QType &qtype, vector<DNSResour
 
   string subdomain(qname);
 
-  set<string, CIStringCompare> nsset;
+  nsset_t nsset(CIStringCompare(), &d_arena);
   bool flawedNSSet=false;
 
   // the two retries allow getBestNSNamesFromCache&co to reprime the root
@@ -453,7 +749,7 @@ static bool ipv6First(const ComboAddress& a, const ComboAddress& b)
 /** This function explicitly goes out for A addresses, but if configured to use IPv6 as well, will also return any IPv6 addresses in the cache
     Additionally, it will return the 'best' address up front, and the rest shuffled
 */
-vector<ComboAddress> SyncRes::getAs(const string &qname, int depth, set<GetBestNSAnswer>& beenthere)
+vector<ComboAddress> SyncRes::getAs(const string &qname, int depth, beenthere_t& beenthere)
 {
   typedef vector<DNSResourceRecord> res_t;
   res_t res;
@@ -473,14 +769,14 @@ vector<ComboAddress> SyncRes::getAs(const string &qname, int depth, set<GetBestN
     random_shuffle(ret.begin(), ret.end(), dns_random);
 
     // move 'best' address for this nameserver name up front
-    nsspeeds_t::iterator best = t_sstorage->nsSpeeds.find(qname);  
+    ComboAddress best;
 
-    if(best != t_sstorage->nsSpeeds.end())
+    if(t_sstorage->infra->getBestAddress(qname, &best))
       for(ret_t::iterator i=ret.begin(); i != ret.end(); ++i) {  
-        if(*i==best->second.d_best) {  // got the fastest one
+        if(*i==best) {  // got the fastest one
           if(i!=ret.begin()) {
             *i=*ret.begin();
-            *ret.begin()=best->second.d_best;
+            *ret.begin()=best;
           }
           break;
         }
@@ -490,7 +786,7 @@ vector<ComboAddress> SyncRes::getAs(const string &qname, int depth, set<GetBestN
   return ret;
 }
 
-void SyncRes::getBestNSFromCache(const string &qname, set<DNSResourceRecord>&bestns, bool* flawedNSSet, int depth, set<GetBestNSAnswer>& beenthere)
+void SyncRes::getBestNSFromCache(const string &qname, bestns_t&bestns, bool* flawedNSSet, int depth, beenthere_t& beenthere)
 {
   string prefix, subdomain(qname);
   if(s_log) {
@@ -529,12 +825,12 @@ void SyncRes::getBestNSFromCache(const string &qname, set<DNSResourceRecord>&bes
         }
       }
       if(!bestns.empty()) {
-        GetBestNSAnswer answer;
+        GetBestNSAnswer answer(&d_arena);
         answer.qname=qname; answer.bestns=bestns;
         if(beenthere.count(answer)) {
           LOG<<prefix<<qname<<": We have NS in cache for '"<<subdomain<<"' but part of LOOP! Trying less specific NS"<<endl;
           if(s_log)
-            for( set<GetBestNSAnswer>::const_iterator j=beenthere.begin();j!=beenthere.end();++j)
+            for( beenthere_t::const_iterator j=beenthere.begin();j!=beenthere.end();++j)
               LOG<<prefix<<qname<<": beenthere: "<<j->qname<<" ("<<(unsigned int)j->bestns.size()<<")"<<endl;
           bestns.clear();
         }
@@ -562,7 +858,7 @@ SyncRes::domainmap_t::const_iterator SyncRes::getBestAuthZone(string* qname)
 }
 
 /** doesn't actually do the work, leaves that to getBestNSFromCache */
-string SyncRes::getBestNSNamesFromCache(const string &qname, set<string, CIStringCompare>& nsset, bool* flawedNSSet, int depth, set<GetBestNSAnswer>&beenthere)
+string SyncRes::getBestNSNamesFromCache(const string &qname, nsset_t& nsset, bool* flawedNSSet, int depth, beenthere_t&beenthere)
 {
   string subdomain(qname);
   string authdomain(qname);
@@ -579,10 +875,10 @@ string SyncRes::getBestNSNamesFromCache(const string &qname, set<string, CIStrin
     return authdomain;
   }
 
-  set<DNSResourceRecord> bestns;
+  bestns_t bestns(std::less<DNSResourceRecord>(), &d_arena);
   getBestNSFromCache(subdomain, bestns, flawedNSSet, depth, beenthere);
 
-  for(set<DNSResourceRecord>::const_iterator k=bestns.begin();k!=bestns.end();++k) {
+  for(bestns_t::const_iterator k=bestns.begin();k!=bestns.end();++k) {
     nsset.insert(k->content);
     if(k==bestns.begin())
       subdomain=k->qname;
@@ -606,16 +902,18 @@ bool SyncRes::doCNAMECacheCheck(const string &qname, const QType &qtype, vector<
   
   LOG<<prefix<<qname<<": Looking for CNAME cache hit of '"<<(qname+"|CNAME")<<"'"<<endl;
   set<DNSResourceRecord> cset;
-  if(t_RC->get(d_now.tv_sec, qname,QType(QType::CNAME),&cset) > 0) {
+  uint32_t origTTL;
+  if(t_RC->get(d_now.tv_sec, qname,QType(QType::CNAME),&cset, &origTTL) > 0) {
 
     for(set<DNSResourceRecord>::const_iterator j=cset.begin();j!=cset.end();++j) {
       if(j->ttl>(unsigned int) d_now.tv_sec) {
+        checkRefreshAhead(qname, QType(QType::CNAME), origTTL, j->ttl - d_now.tv_sec);
         LOG<<prefix<<qname<<": Found cache CNAME hit for '"<< (qname+"|CNAME") <<"' to '"<<j->content<<"'"<<endl;    
         DNSResourceRecord rr=*j;
         rr.ttl-=d_now.tv_sec;
         ret.push_back(rr);
         if(!(qtype==QType(QType::CNAME))) { // perhaps they really wanted a CNAME!
-          set<GetBestNSAnswer>beenthere;
+          beenthere_t beenthere(std::less<GetBestNSAnswer>(), &d_arena);
           res=doResolve(j->content, qtype, ret, depth+1, beenthere);
         }
         else
@@ -631,6 +929,18 @@ bool SyncRes::doCNAMECacheCheck(const string &qname, const QType &qtype, vector<
 
 
 
+/* Remembers the first cache hit that has less than s_refreshAhead percent of its original TTL left, so
+   startDoResolve() can have it refreshed in the background before it expires */
+void SyncRes::checkRefreshAhead(const string& qname, const QType& qtype, uint32_t origTTL, uint32_t ttl)
+{
+  if(!s_refreshAhead || d_refresh || !d_refreshQname.empty() || !origTTL)
+    return;
+  if((uint64_t)ttl * 100 < (uint64_t)origTTL * s_refreshAhead) {
+    d_refreshQname=qname;
+    d_refreshQtype=qtype;
+  }
+}
+
 bool SyncRes::doCacheCheck(const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret, int depth, int &res)
 {
   bool giveNegative=false;
@@ -646,39 +956,28 @@ bool SyncRes::doCacheCheck(const string &qname, const QType &qtype, vector<DNSRe
   uint32_t sttl=0;
   //  cout<<"Lookup for '"<<qname<<"|"<<qtype.getName()<<"'\n";
   
-  pair<negcache_t::const_iterator, negcache_t::const_iterator> range=t_sstorage->negcache.equal_range(tie(qname));
-  negcache_t::iterator ni;
-  for(ni=range.first; ni != range.second; ni++) {
-    // we have something
-    if(ni->d_qtype.getCode() == 0 || ni->d_qtype == qtype) {
-      res=0;
-      if((uint32_t)d_now.tv_sec < ni->d_ttd) {
-        sttl=ni->d_ttd - d_now.tv_sec;
-        if(ni->d_qtype.getCode()) {
-          LOG<<prefix<<qname<<": "<<qtype.getName()<<" is negatively cached via '"<<ni->d_qname<<"' for another "<<sttl<<" seconds"<<endl;
-          res = RCode::NoError;
-        }
-        else {
-          LOG<<prefix<<qname<<": Entire record '"<<qname<<"', is negatively cached via '"<<ni->d_qname<<"' for another "<<sttl<<" seconds"<<endl;
-          res= RCode::NXDomain; 
-        }
-        giveNegative=true;
-        sqname=ni->d_qname;
-        sqt=QType::SOA;
-        moveCacheItemToBack(t_sstorage->negcache, ni);
-        break;
-      }
-      else {
-        LOG<<prefix<<qname<<": Entire record '"<<qname<<"' or type was negatively cached, but entry expired"<<endl;
-        moveCacheItemToFront(t_sstorage->negcache, ni);
-      }
+  NegCacheEntry ne;
+  if(t_sstorage->negcache->get(qname, qtype, d_now.tv_sec, &ne)) {
+    res=0;
+    sttl=ne.d_ttd - d_now.tv_sec;
+    if(ne.d_qtype.getCode()) {
+      LOG<<prefix<<qname<<": "<<qtype.getName()<<" is negatively cached via '"<<ne.d_qname<<"' for another "<<sttl<<" seconds"<<endl;
+      res = RCode::NoError;
+    }
+    else {
+      LOG<<prefix<<qname<<": Entire record '"<<ne.d_name<<"', is negatively cached via '"<<ne.d_qname<<"' for another "<<sttl<<" seconds"<<endl;
+      res= RCode::NXDomain; 
     }
+    giveNegative=true;
+    sqname=ne.d_qname;
+    sqt=QType::SOA;
   }
 
   set<DNSResourceRecord> cset;
   bool found=false, expired=false;
+  uint32_t origTTL, minTTL=std::numeric_limits<uint32_t>::max();
 
-  if(t_RC->get(d_now.tv_sec, sqname, sqt, &cset) > 0) {
+  if(t_RC->get(d_now.tv_sec, sqname, sqt, &cset, &origTTL) > 0) {
     LOG<<prefix<<sqname<<": Found cache hit for "<<sqt.getName()<<": ";
     for(set<DNSResourceRecord>::const_iterator j=cset.begin();j!=cset.end();++j) {
       LOG<<j->content;
@@ -691,6 +990,7 @@ bool SyncRes::doCacheCheck(const string &qname, const QType &qtype, vector<DNSRe
         }
         ret.push_back(rr);
         LOG<<"[ttl="<<rr.ttl<<"] ";
+        minTTL=min(minTTL, j->ttl - (uint32_t)d_now.tv_sec);
         found=true;
       }
       else {
@@ -701,8 +1001,15 @@ bool SyncRes::doCacheCheck(const string &qname, const QType &qtype, vector<DNSRe
   
     LOG<<endl;
     if(found && !expired) {
-      if(!giveNegative)
+      if(!giveNegative) {
         res=0;
+        checkRefreshAhead(sqname, sqt, origTTL, minTTL);
+      }
+      else {
+        s_negcachehits++;
+        if(!pdns_iequals(ne.d_name, qname))
+          s_negcacheparenthits++;
+      }
       return true;
     }
     else
@@ -726,26 +1033,28 @@ bool SyncRes::moreSpecificThan(const string& a, const string &b)
   return counta>countb;
 }
 
+typedef map<string, double, std::less<string>, ArenaAllocator<pair<const string, double> > > speeds_t;
+
 struct speedOrder
 {
-  speedOrder(map<string,double> &speeds) : d_speeds(speeds) {}
+  speedOrder(speeds_t &speeds) : d_speeds(speeds) {}
   bool operator()(const string &a, const string &b) const
   {
     return d_speeds[a] < d_speeds[b];
   }
-  map<string,double>& d_speeds;
+  speeds_t& d_speeds;
 };
 
-inline vector<string> SyncRes::shuffleInSpeedOrder(set<string, CIStringCompare> &nameservers, const string &prefix)
+inline vector<string> SyncRes::shuffleInSpeedOrder(nsset_t &nameservers, const string &prefix)
 {
   vector<string> rnameservers;
   rnameservers.reserve(nameservers.size());
-  map<string,double> speeds;
+  speeds_t speeds(std::less<string>(), &d_arena);
 
-  for(set<string, CIStringCompare>::const_iterator i=nameservers.begin();i!=nameservers.end();++i) {
+  for(nsset_t::const_iterator i=nameservers.begin();i!=nameservers.end();++i) {
     rnameservers.push_back(*i);
     double speed;
-    speed=t_sstorage->nsSpeeds[*i].get(&d_now);
+    speed=t_sstorage->infra->getSpeed(*i, &d_now);
     speeds[*i]=speed;
   }
   random_shuffle(rnameservers.begin(),rnameservers.end(), dns_random);
@@ -790,9 +1099,9 @@ static bool magicAddrMatch(const QType& query, const QType& answer)
 double g_avgLatency;
 
 /** returns -1 in case of no results, rcode otherwise */
-int SyncRes::doResolveAt(set<string, CIStringCompare> nameservers, string auth, bool flawedNSSet, const string &qname, const QType &qtype, 
+int SyncRes::doResolveAt(nsset_t nameservers, string auth, bool flawedNSSet, const string &qname, const QType &qtype, 
         		 vector<DNSResourceRecord>&ret, 
-        		 int depth, set<GetBestNSAnswer>&beenthere)
+        		 int depth, beenthere_t&beenthere)
 {
   string prefix;
   if(s_log) {
@@ -875,7 +1184,7 @@ int SyncRes::doResolveAt(set<string, CIStringCompare> nameservers, string auth,
           LOG<<prefix<<qname<<": Trying IP "<< remoteIP->toStringWithPort() <<", asking '"<<qname<<"|"<<qtype.getName()<<"'"<<endl;
           extern NetmaskGroup* g_dontQuery;
           
-          if(t_sstorage->throttle.shouldThrottle(d_now.tv_sec, make_tuple(*remoteIP, qname, qtype.getCode()))) {
+          if(t_sstorage->infra->shouldThrottle(d_now.tv_sec, make_tuple(*remoteIP, qname, qtype.getCode()))) {
             LOG<<prefix<<qname<<": query throttled "<<endl;
             s_throttledqueries++; d_throttledqueries++;
             continue;
@@ -914,12 +1223,12 @@ int SyncRes::doResolveAt(set<string, CIStringCompare> nameservers, string auth,
               if(resolveret!=-2) { // don't account for resource limits, they are our own fault
         	{
         	  
-        	  t_sstorage->nsSpeeds[*tns].submit(*remoteIP, 1000000, &d_now); // 1 sec
+        	  t_sstorage->infra->submitSpeed(*tns, *remoteIP, 1000000, &d_now); // 1 sec
         	}
         	if(resolveret==-1)
-        	  t_sstorage->throttle.throttle(d_now.tv_sec, make_tuple(*remoteIP, qname, qtype.getCode()), 60, 100); // unreachable, 1 minute or 100 queries
+        	  t_sstorage->infra->throttle(d_now.tv_sec, make_tuple(*remoteIP, qname, qtype.getCode()), 60, 100); // unreachable, 1 minute or 100 queries
         	else
-        	  t_sstorage->throttle.throttle(d_now.tv_sec, make_tuple(*remoteIP, qname, qtype.getCode()), 10, 5);  // timeout
+        	  t_sstorage->infra->throttle(d_now.tv_sec, make_tuple(*remoteIP, qname, qtype.getCode()), 10, 5);  // timeout
               }
               continue;
             }
@@ -927,7 +1236,7 @@ int SyncRes::doResolveAt(set<string, CIStringCompare> nameservers, string auth,
             break;  // this IP address worked!
           wasLame:; // well, it didn't
             LOG<<prefix<<qname<<": status=NS "<<*tns<<" ("<< remoteIP->toString() <<") is lame for '"<<auth<<"', trying sibling IP or NS"<<endl;
-            t_sstorage->throttle.throttle(d_now.tv_sec, make_tuple(*remoteIP, qname, qtype.getCode()), 60, 100); // lame
+            t_sstorage->infra->throttle(d_now.tv_sec, make_tuple(*remoteIP, qname, qtype.getCode()), 60, 100); // lame
           }
         }
         
@@ -946,7 +1255,7 @@ int SyncRes::doResolveAt(set<string, CIStringCompare> nameservers, string auth,
         
         if(lwr.d_rcode==RCode::ServFail) {
           LOG<<prefix<<qname<<": "<<*tns<<" returned a ServFail, trying sibling IP or NS"<<endl;
-          t_sstorage->throttle.throttle(d_now.tv_sec,make_tuple(*remoteIP, qname, qtype.getCode()),60,3); // servfail
+          t_sstorage->infra->throttle(d_now.tv_sec,make_tuple(*remoteIP, qname, qtype.getCode()),60,3); // servfail
           continue;
         }
         LOG<<prefix<<qname<<": Got "<<(unsigned int)lwr.d_result.size()<<" answers from "<<*tns<<" ("<< remoteIP->toString() <<"), rcode="<<lwr.d_rcode<<", in "<<lwr.d_usec/1000<<"ms"<<endl;
@@ -959,7 +1268,7 @@ int SyncRes::doResolveAt(set<string, CIStringCompare> nameservers, string auth,
         double fract = 0.001;
         g_avgLatency = (1-fract) * g_avgLatency + fract * lwr.d_usec;
 
-        t_sstorage->nsSpeeds[*tns].submit(*remoteIP, lwr.d_usec, &d_now);
+        t_sstorage->infra->submitSpeed(*tns, *remoteIP, lwr.d_usec, &d_now);
       }
 
       typedef map<pair<string, QType>, set<DNSResourceRecord>, TCacheComp > tcache_t;
@@ -1016,7 +1325,7 @@ int SyncRes::doResolveAt(set<string, CIStringCompare> nameservers, string auth,
 
         t_RC->replace(d_now.tv_sec, i->first.first, i->first.second, i->second, lwr.d_aabit);
       }
-      set<string, CIStringCompare> nsset;  
+      nsset_t nsset(CIStringCompare(), &d_arena);
       LOG<<prefix<<qname<<": determining status after receiving this packet"<<endl;
 
       bool done=false, realreferral=false, negindic=false;
@@ -1039,7 +1348,8 @@ int SyncRes::doResolveAt(set<string, CIStringCompare> nameservers, string auth,
           ne.d_name=qname;
           ne.d_qtype=QType(0); // this encodes 'whole record'
           
-          replacing_insert(t_sstorage->negcache, ne);
+          if(newtarget.empty()) // otherwise it is the target of the CNAME that does not exist, and all below it
+            t_sstorage->negcache->add(ne, d_now.tv_sec);
           
           negindic=true;
         }
@@ -1086,7 +1396,7 @@ int SyncRes::doResolveAt(set<string, CIStringCompare> nameservers, string auth,
             ne.d_name=qname;
             ne.d_qtype=qtype;
             if(qtype.getCode()) {  // prevents us from blacking out a whole domain
-              replacing_insert(t_sstorage->negcache, ne);
+              t_sstorage->negcache->add(ne, d_now.tv_sec);
             }
             negindic=true;
           }
@@ -1108,7 +1418,7 @@ int SyncRes::doResolveAt(set<string, CIStringCompare> nameservers, string auth,
         }
         LOG<<prefix<<qname<<": status=got a CNAME referral, starting over with "<<newtarget<<endl;
 
-        set<GetBestNSAnswer> beenthere2;
+        beenthere_t beenthere2(std::less<GetBestNSAnswer>(), &d_arena);
         return doResolve(newtarget, qtype, ret, depth + 1, beenthere2);
       }
       if(lwr.d_rcode==RCode::NXDomain) {
@@ -1155,7 +1465,7 @@ void SyncRes::addCruft(const string &qname, vector<DNSResourceRecord>& ret)
     if( (k->d_place==DNSResourceRecord::ANSWER && (k->qtype==QType(QType::MX) || k->qtype==QType(QType::SRV)))  || 
        ((k->d_place==DNSResourceRecord::AUTHORITY || k->d_place==DNSResourceRecord::ANSWER) && k->qtype==QType(QType::NS))) {
       LOG<<d_prefix<<qname<<": record '"<<k->content<<"|"<<k->qtype.getName()<<"' needs IP for additional processing"<<endl;
-      set<GetBestNSAnswer> beenthere;
+      beenthere_t beenthere(std::less<GetBestNSAnswer>(), &d_arena);
       vector<pair<string::size_type, string::size_type> > fields;
       vstringtok(fields, k->content, " ");
       string host;
@@ -1185,12 +1495,12 @@ void SyncRes::addCruft(const string &qname, vector<DNSResourceRecord>& ret)
 
 void SyncRes::addAuthorityRecords(const string& qname, vector<DNSResourceRecord>& ret, int depth)
 {
-  set<DNSResourceRecord> bestns;
-  set<GetBestNSAnswer> beenthere;
+  bestns_t bestns(std::less<DNSResourceRecord>(), &d_arena);
+  beenthere_t beenthere(std::less<GetBestNSAnswer>(), &d_arena);
   bool dontcare;
   getBestNSFromCache(qname, bestns, &dontcare, depth, beenthere);
 
-  for(set<DNSResourceRecord>::const_iterator k=bestns.begin();k!=bestns.end();++k) {
+  for(bestns_t::const_iterator k=bestns.begin();k!=bestns.end();++k) {
     DNSResourceRecord ns=*k;
     ns.d_place=DNSResourceRecord::AUTHORITY;
     ns.ttl-=d_now.tv_sec;
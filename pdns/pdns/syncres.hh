@@ -19,6 +19,8 @@
 #include <boost/optional.hpp>
 #include <boost/tuple/tuple_comparison.hpp>
 #include "mtasker.hh"
+#include "arena.hh"
+#include "openhash.hh"
 #include "iputils.hh"
 
 void primeHints(void);
@@ -36,29 +38,18 @@ struct NegCacheEntry
 };
 
 
-template<class Thing> class Throttle : public boost::noncopyable
+/* Remembers remotes that failed us. Every new entry pays for a little of the cleaning, so expired entries go
+   without ever scanning the whole table on the query path */
+template<class Thing, class Hash> class Throttle : public boost::noncopyable
 {
 public:
   Throttle()
   {
     d_limit=3;
     d_ttl=60;
-    d_last_clean=time(0);
   }
   bool shouldThrottle(time_t now, const Thing& t)
   {
-    if(now > d_last_clean + 300 ) {
-
-      d_last_clean=now;
-      for(typename cont_t::iterator i=d_cont.begin();i!=d_cont.end();) {
-        if( i->second.ttd < now) {
-          d_cont.erase(i++);
-        }
-        else
-          ++i;
-      }
-    }
-
     typename cont_t::iterator i=d_cont.find(t);
     if(i==d_cont.end())
       return false;
@@ -71,14 +62,12 @@ public:
   }
   void throttle(time_t now, const Thing& t, unsigned int ttl=0, unsigned int tries=0) 
   {
-    typename cont_t::iterator i=d_cont.find(t);
-    entry e={ now+(ttl ? ttl : d_ttl), tries ? tries : d_limit};
+    d_cont.expire(4, Expired(now));
 
-    if(i==d_cont.end()) {
-      d_cont[t]=e;
-    } 
-    else if(i->second.ttd > e.ttd || (i->second.count) < e.count) 
-      d_cont[t]=e;
+    entry e={ now+(ttl ? ttl : d_ttl), tries ? tries : d_limit};
+    pair<typename cont_t::iterator, bool> res=d_cont.insert(make_pair(t, e));
+    if(!res.second && (res.first->second.ttd > e.ttd || (res.first->second.count) < e.count)) 
+      res.first->second=e;
   }
   
   unsigned int size()
@@ -88,14 +77,57 @@ public:
 private:
   int d_limit;
   int d_ttl;
-  time_t d_last_clean;
   struct entry 
   {
     time_t ttd;
     int count;
   };
-  typedef map<Thing,entry> cont_t;
+  typedef OpenHashMap<Thing, entry, Hash> cont_t;
   cont_t d_cont;
+
+  struct Expired
+  {
+    explicit Expired(time_t now) : d_now(now)
+    {}
+    bool operator()(const typename cont_t::value_type& v) const
+    {
+      return v.second.ttd < d_now;
+    }
+    time_t d_now;
+  };
+};
+
+struct CIStringHash : public std::unary_function<string, size_t>
+{
+  size_t operator()(const string& a) const
+  {
+    return pdns_ihash(a);
+  }
+};
+
+struct CIStringEqual : public std::binary_function<string, string, bool>
+{
+  bool operator()(const string& a, const string& b) const
+  {
+    return pdns_iequals(a, b);
+  }
+};
+
+struct ComboAddressHash : public std::unary_function<ComboAddress, size_t>
+{
+  size_t operator()(const ComboAddress& a) const
+  {
+    return a.hash();
+  }
+};
+
+//! hashing the name without case agrees with the case sensitive comparison of the tuple
+struct ThrottleKeyHash : public std::unary_function<tuple<ComboAddress,string,uint16_t>, size_t>
+{
+  size_t operator()(const tuple<ComboAddress,string,uint16_t>& a) const
+  {
+    return a.get<0>().hash(pdns_hashmix(pdns_ihash(a.get<1>()), a.get<2>()));
+  }
 };
 
 
@@ -158,6 +190,18 @@ public:
     return limit > d_lastget.tv_sec;
   }
 
+  //! for cache snapshots: the average as of the last get(), and a way to put it back
+  float peek() const
+  {
+    return d_val;
+  }
+  void restore(float val, const struct timeval& now)
+  {
+    d_val=val;
+    d_last=d_lastget=now;
+    d_needinit=false;
+  }
+
 private:
   struct timeval d_last;          // stores time
   struct timeval d_lastget;       // stores time
@@ -172,6 +216,7 @@ public:
   explicit SyncRes(const struct timeval& now);
 
   int beginResolve(const string &qname, const QType &qtype, uint16_t qclass, vector<DNSResourceRecord>&ret);
+  bool getCachedWireAnswer(const string &qname, const QType &qtype, uint16_t qclass, vector<MemRecursorCache::WireRecord>& ret);
   void setId(int id)
   {
     if(s_log)
@@ -190,6 +235,19 @@ public:
     d_nocache=state;
   }
 
+  //! answer from the cache only, as it was 'seconds' ago, so records that expired since then are still good
+  void setServeStale(unsigned int seconds)
+  {
+    d_now.tv_sec-=seconds;
+    d_cacheonly=d_stale=true;
+  }
+
+  //! refresh the question asked from the authoritatives, even if it is in the cache
+  void setRefresh(bool state=true)
+  {
+    d_refresh=state;
+  }
+
   void setDoEDNS0(bool state=true)
   {
     d_doEDNS0=state;
@@ -207,6 +265,8 @@ public:
   static unsigned int s_tcpoutqueries;
   static unsigned int s_nodelegated;
   static unsigned int s_unreachables;
+  static unsigned int s_negcachehits;
+  static unsigned int s_negcacheparenthits;
   static bool s_doAAAAAdditionalProcessing;
   static bool s_doAdditionalProcessing;
   static bool s_doIPv6;
@@ -283,7 +343,7 @@ public:
     ComboAddress d_best;
   };
 
-  typedef map<string, DecayingEwmaCollection, CIStringCompare> nsspeeds_t;
+  typedef OpenHashMap<string, DecayingEwmaCollection, CIStringHash, CIStringEqual> nsspeeds_t;
   
 
   struct EDNSStatus
@@ -292,9 +352,13 @@ public:
     enum EDNSMode { CONFIRMEDPINGER=-1, UNKNOWN=0, EDNSNOPING=1, EDNSPINGOK=2, EDNSIGNORANT=3, NOEDNS=4 } mode;
     time_t modeSetAt;
     int EDNSPingHitCount;
+    bool operator==(const EDNSStatus& rhs) const
+    {
+      return mode == rhs.mode && modeSetAt == rhs.modeSetAt && EDNSPingHitCount == rhs.EDNSPingHitCount;
+    }
   };
 
-  typedef map<ComboAddress, EDNSStatus> ednsstatus_t;
+  typedef OpenHashMap<ComboAddress, EDNSStatus, ComboAddressHash> ednsstatus_t;
 
   
 
@@ -324,9 +388,168 @@ public:
   typedef map<string, AuthDomain, CIStringCompare> domainmap_t;
   
 
-  typedef Throttle<tuple<ComboAddress,string,uint16_t> > throttle_t;
+  typedef tuple<ComboAddress,string,uint16_t> throttlekey_t;
+  typedef Throttle<throttlekey_t, ThrottleKeyHash> throttle_t;
+
+  /* What we know about the authoritative servers: who is throttled, how fast they answer and what they make of
+     EDNS. Normally each thread has its own. One constructed with a number of shards can be share()d, all threads
+     then see the same state, striped over locks by the hash of the key. That way a server one thread found dead is
+     not tried again by the others, and an RTT measured by one thread is used by all */
+  class InfraCache : public boost::noncopyable
+  {
+  public:
+    InfraCache();
+    explicit InfraCache(unsigned int shards);
+    InfraCache* share() const;
+    bool isShared() const
+    {
+      return d_locked;
+    }
+
+    bool shouldThrottle(time_t now, const throttlekey_t& t);
+    void throttle(time_t now, const throttlekey_t& t, unsigned int ttl, unsigned int tries);
+
+    void submitSpeed(const string& nsname, const ComboAddress& remote, int usecs, struct timeval* now);
+    double getSpeed(const string& nsname, struct timeval* now);
+    //! the fastest address of nsname as of the last getSpeed()
+    bool getBestAddress(const string& nsname, ComboAddress* best);
+    void setSpeeds(const string& nsname, const DecayingEwmaCollection& dec);
+    void pruneSpeeds(time_t limit);
+
+    EDNSStatus getEDNSStatus(const ComboAddress& remote, time_t now);
+    //! stores status, unless the entry is no longer what we read as 'was': whoever changed it in the meantime knows better
+    void updateEDNSStatus(const ComboAddress& remote, const EDNSStatus& was, const EDNSStatus& status);
+
+    uint64_t throttleSize();
+    uint64_t nsSpeedsSize();
+
+    struct Shard : public boost::noncopyable
+    {
+      Shard()
+      {
+        pthread_mutex_init(&d_mutex, 0);
+      }
+      throttle_t throttle;
+      nsspeeds_t nsSpeeds;
+      ednsstatus_t ednsstatus;
+      pthread_mutex_t d_mutex;
+    };
+
+    //! locks a shard, but only if it is shared with other threads
+    class ShardLock : public boost::noncopyable
+    {
+    public:
+      ShardLock(const InfraCache& ic, Shard& shard) : d_mutex(ic.d_locked ? &shard.d_mutex : 0)
+      {
+        if(d_mutex)
+          pthread_mutex_lock(d_mutex);
+      }
+      ~ShardLock()
+      {
+        if(d_mutex)
+          pthread_mutex_unlock(d_mutex);
+      }
+    private:
+      pthread_mutex_t* d_mutex;
+    };
+
+    //! for dumps and snapshots, which walk all shards, each under a ShardLock
+    unsigned int numShards() const
+    {
+      return d_shards.size();
+    }
+    Shard& getShard(unsigned int n)
+    {
+      return *d_shards[n];
+    }
+
+  private:
+    Shard& getShardFor(uint32_t hash)
+    {
+      return *d_shards[d_shards.size()==1 ? 0 : hash % d_shards.size()];
+    }
+
+    vector<shared_ptr<Shard> > d_shards;
+    bool d_locked;
+  };
+
+  /* Names and types that do not exist. An NXDOMAIN is kept at the name that was denied, and stands for everything
+     below that name as well (RFC 8020), so a query for a name under a nonexistent one is answered from here without
+     asking anyone. Entries below a name we already know to be nonexistent add nothing, and are not stored.
+     Like the InfraCache, one constructed with a number of shards can be share()d between threads */
+  class NegCache : public boost::noncopyable
+  {
+  public:
+    NegCache();
+    explicit NegCache(unsigned int shards);
+    NegCache* share() const;
+    bool isShared() const
+    {
+      return d_locked;
+    }
+
+    void add(const NegCacheEntry& ne, time_t now);
+    /** finds what says qname|qtype does not exist: an entry for qname itself, or the NXDOMAIN of a name above it.
+        In the latter case ne->d_name is that name */
+    bool get(const string& qname, const QType& qtype, time_t now, NegCacheEntry* ne);
+    //! removes the entries for name itself, returns how many there were
+    uint64_t wipe(const string& name);
+    void clear();
+    //! trims each shard to its part of maxEntries, expired entries first
+    void prune(unsigned int maxEntries);
+    uint64_t size();
+
+    struct Shard : public boost::noncopyable
+    {
+      Shard()
+      {
+        pthread_mutex_init(&d_mutex, 0);
+      }
+      negcache_t d_cache;
+      pthread_mutex_t d_mutex;
+    };
+
+    class ShardLock : public boost::noncopyable
+    {
+    public:
+      ShardLock(const NegCache& nc, Shard& shard) : d_mutex(nc.d_locked ? &shard.d_mutex : 0)
+      {
+        if(d_mutex)
+          pthread_mutex_lock(d_mutex);
+      }
+      ~ShardLock()
+      {
+        if(d_mutex)
+          pthread_mutex_unlock(d_mutex);
+      }
+    private:
+      pthread_mutex_t* d_mutex;
+    };
+
+    unsigned int numShards() const
+    {
+      return d_shards.size();
+    }
+    Shard& getShard(unsigned int n)
+    {
+      return *d_shards[n];
+    }
+
+  private:
+    Shard& getShardFor(const string& name)
+    {
+      return *d_shards[d_shards.size()==1 ? 0 : pdns_ihash(name) % d_shards.size()];
+    }
+    bool getExact(const string& qname, const QType& qtype, time_t now, NegCacheEntry* ne);
+
+    vector<shared_ptr<Shard> > d_shards;
+    bool d_locked;
+  };
   
   struct timeval d_now;
+  string d_refreshQname; // if set, a cache hit in the last s_refreshAhead percent of its TTL, worth refreshing
+  QType d_refreshQtype;
+  static unsigned int s_refreshAhead;
   static unsigned int s_maxnegttl;
   static unsigned int s_maxcachettl;
   static unsigned int s_packetcachettl;
@@ -335,42 +558,51 @@ public:
   static string s_serverID;
 
   struct StaticStorage {
-    negcache_t negcache;    
-    nsspeeds_t nsSpeeds;
-    ednsstatus_t ednsstatus;
-    throttle_t throttle;
+    NegCache* negcache;
+    InfraCache* infra;
     domainmap_t* domainmap;
   };
 
 private:
   struct GetBestNSAnswer;
-  int doResolveAt(set<string, CIStringCompare> nameservers, string auth, bool flawedNSSet, const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret,
-        	  int depth, set<GetBestNSAnswer>&beenthere);
-  int doResolve(const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret, int depth, set<GetBestNSAnswer>& beenthere);
+  // the bookkeeping of a resolution comes from d_arena, and goes when we do
+  typedef set<string, CIStringCompare, ArenaAllocator<string> > nsset_t;
+  typedef set<DNSResourceRecord, std::less<DNSResourceRecord>, ArenaAllocator<DNSResourceRecord> > bestns_t;
+  typedef set<GetBestNSAnswer, std::less<GetBestNSAnswer>, ArenaAllocator<GetBestNSAnswer> > beenthere_t;
+
+  int doResolveAt(nsset_t nameservers, string auth, bool flawedNSSet, const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret,
+        	  int depth, beenthere_t&beenthere);
+  int doResolve(const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret, int depth, beenthere_t& beenthere);
   bool doOOBResolve(const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret, int depth, int &res);
   domainmap_t::const_iterator getBestAuthZone(string* qname);
   bool doCNAMECacheCheck(const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret, int depth, int &res);
   bool doCacheCheck(const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret, int depth, int &res);
-  void getBestNSFromCache(const string &qname, set<DNSResourceRecord>&bestns, bool* flawedNSSet, int depth, set<GetBestNSAnswer>& beenthere);
+  void getBestNSFromCache(const string &qname, bestns_t&bestns, bool* flawedNSSet, int depth, beenthere_t& beenthere);
   void addCruft(const string &qname, vector<DNSResourceRecord>& ret);
-  string getBestNSNamesFromCache(const string &qname,set<string, CIStringCompare>& nsset, bool* flawedNSSet, int depth, set<GetBestNSAnswer>&beenthere);
+  string getBestNSNamesFromCache(const string &qname,nsset_t& nsset, bool* flawedNSSet, int depth, beenthere_t&beenthere);
   void addAuthorityRecords(const string& qname, vector<DNSResourceRecord>& ret, int depth);
+  void checkRefreshAhead(const string& qname, const QType& qtype, uint32_t origTTL, uint32_t ttl);
 
-  inline vector<string> shuffleInSpeedOrder(set<string, CIStringCompare> &nameservers, const string &prefix);
+  inline vector<string> shuffleInSpeedOrder(nsset_t &nameservers, const string &prefix);
   bool moreSpecificThan(const string& a, const string &b);
-  vector<ComboAddress> getAs(const string &qname, int depth, set<GetBestNSAnswer>& beenthere);
+  vector<ComboAddress> getAs(const string &qname, int depth, beenthere_t& beenthere);
 
 private:
   string d_prefix;
   static bool s_log;
   bool d_cacheonly;
   bool d_nocache;
+  bool d_refresh;
+  bool d_stale;
   bool d_doEDNS0;
+  MonotonicArena d_arena;
 
   struct GetBestNSAnswer
   {
+    explicit GetBestNSAnswer(MonotonicArena* arena) : bestns(std::less<DNSResourceRecord>(), arena)
+    {}
     string qname;
-    set<DNSResourceRecord> bestns;
+    bestns_t bestns;
     bool operator<(const GetBestNSAnswer &b) const
     {
       if(qname<b.qname)
@@ -392,7 +624,7 @@ int arecvtcp(string& data, int len, Socket* sock);
 
 struct PacketID
 {
-  PacketID() : id(0), type(0), sock(0), inNeeded(0), outPos(0), nearMisses(0), fd(-1)
+  PacketID() : id(0), type(0), ednsLevel(0), sock(0), inNeeded(0), outPos(0), nearMisses(0), fd(-1)
   {
     memset(&remote, 0, sizeof(remote));
   }
@@ -401,6 +633,8 @@ struct PacketID
   ComboAddress remote;  // this is the remote
   string domain;             // this is the question 
   uint16_t type;             // and this is its type
+  int ednsLevel;             // as passed to asyncresolve, only identical queries get chained
+  string ping;               // the EDNS PING nonce we sent, if any, so chained queries can check it too
 
   Socket* sock;  // or wait for an event on a TCP fd
   int inNeeded; // if this is set, we'll read until inNeeded bytes are read
@@ -430,25 +664,55 @@ struct PacketID
 
     return tie(fd, id) < tie(b.fd, b.id);
   }
+
+  bool operator==(const PacketID& b) const
+  {
+    return birthdayEquals(b) && fd == b.fd && id == b.id;
+  }
+
+  //! same question to the same remote, whatever the id and socket used
+  bool birthdayEquals(const PacketID& b) const
+  {
+    int ourSock= sock ? sock->getHandle() : 0;
+    int bSock = b.sock ? b.sock->getHandle() : 0;
+    return remote == b.remote && ourSock == bSock && type == b.type && pdns_iequals(domain, b.domain);
+  }
+
+  uint32_t birthdayHash() const
+  {
+    uint32_t ret=pdns_ihash(domain);
+    ret=pdns_hashmix(ret, type | ((uint32_t)(sock ? sock->getHandle() : 0) << 16));
+    return remote.hash(ret);
+  }
 };
 
-struct PacketIDBirthdayCompare: public std::binary_function<PacketID, PacketID, bool>  
+inline size_t hash_value(const PacketID& pid)
 {
-  bool operator()(const PacketID& a, const PacketID& b) const
+  return pdns_hashmix(pid.birthdayHash(), pid.id | ((uint32_t)pid.fd << 16));
+}
+
+//! finds outstanding queries that an identical new one can be chained onto
+struct PacketIDBirthdayHash: public std::unary_function<PacketID, size_t>
+{
+  size_t operator()(const PacketID& a) const
   {
-    int ourSock= a.sock ? a.sock->getHandle() : 0;
-    int bSock = b.sock ? b.sock->getHandle() : 0;
-    if( tie(a.remote, ourSock, a.type) < tie(b.remote, bSock, b.type))
-      return true;
-    if( tie(a.remote, ourSock, a.type) > tie(b.remote, bSock, b.type))
-      return false;
+    return a.birthdayHash();
+  }
+};
 
-    return pdns_ilexicographical_compare(a.domain, b.domain);
+struct PacketIDBirthdayEqual: public std::binary_function<PacketID, PacketID, bool>
+{
+  bool operator()(const PacketID& a, const PacketID& b) const
+  {
+    return a.birthdayEquals(b);
   }
 };
 extern __thread MemRecursorCache* t_RC;
+extern MemRecursorCache* g_sharedRC;
+extern SyncRes::InfraCache* g_sharedInfra;
+extern SyncRes::NegCache* g_sharedNegCache;
 extern __thread RecursorPacketCache* t_packetCache;
-typedef MTasker<PacketID,string> MT_t;
+typedef MTasker<PacketID,string,PacketIDBirthdayHash,PacketIDBirthdayEqual> MT_t;
 extern __thread MT_t* MT;
 
 
@@ -479,6 +743,9 @@ struct RecursorStats
   uint64_t noPingOutQueries, noEdnsOutQueries;
   uint64_t packetCacheHits;
   uint64_t noPacketError;
+  uint64_t cacheRefreshes;
+  uint64_t staleAnswers;
+  uint64_t outgoingSocketsOpened, outgoingSocketsClosed;
   time_t startupTime;
   unsigned int maxMThreadStackUsage;
 };
@@ -525,6 +792,7 @@ string doQueueReloadLuaScript(vector<string>::const_iterator begin, vector<strin
 void parseACLs();
 extern RecursorStats g_stats;
 extern unsigned int g_numThreads;
+extern __thread unsigned int t_id;
 
 
 
@@ -551,5 +819,6 @@ uint64_t* pleaseGetThrottleSize();
 uint64_t* pleaseGetPacketCacheHits();
 uint64_t* pleaseGetPacketCacheSize();
 uint64_t* pleaseWipeCache(const std::string& canon);
+uint64_t* pleaseGetPooledSockets();
 
 #endif
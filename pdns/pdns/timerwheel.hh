@@ -0,0 +1,164 @@
+#ifndef PDNS_TIMERWHEEL_HH
+#define PDNS_TIMERWHEEL_HH
+#include <inttypes.h>
+#include <boost/utility.hpp>
+
+/* Hierarchical timing wheel, as described by Varghese and Lauck. Timers are kept in four levels of 256 slots,
+   the first level holding the timers that expire within 256 ticks, the second those within 65536 ticks and so on.
+   Adding and removing a timer is O(1), and so is advancing one tick: whenever the first level wraps around, the
+   next slot of the level above is cascaded down.
+
+   Timers are intrusive, the owner derives from TimerWheel::Timer (and may do so const, all members are mutable)
+   and must remove() it before it goes away. Expired timers are moved to a list, to be taken off one at a time with
+   popExpired(), so whatever the owner does in between, like adding or removing other timers, is safe. */
+
+class TimerWheel : public boost::noncopyable
+{
+public:
+  struct Timer
+  {
+    Timer() : d_prev(0), d_next(0), d_expire(0)
+    {}
+
+    bool isActive() const
+    {
+      return d_next != 0;
+    }
+
+    mutable const Timer* d_prev;
+    mutable const Timer* d_next;
+    mutable uint64_t d_expire;   //!< in ticks
+  };
+
+  TimerWheel() : d_current(0), d_count(0)
+  {
+    for(unsigned int l=0; l < s_levels; ++l)
+      for(unsigned int n=0; n < s_slots; ++n)
+        initList(d_wheel[l][n]);
+    initList(d_expired);
+  }
+
+  //! arms t to expire at tick expire, now is the current tick
+  void add(const Timer* t, uint64_t expire, uint64_t now)
+  {
+    if(!d_count && d_current < now) // nothing in the wheel, no need to tick our way up
+      d_current=now;
+    t->d_expire=expire;
+    place(t);
+    d_count++;
+  }
+
+  void remove(const Timer* t)
+  {
+    if(!t->isActive())
+      return;
+    unlink(t);
+    d_count--;
+  }
+
+  //! moves whatever expired up to and including tick now to the expired list
+  void advance(uint64_t now)
+  {
+    if(!d_count) {
+      if(d_current < now)
+        d_current=now;
+      return;
+    }
+    while(d_current < now) {
+      d_current++;
+      unsigned int idx=d_current & s_mask;
+      if(!idx)
+        cascade(1);
+      spliceExpired(d_wheel[0][idx]);
+    }
+  }
+
+  //! takes an expired timer off the list, 0 if there is none
+  const Timer* popExpired()
+  {
+    if(d_expired.d_next == &d_expired)
+      return 0;
+    const Timer* t=d_expired.d_next;
+    unlink(t);
+    d_count--;
+    return t;
+  }
+
+  //! number of timers, both armed and expired
+  unsigned int size() const
+  {
+    return d_count;
+  }
+
+private:
+  static const unsigned int s_levels=4, s_bits=8, s_slots=1<<s_bits, s_mask=s_slots-1;
+
+  static void initList(Timer& head)
+  {
+    head.d_prev=head.d_next=&head;
+  }
+
+  static void unlink(const Timer* t)
+  {
+    t->d_prev->d_next=t->d_next;
+    t->d_next->d_prev=t->d_prev;
+    t->d_prev=t->d_next=0;
+  }
+
+  static void append(Timer& head, const Timer* t)
+  {
+    t->d_prev=head.d_prev;
+    t->d_next=&head;
+    head.d_prev->d_next=t;
+    head.d_prev=t;
+  }
+
+  //! puts t in the lowest level that shares all higher bits with the current tick
+  void place(const Timer* t)
+  {
+    if(t->d_expire <= d_current) {
+      append(d_expired, t);
+      return;
+    }
+    for(unsigned int l=0; l < s_levels; ++l) {
+      unsigned int shift=s_bits*(l+1);
+      if((t->d_expire >> shift) == (d_current >> shift)) {
+        append(d_wheel[l][(t->d_expire >> (s_bits*l)) & s_mask], t);
+        return;
+      }
+    }
+    // too far out, park it in the last slot of the top level, it will be placed again when that comes around
+    append(d_wheel[s_levels-1][((d_current >> (s_bits*(s_levels-1))) - 1) & s_mask], t);
+  }
+
+  void cascade(unsigned int level)
+  {
+    if(level == s_levels)
+      return;
+    unsigned int idx=(d_current >> (s_bits*level)) & s_mask;
+    if(!idx)
+      cascade(level+1);
+    Timer& head=d_wheel[level][idx];
+    while(head.d_next != &head) {
+      const Timer* t=head.d_next;
+      unlink(t);
+      place(t);
+    }
+  }
+
+  void spliceExpired(Timer& head)
+  {
+    while(head.d_next != &head) {
+      const Timer* t=head.d_next;
+      unlink(t);
+      append(d_expired, t);
+    }
+  }
+
+  Timer d_wheel[s_levels][s_slots];
+  Timer d_expired;
+  uint64_t d_current;
+  unsigned int d_count;
+};
+
+#endif